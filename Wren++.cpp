@@ -1,18 +1,345 @@
 #include "Wren++.h"
+#include <algorithm>
 #include <cstdlib> // for malloc
 #include <cstring> // for strcmp, memcpy
 #include <cassert>
+#include <chrono>
+#include <cstdint> // for SIZE_MAX
+#include <cstddef> // for max_align_t
+#include <cstdio>  // for snprintf
+#include <deque>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+#if defined(_WIN32)
+#include <malloc.h> // for _msize
+#elif defined(__APPLE__)
+#include <malloc/malloc.h> // for malloc_size
+#else
+#include <malloc.h> // for malloc_usable_size
+#endif
+#ifndef _WIN32
+#include <fcntl.h>    // for open
+#include <sys/mman.h> // for mmap, munmap
+#include <unistd.h>   // for close, sysconf
+#endif
+
+namespace wrenpp
+{
+namespace detail
+{
+// The allocator and statistics of a single VM. Wren++ also decides when the VM collects
+// garbage, following Wren's own policy, so that every collection can be timed.
+struct Heap
+{
+    AllocatorFn fn;
+    void* userData{nullptr};
+    // null until the VM is fully constructed, and again once it's being freed
+    WrenVM* vm{nullptr};
+    // Without a Config allocator, blocks come straight from realloc and carry no header. The heap
+    // then counts the sizes the system allocator reports for them.
+    bool headerless{false};
+    std::size_t minHeapSize{0u};
+    int heapGrowthPercent{0};
+    // a collection is triggered when an allocation would take liveBytes past this
+    std::size_t threshold{0u};
+    bool collecting{false};
+    HeapStats stats{};
+
+    // what VM::idle and the GcScheduler go by
+    GcScheduler* scheduler{nullptr};
+    bool idling{false};
+    std::uint64_t allocatedAtLastIdle{0u};
+    // the bytes allocated between two idle windows, on average
+    double windowGrowth{0.0};
+    // the cost of a collection, per byte of heap, on average. Zero until one has been timed.
+    double pausePerByte{0.0};
+    // the live bytes right after the last collection, and the most that has been
+    std::size_t settledBytes{0u};
+    std::size_t maxSettledBytes{0u};
+    double maxWindowGrowth{0.0};
+};
+} // namespace detail
+} // namespace wrenpp
 
 namespace
 {
+using KeyParts = std::initializer_list<const char*>;
+
+// FNV-1a over each part of the key, with the terminating null included so that the part
+// boundaries contribute to the hash. No qualified string is ever built.
+std::uint64_t hashKey(KeyParts parts)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const char* part : parts)
+    {
+        do
+        {
+            hash ^= std::uint8_t(*part);
+            hash *= 1099511628211ull;
+        } while (*part++ != '\0');
+    }
+    return hash;
+}
+
+/*
+ * Maps a (module, class, ...) key to the bound value. Bindings are appended to a flat list
+ * while the module contexts are being built, and the list is frozen into an open addressing
+ * table the next time Wren asks for a binding. Lookups compare the full key, so two signatures
+ * with the same hash can never resolve to the wrong binding, and they don't allocate.
+ */
+template<typename T>
+class BindingTable
+{
+public:
+    void insert(KeyParts parts, T value)
+    {
+        Entry entry{hashKey(parts), std::uint32_t(keys_.size()), 0u, value};
+        for (const char* part : parts)
+        {
+            keys_.append(part);
+            keys_.push_back('\0');
+        }
+        entry.keyLength = std::uint32_t(keys_.size()) - entry.keyOffset;
+        entries_.push_back(entry);
+        // a late registration thaws the table, it will be rebuilt on the next lookup
+        slots_.clear();
+    }
+
+    const T* find(KeyParts parts)
+    {
+        if (slots_.empty())
+        {
+            if (entries_.empty())
+            {
+                return nullptr;
+            }
+            freeze();
+        }
+
+        const std::uint64_t hash = hashKey(parts);
+        const std::size_t mask = slots_.size() - 1u;
+        for (std::size_t i = std::size_t(hash) & mask;; i = (i + 1u) & mask)
+        {
+            const std::uint32_t index = slots_[i];
+            if (index == 0u)
+            {
+                return nullptr;
+            }
+            const Entry& entry = entries_[index - 1u];
+            if (entry.hash == hash && keyEquals(entry, parts))
+            {
+                return &entry.value;
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        std::uint64_t hash;
+        std::uint32_t keyOffset;
+        std::uint32_t keyLength;
+        T value;
+    };
+
+    bool keyEquals(const Entry& entry, KeyParts parts) const
+    {
+        const char* key = keys_.data() + entry.keyOffset;
+        const char* end = key + entry.keyLength;
+        for (const char* part : parts)
+        {
+            while (key != end && *part != '\0' && *key == *part)
+            {
+                ++key;
+                ++part;
+            }
+            if (key == end || *part != '\0' || *key != '\0')
+            {
+                return false;
+            }
+            ++key;
+        }
+        return key == end;
+    }
+
+    bool keyEquals(const Entry& lhs, const Entry& rhs) const
+    {
+        return lhs.hash == rhs.hash && lhs.keyLength == rhs.keyLength &&
+               std::memcmp(
+                   keys_.data() + lhs.keyOffset, keys_.data() + rhs.keyOffset, lhs.keyLength) ==
+                   0;
+    }
+
+    void freeze()
+    {
+        // keep the load factor at or below one half, so that probe sequences stay short
+        std::size_t capacity = 8u;
+        while (capacity < 2u * entries_.size())
+        {
+            capacity *= 2u;
+        }
+        slots_.assign(capacity, 0u);
+
+        const std::size_t mask = capacity - 1u;
+        for (std::uint32_t index = 0u; index < entries_.size(); ++index)
+        {
+            const Entry& entry = entries_[index];
+            std::size_t i = std::size_t(entry.hash) & mask;
+            // the first registration of a signature wins, like it did with the old hash map
+            while (slots_[i] != 0u && !keyEquals(entries_[slots_[i] - 1u], entry))
+            {
+                i = (i + 1u) & mask;
+            }
+            if (slots_[i] == 0u)
+            {
+                slots_[i] = index + 1u;
+            }
+        }
+    }
+
+    std::string keys_{};
+    std::vector<Entry> entries_{};
+    // indices into entries_, offset by one so that zero marks an empty slot
+    std::vector<std::uint32_t> slots_{};
+};
+
+#ifdef WRENPP_PROFILE_BINDINGS
+// The calls made to one binding, which Wren calls through the trampoline of the same index.
+struct ProfileRecord
+{
+    WrenForeignMethodFn fn;
+    std::string module;
+    std::string className;
+    std::string signature;
+    bool isStatic;
+    std::uint64_t calls;
+    std::chrono::nanoseconds totalTime;
+    std::chrono::nanoseconds maxTime;
+};
+
+struct BindingProfiler
+{
+    bool enabled{false};
+    std::vector<ProfileRecord> records{};
+    // record indices by binding key, so that a binding which Wren looks up again keeps its record
+    std::unordered_map<std::string, std::uint32_t> indices{};
+    // the bindings looked up once every trampoline was taken
+    std::size_t unprofiled{0u};
+};
+
+// Each profiled binding needs a trampoline compiled in, so there's a fixed number of them. Bindings
+// past this many are called directly, and not profiled.
+#ifndef WRENPP_PROFILED_BINDINGS
+#define WRENPP_PROFILED_BINDINGS 4096
+#endif
+constexpr std::size_t ProfiledBindings = WRENPP_PROFILED_BINDINGS;
+
+// the index of a binding which isn't profiled
+constexpr std::uint32_t Unprofiled = ~std::uint32_t(0u);
+#endif
+
 struct BoundState
 {
-    std::unordered_map<std::size_t, WrenForeignMethodFn> methods{};
-    std::unordered_map<std::size_t, WrenForeignClassMethods> classes{};
+    BindingTable<WrenForeignMethodFn> methods{};
+    BindingTable<WrenForeignClassMethods> classes{};
+    // handles to the bound classes, indexed by type id
+    std::vector<WrenHandle*> classHandles{};
+    wrenpp::detail::Heap heap{};
+    wrenpp::ModuleLoader* moduleLoader{nullptr};
+    const wrenpp::ModuleBundle* moduleBundle{nullptr};
+    wrenpp::FiberScheduler* fiberScheduler{nullptr};
+    // set when the first Channel or Serializer declares ValueTokens
+    WrenHandle* valueTokens{nullptr};
+    WrenHandle* flattenValue{nullptr};
+    WrenHandle* rebuildValue{nullptr};
+    // set by bindChannels
+    WrenHandle* channelClass{nullptr};
+    WrenHandle* deliverMessage{nullptr};
+    // the channels the VM listens on, with their handlers
+    std::vector<std::pair<wrenpp::Channel*, WrenHandle*>> inbound{};
+#ifdef WRENPP_PROFILE_BINDINGS
+    BindingProfiler profiler{};
+#endif
 };
 
+#ifdef WRENPP_PROFILE_BINDINGS
+void callProfiled(WrenVM* vm, std::size_t index)
+{
+    BindingProfiler& profiler = static_cast<BoundState*>(wrenGetUserData(vm))->profiler;
+    const WrenForeignMethodFn fn = profiler.records[index].fn;
+    if (!profiler.enabled)
+    {
+        fn(vm);
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    fn(vm);
+    const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+    // the call may have bound more methods, and moved the records
+    ProfileRecord& record = profiler.records[index];
+    ++record.calls;
+    record.totalTime += elapsed;
+    record.maxTime = std::max(record.maxTime, elapsed);
+}
+
+// Wren passes nothing but the VM to a foreign method, so each record gets its own trampoline.
+template<std::size_t Index>
+void profiledCall(WrenVM* vm)
+{
+    callProfiled(vm, Index);
+}
+
+template<std::size_t... Index>
+std::array<WrenForeignMethodFn, sizeof...(Index)> makeProfiledCalls(std::index_sequence<Index...>)
+{
+    return {{&profiledCall<Index>...}};
+}
+
+const std::array<WrenForeignMethodFn, ProfiledBindings> profiledCalls =
+    makeProfiledCalls(std::make_index_sequence<ProfiledBindings>{});
+
+WrenForeignMethodFn profiledBinding(
+    BindingProfiler& profiler,
+    const char* module,
+    const char* className,
+    bool isStatic,
+    const char* signature,
+    WrenForeignMethodFn fn)
+{
+    std::string key = module;
+    key.append(1u, '\0').append(className).append(1u, '\0').append(signature);
+    key.append(isStatic ? "s" : "");
+    auto it = profiler.indices.find(key);
+    if (it == profiler.indices.end())
+    {
+        if (profiler.records.size() == ProfiledBindings)
+        {
+            profiler.indices.emplace(key, Unprofiled);
+            ++profiler.unprofiled;
+            return fn;
+        }
+        it = profiler.indices.emplace(key, std::uint32_t(profiler.records.size())).first;
+        profiler.records.push_back(ProfileRecord{
+            fn,
+            module,
+            className,
+            signature,
+            isStatic,
+            0u,
+            std::chrono::nanoseconds::zero(),
+            std::chrono::nanoseconds::zero()});
+    }
+    return it->second == Unprofiled ? fn : profiledCalls[it->second];
+}
+#endif
+
 WrenForeignMethodFn foreignMethodProvider(
     WrenVM* vm,
     const char* module,
@@ -21,26 +348,30 @@ WrenForeignMethodFn foreignMethodProvider(
     const char* signature)
 {
     auto* boundState = (BoundState*)wrenGetUserData(vm);
-    auto it = boundState->methods.find(
-        wrenpp::detail::hashMethodSignature(module, className, isStatic, signature));
-    if (it == boundState->methods.end())
+    const WrenForeignMethodFn* method =
+        boundState->methods.find({module, className, signature, isStatic ? "s" : ""});
+    if (method == nullptr)
     {
         return NULL;
     }
 
-    return it->second;
+#ifdef WRENPP_PROFILE_BINDINGS
+    return profiledBinding(boundState->profiler, module, className, isStatic, signature, *method);
+#else
+    return *method;
+#endif
 }
 
 WrenForeignClassMethods foreignClassProvider(WrenVM* vm, const char* m, const char* c)
 {
     auto* boundState = (BoundState*)wrenGetUserData(vm);
-    auto it = boundState->classes.find(wrenpp::detail::hashClassSignature(m, c));
-    if (it == boundState->classes.end())
+    const WrenForeignClassMethods* methods = boundState->classes.find({m, c});
+    if (methods == nullptr)
     {
         return WrenForeignClassMethods{nullptr, nullptr};
     }
 
-    return it->second;
+    return *methods;
 }
 
 inline const char* errorTypeToString(WrenErrorType type)
@@ -54,264 +385,3145 @@ inline const char* errorTypeToString(WrenErrorType type)
     }
 }
 
-char* loadModuleFnWrapper(WrenVM* vm, const char* mod) { return wrenpp::VM::loadModuleFn(mod); }
-
-void writeFnWrapper(WrenVM* vm, const char* text) { wrenpp::VM::writeFn(text); }
-
-void errorFnWrapper(WrenVM*, WrenErrorType type, const char* module, int line, const char* message)
+void abortFiber(WrenVM* vm, const char* message)
 {
-    wrenpp::VM::errorFn(type, module, line, message);
+    wrenSetSlotString(vm, 0, message);
+    wrenAbortFiber(vm, 0);
 }
 
-void* reallocateFnWrapper(void* memory, std::size_t newSize)
+// reads the index in slot 1, aborting the fiber if it is not within the array
+template<typename T>
+bool typedArrayIndex(WrenVM* vm, const wrenpp::TypedArray<T>& array, std::size_t& index)
 {
-    return wrenpp::VM::reallocateFn(memory, newSize);
+    const double i = wrenGetSlotDouble(vm, 1);
+    if (!(i >= 0.0 && i < double(array.count())) || i != double(std::size_t(i)))
+    {
+        abortFiber(vm, "Subscript out of bounds.");
+        return false;
+    }
+    index = std::size_t(i);
+    return true;
 }
-} // namespace
 
-namespace wrenpp
-{
-namespace detail
-{
-void registerFunction(
-    WrenVM* vm,
-    const std::string& mod,
-    const std::string& cName,
-    bool isStatic,
-    std::string sig,
-    WrenForeignMethodFn function)
+template<typename T>
+void typedArrayCount(WrenVM* vm)
 {
-    BoundState* boundState = (BoundState*)wrenGetUserData(vm);
-    std::size_t hash =
-        detail::hashMethodSignature(mod.c_str(), cName.c_str(), isStatic, sig.c_str());
-    boundState->methods.insert(std::make_pair(hash, function));
+    const auto* array = wrenpp::getSlotForeign<wrenpp::TypedArray<T>>(vm, 0);
+    wrenSetSlotDouble(vm, 0, double(array->count()));
 }
 
-void registerClass(
-    WrenVM* vm,
-    const std::string& mod,
-    std::string cName,
-    WrenForeignClassMethods methods)
+template<typename T>
+void typedArrayGet(WrenVM* vm)
 {
-    BoundState* boundState = (BoundState*)wrenGetUserData(vm);
-    std::size_t hash = detail::hashClassSignature(mod.c_str(), cName.c_str());
-    boundState->classes.insert(std::make_pair(hash, methods));
+    const auto* array = wrenpp::getSlotForeign<wrenpp::TypedArray<T>>(vm, 0);
+    std::size_t index;
+    if (typedArrayIndex(vm, *array, index))
+    {
+        wrenSetSlotDouble(vm, 0, double((*array)[index]));
+    }
 }
-} // namespace detail
-
-Value null = Value();
-
-Value::Value(bool val) : type_{WREN_TYPE_BOOL}, string_{nullptr} { set(val); }
 
-Value::Value(float val) : type_{WREN_TYPE_NUM}, string_{nullptr} { set(val); }
-
-Value::Value(double val) : type_{WREN_TYPE_NUM}, string_{nullptr} { set(val); }
-
-Value::Value(int val) : type_{WREN_TYPE_NUM}, string_{nullptr} { set(val); }
-
-Value::Value(unsigned int val) : type_{WREN_TYPE_NUM}, string_{nullptr} { set(val); }
+template<typename T>
+void typedArraySet(WrenVM* vm)
+{
+    auto* array = wrenpp::getSlotForeign<wrenpp::TypedArray<T>>(vm, 0);
+    std::size_t index;
+    if (typedArrayIndex(vm, *array, index))
+    {
+        (*array)[index] = T(wrenGetSlotDouble(vm, 2));
+        // assignment evaluates to the assigned value
+        wrenSetSlotDouble(vm, 0, double((*array)[index]));
+    }
+}
 
-Value::Value(const char* str) : type_{WREN_TYPE_STRING}, string_{nullptr}
+void sharedBufferByteCount(WrenVM* vm)
 {
-    string_ = (char*)VM::reallocateFn(nullptr, std::strlen(str) + 1);
-    std::strcpy(string_, str);
+    const auto* buffer = wrenpp::getSlotForeign<wrenpp::SharedBuffer>(vm, 0);
+    wrenSetSlotDouble(vm, 0, double(buffer->size()));
 }
 
-Value::~Value()
+template<typename T>
+void sharedBufferRead(WrenVM* vm)
 {
-    if (string_)
+    const auto* buffer = wrenpp::getSlotForeign<wrenpp::SharedBuffer>(vm, 0);
+    const double i = wrenGetSlotDouble(vm, 1);
+    if (!(i >= 0.0 && i < double(buffer->count<T>())) || i != double(std::size_t(i)))
     {
-        VM::reallocateFn(string_, 0u);
+        abortFiber(vm, "Subscript out of bounds.");
+        return;
     }
+    wrenSetSlotDouble(vm, 0, double(buffer->read<T>(std::size_t(i))));
 }
 
-Method::Method(VM* vm, WrenHandle* variable, WrenHandle* method)
-    : vm_(vm), method_(method), variable_(variable)
+void publishedBufferCurrent(WrenVM* vm)
 {
+    const auto* published = wrenpp::getSlotForeign<wrenpp::PublishedBuffer>(vm, 0);
+    wrenpp::emplaceSlotForeignValue<wrenpp::SharedBuffer>(vm, 0, published->current());
 }
 
-Method::Method(Method&& other) : vm_(other.vm_), method_(other.method_), variable_(other.variable_)
+void publishedBufferVersion(WrenVM* vm)
 {
-    other.vm_ = nullptr;
-    other.method_ = nullptr;
-    other.variable_ = nullptr;
+    const auto* published = wrenpp::getSlotForeign<wrenpp::PublishedBuffer>(vm, 0);
+    wrenSetSlotDouble(vm, 0, double(published->version()));
 }
 
-Method::~Method()
-{
-    if (vm_)
-    {
-        assert(method_ && variable_);
-        wrenReleaseHandle(vm_->ptr(), method_);
-        wrenReleaseHandle(vm_->ptr(), variable_);
-    }
-}
+const char* const SharedBufferSource =
+    "foreign class SharedBuffer {\n"
+    "  foreign byteCount\n"
+    "  foreign uint8(index)\n"
+    "  foreign int32(index)\n"
+    "  foreign float32(index)\n"
+    "  foreign float64(index)\n"
+    "}\n"
+    "foreign class PublishedBuffer {\n"
+    "  foreign current\n"
+    "  foreign version\n"
+    "}\n";
 
-Method& Method::operator=(Method&& rhs)
+template<typename T>
+void bindTypedArray(wrenpp::ModuleContext& module, const std::string& className)
 {
-    if (&rhs != this)
-    {
-        vm_ = rhs.vm_;
-        method_ = rhs.method_;
-        variable_ = rhs.variable_;
-        rhs.vm_ = nullptr;
-        rhs.method_ = nullptr;
-        rhs.variable_ = nullptr;
-    }
-
-    return *this;
+    using Array = wrenpp::TypedArray<T>;
+    module.bindClass<Array, unsigned>(className)
+        .bindCFunction(false, "count", typedArrayCount<T>)
+        .bindCFunction(false, "[_]", typedArrayGet<T>)
+        .bindCFunction(false, "[_]=(_)", typedArraySet<T>)
+        .template bindMethod<decltype(&Array::fill), &Array::fill>(false, "fill(_)")
+        .template bindMethod<decltype(&Array::copy), &Array::copy>(false, "copy(_)")
+        .template bindMethod<decltype(&Array::sum), &Array::sum>(false, "sum")
+        .template bindMethod<decltype(&Array::scale), &Array::scale>(false, "scale(_)")
+        .template bindMethod<decltype(&Array::axpy), &Array::axpy>(false, "axpy(_,_)")
+        .template bindMethod<decltype(&Array::min), &Array::min>(false, "min")
+        .template bindMethod<decltype(&Array::max), &Array::max>(false, "max")
+        .template bindMethod<decltype(&Array::toVector), &Array::toVector>(false, "toList");
 }
 
-ClassContext ModuleContext::beginClass(std::string c) { return ClassContext(c, *this); }
+using wrenpp::detail::ForeignHooks;
 
-void ModuleContext::endModule() {}
+// The format of Serializer and of Channel messages, which start with this version byte. The
+// value follows, as a type byte and its payload. Counts and lengths are unsigned LEB128 varints,
+// and other numbers little-endian doubles, so the bytes read the same on any host.
+constexpr char SerializedVersion = 2;
 
-ModuleContext& ClassContext::endClass() { return module_; }
+enum SerializedType : char
+{
+    SerializedNull = 'n',
+    SerializedTrue = 't',
+    SerializedFalse = 'f',
+    // a number which is a whole number of at most 53 bits, as a zigzag encoded varint
+    SerializedInteger = 'i',
+    // any other number, as the bits of the double, least significant byte first
+    SerializedNumber = 'd',
+    SerializedString = 's',
+    // the element count, followed by the elements
+    SerializedList = 'l',
+    // the entry count, followed by the keys and values in turn
+    SerializedMap = 'm',
+    // the list or map written n-th, counting from zero in the order they start
+    SerializedReference = 'r',
+    // the class name, then the length and bytes the foreign hook wrote
+    SerializedForeign = 'o',
+};
 
-ClassContext::ClassContext(std::string c, ModuleContext& mod) : module_(mod), class_(c) {}
+// The tags of the tokens which ValueTokens flattens a list or map into, each followed by its
+// payload. An object which isn't a number, string, boolean or null is tagged with its class name.
+enum ValueToken
+{
+    TokenValue = 0,
+    TokenList = 1,
+    TokenMap = 2,
+    TokenReference = 3,
+};
 
-ClassContext& ClassContext::bindCFunction(
-    bool isStatic,
-    std::string signature,
-    WrenForeignMethodFn function)
+void appendVarint(std::string& out, std::uint64_t value)
 {
-    detail::registerFunction(module_.vm_, module_.name_, class_, isStatic, signature, function);
-    return *this;
+    while (value >= 0x80u)
+    {
+        out += char(std::uint8_t(value) | 0x80u);
+        value >>= 7;
+    }
+    out += char(value);
 }
 
-/*
- * Returns the source as a heap-allocated string.
- * Uses malloc, because our reallocateFn is set to default:
- * it uses malloc, realloc and free.
- * */
-LoadModuleFn VM::loadModuleFn = [](const char* mod) -> char* {
-    std::string path(mod);
-    path += ".wren";
-    std::string source;
-    try
+void appendSerializedNumber(std::string& out, double number)
+{
+    const double limit = 9007199254740992.0; // 2^53
+    if (number >= -limit && number <= limit && number == std::floor(number) &&
+        !(number == 0.0 && std::signbit(number)))
     {
-        source = wrenpp::detail::fileToString(path);
+        const std::int64_t integer = std::int64_t(number);
+        out += SerializedInteger;
+        appendVarint(out, (std::uint64_t(integer) << 1) ^ std::uint64_t(integer >> 63));
+        return;
     }
-    catch (const std::exception&)
+    // the bits of the double, least significant byte first, whatever the host's byte order
+    std::uint64_t bits;
+    std::memcpy(&bits, &number, sizeof(bits));
+    out += SerializedNumber;
+    for (unsigned shift = 0u; shift < 64u; shift += 8u)
     {
-        return NULL;
+        out += char(std::uint8_t(bits >> shift));
     }
-    char* buffer = (char*)malloc(source.size());
-    assert(buffer != nullptr);
-    memcpy(buffer, source.c_str(), source.size());
-    return buffer;
+}
+
+void appendSerializedBytes(std::string& out, const char* bytes, std::size_t length)
+{
+    appendVarint(out, length);
+    out.append(bytes, length);
+}
+
+// Thrown for bytes which aren't in the format, or hold a foreign object without a hook.
+struct FormatError : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
 };
 
-WriteFn VM::writeFn = [](const char* text) -> void { std::cout << text; };
+struct SerializedReader
+{
+    const char* at;
+    const char* end;
 
-ErrorFn VM::errorFn =
-    [](WrenErrorType type, const char* module_name, int line, const char* message) -> void {
-    const char* typeStr = errorTypeToString(type);
-    if (module_name)
+    void need(std::size_t size) const
     {
-        std::cout << typeStr << " in " << module_name << ":" << line << "> " << message
-                  << std::endl;
+        if (std::size_t(end - at) < size)
+        {
+            throw FormatError("the bytes are truncated");
+        }
     }
-    else
+
+    char byte()
     {
-        std::cout << typeStr << "> " << message << std::endl;
+        need(1u);
+        return *at++;
     }
-};
-
-ReallocateFn VM::reallocateFn = std::realloc;
 
-std::size_t VM::initialHeapSize = 0xA00000u;
+    std::uint64_t varint()
+    {
+        std::uint64_t value = 0u;
+        for (unsigned shift = 0u; shift < 64u; shift += 7u)
+        {
+            const std::uint8_t b = std::uint8_t(byte());
+            value |= std::uint64_t(b & 0x7Fu) << shift;
+            if ((b & 0x80u) == 0u)
+            {
+                return value;
+            }
+        }
+        throw FormatError("a count is malformed");
+    }
 
-std::size_t VM::minHeapSize = 0x100000u;
+    double number()
+    {
+        need(8u);
+        std::uint64_t bits = 0u;
+        for (unsigned shift = 0u; shift < 64u; shift += 8u)
+        {
+            bits |= std::uint64_t(std::uint8_t(*at++)) << shift;
+        }
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
 
-int VM::heapGrowthPercent = 50;
+    // a length, and that many bytes
+    std::pair<const char*, std::size_t> bytes()
+    {
+        const std::uint64_t length = varint();
+        need(length);
+        const char* start = at;
+        at += length;
+        return {start, std::size_t(length)};
+    }
+};
 
-std::size_t VM::chunkSize = 0x500000u;
+const char* const UnsupportedValue = "only numbers, strings, booleans, null, lists, maps and "
+                                     "registered foreign objects can be serialized";
 
-VM::VM() : vm_{nullptr}
+bool writeScalar(WrenVM* vm, int slot, std::string& out)
 {
-    WrenConfiguration configuration{};
-    wrenInitConfiguration(&configuration);
-    configuration.reallocateFn = reallocateFnWrapper;
-    configuration.initialHeapSize = initialHeapSize;
-    configuration.minHeapSize = minHeapSize;
-    configuration.heapGrowthPercent = heapGrowthPercent;
-    configuration.bindForeignMethodFn = foreignMethodProvider;
-    configuration.loadModuleFn = loadModuleFnWrapper;
-    configuration.bindForeignClassFn = foreignClassProvider;
-    configuration.writeFn = writeFnWrapper;
-    configuration.errorFn = errorFnWrapper;
-    configuration.userData = new BoundState();
-
-    vm_ = wrenNewVM(&configuration);
+    switch (wrenGetSlotType(vm, slot))
+    {
+    case WREN_TYPE_NULL: out += SerializedNull; return true;
+    case WREN_TYPE_BOOL:
+        out += wrenGetSlotBool(vm, slot) ? SerializedTrue : SerializedFalse;
+        return true;
+    case WREN_TYPE_NUM: appendSerializedNumber(out, wrenGetSlotDouble(vm, slot)); return true;
+    case WREN_TYPE_STRING:
+    {
+        int length = 0;
+        const char* bytes = wrenGetSlotBytes(vm, slot, &length);
+        out += SerializedString;
+        appendSerializedBytes(out, bytes, std::size_t(length));
+        return true;
+    }
+    default: return false;
+    }
 }
 
-VM::VM(VM&& other) : vm_{other.vm_} { other.vm_ = nullptr; }
-
-VM& VM::operator=(VM&& rhs)
+// Writes the object in the slot, of the class named in the slot before it, with its hook.
+std::string writeForeign(WrenVM* vm, int slot, std::string& out, const ForeignHooks* hooks)
 {
-    if (&rhs != this)
+    if (hooks == nullptr || wrenGetSlotType(vm, slot) != WREN_TYPE_FOREIGN)
     {
-        vm_ = rhs.vm_;
-        rhs.vm_ = nullptr;
+        return UnsupportedValue;
     }
-    return *this;
+    int length = 0;
+    const char* name = wrenGetSlotBytes(vm, slot - 1, &length);
+    const std::string className(name, std::size_t(length));
+    auto hook = hooks->find(className);
+    if (hook == hooks->end())
+    {
+        return "no foreign hook registered for " + className;
+    }
+    std::string bytes;
+    hook->second.save(vm, slot, bytes);
+    out += SerializedForeign;
+    appendSerializedBytes(out, className.data(), className.size());
+    appendSerializedBytes(out, bytes.data(), bytes.size());
+    return std::string();
 }
 
-VM::~VM()
+// Writes the value in the slot, which is a number, string, boolean or null, or the tokens which
+// ValueTokens.flatten turned a value into. Uses the next two slots. Returns what's wrong with the
+// value, or nothing.
+std::string writeValue(WrenVM* vm, int slot, std::string& out, const ForeignHooks* hooks)
 {
-    if (vm_ != nullptr)
+    out += SerializedVersion;
+    if (wrenGetSlotType(vm, slot) != WREN_TYPE_LIST)
+    {
+        return writeScalar(vm, slot, out) ? std::string() : UnsupportedValue;
+    }
+    wrenEnsureSlots(vm, slot + 3);
+    const int count = wrenGetListCount(vm, slot);
+    for (int i = 0; i + 1 < count; i += 2)
     {
-        delete (BoundState*)wrenGetUserData(vm_);
-        wrenFreeVM(vm_);
+        wrenGetListElement(vm, slot, i, slot + 1);
+        wrenGetListElement(vm, slot, i + 1, slot + 2);
+        if (wrenGetSlotType(vm, slot + 1) != WREN_TYPE_NUM)
+        {
+            std::string error = writeForeign(vm, slot + 2, out, hooks);
+            if (!error.empty())
+            {
+                return error;
+            }
+            continue;
+        }
+        const int tag = int(wrenGetSlotDouble(vm, slot + 1));
+        if (tag == TokenValue)
+        {
+            if (!writeScalar(vm, slot + 2, out))
+            {
+                return UnsupportedValue;
+            }
+            continue;
+        }
+        out += tag == TokenList ? SerializedList
+                                : (tag == TokenMap ? SerializedMap : SerializedReference);
+        appendVarint(out, std::uint64_t(wrenGetSlotDouble(vm, slot + 2)));
     }
+    return std::string();
 }
 
-Result VM::executeModule(const std::string& mod)
+// Reads a value which isn't a list or map, of the given type, into the slot.
+void readScalar(
+    WrenVM* vm,
+    int slot,
+    char type,
+    SerializedReader& reader,
+    const ForeignHooks* hooks)
 {
-    const std::string source(loadModuleFn(mod.c_str()));
-    auto res = wrenInterpret(vm_, mod.c_str(), source.c_str());
-
-    if (res == WrenInterpretResult::WREN_RESULT_COMPILE_ERROR)
+    switch (type)
     {
-        return Result::CompileError;
+    case SerializedNull: wrenSetSlotNull(vm, slot); return;
+    case SerializedTrue: wrenSetSlotBool(vm, slot, true); return;
+    case SerializedFalse: wrenSetSlotBool(vm, slot, false); return;
+    case SerializedInteger:
+    {
+        const std::uint64_t zigzag = reader.varint();
+        const std::int64_t integer = std::int64_t(zigzag >> 1) ^ -std::int64_t(zigzag & 1u);
+        wrenSetSlotDouble(vm, slot, double(integer));
+        return;
+    }
+    case SerializedNumber: wrenSetSlotDouble(vm, slot, reader.number()); return;
+    case SerializedString:
+    {
+        const auto string = reader.bytes();
+        wrenSetSlotBytes(vm, slot, string.first, string.second);
+        return;
+    }
+    case SerializedForeign:
+    {
+        const auto name = reader.bytes();
+        const auto object = reader.bytes();
+        const std::string className(name.first, name.second);
+        if (hooks == nullptr || hooks->count(className) == 0u)
+        {
+            throw FormatError("no foreign hook registered for " + className);
+        }
+        hooks->at(className).load(vm, slot, std::string(object.first, object.second));
+        return;
+    }
+    default: throw FormatError("unknown value type");
     }
+}
 
-    if (res == WrenInterpretResult::WREN_RESULT_RUNTIME_ERROR)
+// Reads the bytes into the slot, as the value itself when it isn't a list or map, or else as the
+// tokens which ValueTokens.rebuild turns back into it. Uses the next two slots. Throws
+// FormatError, which mustn't unwind through Wren.
+void readValue(WrenVM* vm, int slot, const std::string& bytes, const ForeignHooks* hooks)
+{
+    SerializedReader reader{bytes.data(), bytes.data() + bytes.size()};
+    if (reader.byte() != SerializedVersion)
     {
-        return Result::RuntimeError;
+        throw FormatError("unknown format version");
+    }
+    wrenEnsureSlots(vm, slot + 3);
+    char type = reader.byte();
+    if (type != SerializedList && type != SerializedMap)
+    {
+        readScalar(vm, slot, type, reader, hooks);
+        return;
     }
 
-    return Result::Success;
+    wrenSetSlotNewList(vm, slot);
+    std::uint64_t containers = 0u;
+    // the values still to read
+    std::uint64_t remaining = 1u;
+    while (true)
+    {
+        if (type == SerializedList || type == SerializedMap)
+        {
+            const std::uint64_t count = reader.varint();
+            const std::uint64_t values = type == SerializedList ? count : count * 2u;
+            // each value takes a byte at least
+            const std::uint64_t left = std::uint64_t(reader.end - reader.at);
+            if (count > left || values > left)
+            {
+                throw FormatError("the bytes are truncated");
+            }
+            wrenSetSlotDouble(vm, slot + 1, type == SerializedList ? TokenList : TokenMap);
+            wrenSetSlotDouble(vm, slot + 2, double(count));
+            remaining += values;
+            ++containers;
+        }
+        else if (type == SerializedReference)
+        {
+            const std::uint64_t index = reader.varint();
+            if (index >= containers)
+            {
+                throw FormatError("a reference is out of range");
+            }
+            wrenSetSlotDouble(vm, slot + 1, TokenReference);
+            wrenSetSlotDouble(vm, slot + 2, double(index));
+        }
+        else
+        {
+            wrenSetSlotDouble(vm, slot + 1, TokenValue);
+            readScalar(vm, slot + 2, type, reader, hooks);
+        }
+        wrenInsertInList(vm, slot, -1, slot + 1);
+        wrenInsertInList(vm, slot, -1, slot + 2);
+        if (--remaining == 0u)
+        {
+            return;
+        }
+        type = reader.byte();
+    }
 }
 
-Result VM::executeString(const std::string& code)
-{
-    auto res = wrenInterpret(vm_, "main", code.c_str());
+// The Wren side of the format, declared once per VM in its own module. flatten turns a list or
+// map into tokens, in one call. Wren's maps only take value types as keys, so the identity table
+// is kept in the lists and maps themselves while walking: each one seen gets a Seen_ holding its
+// index, appended to a list or under the Seen_ key of a map. The walk runs in its own fiber, since
+// an object's is(_) or type may abort it, and the marks are taken out again whether or not it
+// finished. Each open container in rebuild is [container, values still to come, last key]. A map
+// takes a key when an even number of values is still to come, and a value for it when odd.
+const char* const ValueTokensModule = "wrenpp/values";
+const char* const ValueTokensSource =
+    "class Seen_ {\n"
+    "  construct new(index) { _index = index }\n"
+    "  index { _index }\n"
+    "}\n"
+    "class ValueTokens {\n"
+    "  static flatten(value) {\n"
+    "    var tokens = []\n"
+    "    var seen = []\n"
+    "    var walk = Fiber.new { ValueTokens.walk_(value, tokens, seen) }\n"
+    "    walk.try()\n"
+    "    for (item in seen) {\n"
+    "      if (item is List) {\n"
+    "        item.removeAt(-1)\n"
+    "      } else {\n"
+    "        item.remove(Seen_)\n"
+    "      }\n"
+    "    }\n"
+    "    if (walk.error != null) Fiber.abort(walk.error)\n"
+    "    if (!walk.isDone) Fiber.abort(\"A value yielded while it was flattened.\")\n"
+    "    return tokens\n"
+    "  }\n"
+    "  static walk_(value, tokens, seen) {\n"
+    "    var stack = [value]\n"
+    "    while (stack.count > 0) {\n"
+    "      var item = stack.removeAt(-1)\n"
+    "      if (item is List || item is Map) {\n"
+    "        var mark = item is Map ? item[Seen_] : (item.count > 0 ? item[-1] : null)\n"
+    "        if (mark is Seen_) {\n"
+    "          tokens.add(3)\n"
+    "          tokens.add(mark.index)\n"
+    "        } else if (item is List) {\n"
+    "          tokens.add(1)\n"
+    "          tokens.add(item.count)\n"
+    "          var i = item.count - 1\n"
+    "          while (i >= 0) {\n"
+    "            stack.add(item[i])\n"
+    "            i = i - 1\n"
+    "          }\n"
+    "          item.add(Seen_.new(seen.count))\n"
+    "          seen.add(item)\n"
+    "        } else {\n"
+    "          tokens.add(2)\n"
+    "          tokens.add(item.count)\n"
+    "          for (key in item.keys) {\n"
+    "            stack.add(item[key])\n"
+    "            stack.add(key)\n"
+    "          }\n"
+    "          item[Seen_] = Seen_.new(seen.count)\n"
+    "          seen.add(item)\n"
+    "        }\n"
+    "      } else {\n"
+    "        var scalar = item is Num || item is String || item is Bool || item is Null\n"
+    "        tokens.add(scalar ? 0 : item.type.name)\n"
+    "        tokens.add(item)\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "  static rebuild(tokens) {\n"
+    "    var root = null\n"
+    "    var made = []\n"
+    "    var open = []\n"
+    "    var i = 0\n"
+    "    while (i < tokens.count) {\n"
+    "      var tag = tokens[i]\n"
+    "      var value = tokens[i + 1]\n"
+    "      var count = 0\n"
+    "      if (tag == 1 || tag == 2) {\n"
+    "        count = tag == 1 ? value : value * 2\n"
+    "        value = tag == 1 ? [] : {}\n"
+    "        made.add(value)\n"
+    "      } else if (tag == 3) {\n"
+    "        value = made[value]\n"
+    "      }\n"
+    "      if (open.isEmpty) {\n"
+    "        root = value\n"
+    "      } else {\n"
+    "        var top = open[-1]\n"
+    "        if (top[0] is List) {\n"
+    "          top[0].add(value)\n"
+    "        } else if (top[1] % 2 == 0) {\n"
+    "          top[2] = value\n"
+    "        } else {\n"
+    "          top[0][top[2]] = value\n"
+    "        }\n"
+    "        top[1] = top[1] - 1\n"
+    "        if (top[1] == 0) open.removeAt(-1)\n"
+    "      }\n"
+    "      if (count > 0) open.add([value, count, null])\n"
+    "      i = i + 2\n"
+    "    }\n"
+    "    return root\n"
+    "  }\n"
+    "}\n";
 
-    if (res == WrenInterpretResult::WREN_RESULT_COMPILE_ERROR)
+// Declares ValueTokens in the VM, unless it already is.
+bool declareValueTokens(WrenVM* vm)
+{
+    BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+    if (boundState->valueTokens != nullptr)
     {
-        return Result::CompileError;
+        return true;
     }
+    if (wrenInterpret(vm, ValueTokensModule, ValueTokensSource) != WREN_RESULT_SUCCESS)
+    {
+        return false;
+    }
+    wrenEnsureSlots(vm, 1);
+    wrenGetVariable(vm, ValueTokensModule, "ValueTokens", 0);
+    boundState->valueTokens = wrenGetSlotHandle(vm, 0);
+    boundState->flattenValue = wrenMakeCallHandle(vm, "flatten(_)");
+    boundState->rebuildValue = wrenMakeCallHandle(vm, "rebuild(_)");
+    return true;
+}
 
-    if (res == WrenInterpretResult::WREN_RESULT_RUNTIME_ERROR)
+// Parks a fiber until the channel has a message, or room for one.
+class ChannelWait : public wrenpp::detail::AsyncOperation
+{
+public:
+    ChannelWait(const wrenpp::Channel& channel, bool forMessage)
+        : channel_{channel}, forMessage_{forMessage}
     {
-        return Result::RuntimeError;
     }
 
-    return Result::Success;
+    bool ready() const override { return forMessage_ ? !channel_.empty() : !channel_.full(); }
+
+    void setResult(WrenVM* vm, int slot) override { wrenSetSlotNull(vm, slot); }
+
+private:
+    const wrenpp::Channel& channel_;
+    bool forMessage_;
+};
+
+void channelCapacity(WrenVM* vm)
+{
+    const auto* channel = wrenpp::getSlotForeign<wrenpp::Channel>(vm, 0);
+    wrenSetSlotDouble(vm, 0, double(channel->capacity()));
 }
 
-void VM::collectGarbage() { wrenCollectGarbage(vm_); }
+void channelIsEmpty(WrenVM* vm)
+{
+    const auto* channel = wrenpp::getSlotForeign<wrenpp::Channel>(vm, 0);
+    wrenSetSlotBool(vm, 0, channel->empty());
+}
 
-Method VM::method(const std::string& mod, const std::string& var, const std::string& sig)
+void channelIsFull(WrenVM* vm)
 {
-    wrenEnsureSlots(vm_, 1);
-    wrenGetVariable(vm_, mod.c_str(), var.c_str(), 0);
-    WrenHandle* variable = wrenGetSlotHandle(vm_, 0);
-    WrenHandle* handle = wrenMakeCallHandle(vm_, sig.c_str());
-    return Method(this, variable, handle);
+    const auto* channel = wrenpp::getSlotForeign<wrenpp::Channel>(vm, 0);
+    wrenSetSlotBool(vm, 0, channel->full());
 }
 
-ModuleContext VM::beginModule(std::string name) { return ModuleContext(vm_, name); }
+void channelTrySend(WrenVM* vm)
+{
+    auto* channel = wrenpp::getSlotForeign<wrenpp::Channel>(vm, 0);
+    std::string message;
+    if (!writeValue(vm, 1, message, nullptr).empty())
+    {
+        abortFiber(vm, "Channels only send numbers, strings, booleans, null, lists and maps.");
+        return;
+    }
+    wrenSetSlotBool(vm, 0, channel->trySendMessage(std::move(message)));
+}
+
+void channelReceive(WrenVM* vm)
+{
+    auto* channel = wrenpp::getSlotForeign<wrenpp::Channel>(vm, 0);
+    std::string message;
+    if (!channel->tryReceiveMessage(message))
+    {
+        abortFiber(vm, "The channel is empty.");
+        return;
+    }
+    try
+    {
+        readValue(vm, 0, message, nullptr);
+    }
+    catch (const FormatError& error)
+    {
+        abortFiber(vm, (std::string("The message can't be read: ") + error.what()).c_str());
+    }
+}
+
+template<bool ForMessage>
+void channelWait(WrenVM* vm)
+{
+    const auto* channel = wrenpp::getSlotForeign<wrenpp::Channel>(vm, 0);
+    wrenpp::detail::startAsync(vm, std::make_unique<ChannelWait>(*channel, ForMessage));
+}
+
+const char* const ChannelSource =
+    "import \"wrenpp/values\" for ValueTokens\n"
+    "foreign class Channel {\n"
+    "  foreign capacity\n"
+    "  foreign isEmpty\n"
+    "  foreign isFull\n"
+    "  trySend(message) { trySend_(Channel.pack_(message)) }\n"
+    "  send(message) {\n"
+    "    var packed = Channel.pack_(message)\n"
+    "    while (!trySend_(packed)) Fiber.yield(waitForSpace_())\n"
+    "  }\n"
+    "  receive() {\n"
+    "    while (isEmpty) Fiber.yield(waitForMessage_())\n"
+    "    return Channel.unpack_(receive_())\n"
+    "  }\n"
+    "  foreign trySend_(packed)\n"
+    "  foreign receive_()\n"
+    "  foreign waitForSpace_()\n"
+    "  foreign waitForMessage_()\n"
+    "  static pack_(value) { value is List || value is Map ? ValueTokens.flatten(value) : value }\n"
+    "  static unpack_(value) { value is List ? ValueTokens.rebuild(value) : value }\n"
+    "  static deliver_(handler, message) { handler.call(unpack_(message)) }\n"
+    "}\n";
+
+std::string typedArrayDeclaration(const char* className)
+{
+    std::string declaration("foreign class ");
+    declaration += className;
+    declaration +=
+        " {\n"
+        "  construct new(count) {}\n"
+        "  foreign count\n"
+        "  foreign [index]\n"
+        "  foreign [index]=(value)\n"
+        "  foreign fill(value)\n"
+        "  foreign copy(source)\n"
+        "  foreign sum\n"
+        "  foreign scale(factor)\n"
+        "  foreign axpy(a, x)\n"
+        "  foreign min\n"
+        "  foreign max\n"
+        "  foreign toList\n"
+        "}\n";
+    return declaration;
+}
+
+void writeFnWrapper(WrenVM* vm, const char* text) { wrenpp::VM::writeFn(text); }
+
+void errorFnWrapper(WrenVM*, WrenErrorType type, const char* module, int line, const char* message)
+{
+    wrenpp::VM::errorFn(type, module, line, message);
+}
+
+using wrenpp::detail::Heap;
+
+void* systemReallocate(void* memory, std::size_t, std::size_t newSize, void*)
+{
+    if (newSize == 0u)
+    {
+        std::free(memory);
+        return nullptr;
+    }
+    return std::realloc(memory, newSize);
+}
+
+// for allocations made through a Config allocator while no VM is in scope, which aren't counted
+Heap systemHeap{&systemReallocate};
+
+thread_local Heap* activeHeap = nullptr;
+
+// Precedes every allocation, so that the block can be returned to the heap it came from,
+// whichever VM happens to be in scope when Wren frees it.
+struct alignas(alignof(std::max_align_t)) AllocationHeader
+{
+    Heap* owner;
+    std::size_t size;
+};
+
+// How much weight each new sample gets in the running averages of the idle scheduling
+constexpr double SampleWeight = 0.25;
+
+double average(double current, double sample)
+{
+    return current == 0.0 ? sample : current + SampleWeight * (sample - current);
+}
+
+enum class Collection
+{
+    Implicit,
+    Explicit,
+    Idle
+};
+
+void collect(Heap& heap, Collection kind)
+{
+    wrenpp::HeapStats& stats = heap.stats;
+    const std::size_t heapBytes = stats.liveBytes;
+
+    heap.collecting = true;
+    const auto start = std::chrono::steady_clock::now();
+    wrenCollectGarbage(heap.vm);
+    const auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    heap.collecting = false;
+
+    ++stats.collections;
+    if (kind == Collection::Explicit)
+    {
+        ++stats.explicitCollections;
+    }
+    else if (kind == Collection::Idle)
+    {
+        ++stats.idleCollections;
+    }
+    stats.totalPause += pause;
+    stats.maxPause = std::max(stats.maxPause, pause);
+    heap.threshold = std::max(
+        heap.minHeapSize,
+        stats.liveBytes + stats.liveBytes * std::size_t(heap.heapGrowthPercent) / 100u);
+
+    const double bytes = double(std::max<std::size_t>(heapBytes, 1u));
+    heap.pausePerByte = average(heap.pausePerByte, double(pause.count()) / bytes);
+    heap.settledBytes = stats.liveBytes;
+    heap.maxSettledBytes = std::max(heap.maxSettledBytes, stats.liveBytes);
+}
+
+// Wren collects right before allocating, and so do we. Wren allocates while it collects, so the
+// collection mustn't start another one.
+void collectBefore(Heap& heap, std::size_t oldSize, std::size_t newSize)
+{
+    if (newSize > oldSize && heap.vm != nullptr && !heap.collecting &&
+        heap.stats.liveBytes + (newSize - oldSize) > heap.threshold)
+    {
+        collect(heap, Collection::Implicit);
+    }
+}
+
+void count(Heap& heap, void* memory, std::size_t oldSize, std::size_t newSize)
+{
+    wrenpp::HeapStats& stats = heap.stats;
+    if (memory == nullptr)
+    {
+        ++stats.allocations;
+    }
+    else if (newSize == 0u)
+    {
+        ++stats.frees;
+    }
+    else
+    {
+        ++stats.reallocations;
+    }
+    if (newSize > oldSize)
+    {
+        stats.allocatedBytes += newSize - oldSize;
+    }
+    // a headerless heap may free a block it never counted, which was allocated out of scope
+    stats.liveBytes = stats.liveBytes - std::min(stats.liveBytes, oldSize) + newSize;
+    stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+}
+
+void* reallocateFrom(Heap* owner, void* memory, std::size_t newSize)
+{
+    AllocationHeader* header = nullptr;
+    std::size_t oldSize = 0u;
+    if (memory != nullptr)
+    {
+        header = static_cast<AllocationHeader*>(memory) - 1;
+        owner = header->owner;
+        oldSize = header->size;
+    }
+    else if (newSize == 0u)
+    {
+        return nullptr;
+    }
+
+    collectBefore(*owner, oldSize, newSize);
+
+    const std::size_t blockSize = oldSize == 0u ? 0u : sizeof(AllocationHeader) + oldSize;
+    if (newSize == 0u)
+    {
+        owner->fn(header, blockSize, 0u, owner->userData);
+    }
+    else
+    {
+        header = static_cast<AllocationHeader*>(owner->fn(
+            header, blockSize, sizeof(AllocationHeader) + newSize, owner->userData));
+        if (header == nullptr)
+        {
+            return nullptr;
+        }
+        header->owner = owner;
+        header->size = newSize;
+    }
+
+    if (owner != &systemHeap)
+    {
+        count(*owner, memory, oldSize, newSize);
+    }
+    return newSize == 0u ? nullptr : header + 1;
+}
+
+void* heapReallocate(void* memory, std::size_t newSize)
+{
+    return reallocateFrom(activeHeap ? activeHeap : &systemHeap, memory, newSize);
+}
+
+std::size_t blockSize(void* memory)
+{
+#if defined(_WIN32)
+    return _msize(memory);
+#elif defined(__APPLE__)
+    return malloc_size(memory);
+#else
+    return malloc_usable_size(memory);
+#endif
+}
+
+// The reallocate hook of VMs without a Config allocator. Their blocks are counted by the heap in
+// scope, if it's headerless too. Allocations made out of scope aren't counted.
+void* headerlessReallocate(void* memory, std::size_t newSize)
+{
+    Heap* heap = activeHeap != nullptr && activeHeap->headerless ? activeHeap : nullptr;
+    const std::size_t oldSize = memory != nullptr ? blockSize(memory) : 0u;
+    if (heap != nullptr)
+    {
+        collectBefore(*heap, oldSize, newSize);
+    }
+    void* result = systemReallocate(memory, 0u, newSize, nullptr);
+    if (heap != nullptr && (result != nullptr || newSize == 0u))
+    {
+        count(*heap, memory, oldSize, result != nullptr ? blockSize(result) : 0u);
+    }
+    return result;
+}
+
+// Wren's own collection thresholds, which only come into play when the VM allocates with no
+// HeapScope in place, as when it's driven through VM::ptr directly. They're twice the heap's, so
+// whenever the heap sees the allocations, its own timed collections come first.
+std::size_t fallbackThreshold(std::size_t bytes)
+{
+    return bytes > SIZE_MAX / 2u ? SIZE_MAX : 2u * bytes;
+}
+
+// Wren frees the source of an import through the VM's heap, so it has to come from there
+char* copyToHeap(WrenVM* vm, const char* source, std::size_t length)
+{
+    Heap& heap = static_cast<BoundState*>(wrenGetUserData(vm))->heap;
+    char* copy = static_cast<char*>(
+        heap.headerless ? std::malloc(length + 1u) : reallocateFrom(&heap, nullptr, length + 1u));
+    if (copy != nullptr)
+    {
+        std::memcpy(copy, source, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+char* loadModuleFnWrapper(WrenVM* vm, const char* mod)
+{
+    const BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm));
+    if (boundState->moduleBundle != nullptr)
+    {
+        std::size_t size = 0u;
+        const char* source = boundState->moduleBundle->find(mod, &size);
+        if (source != nullptr)
+        {
+            return copyToHeap(vm, source, size);
+        }
+    }
+    if (boundState->moduleLoader != nullptr)
+    {
+        const std::shared_ptr<const wrenpp::ModuleLoader::Source> source =
+            boundState->moduleLoader->find(mod);
+        return source ? copyToHeap(vm, source->data(), source->size()) : nullptr;
+    }
+
+    // A headerless heap frees with plain free, so loadModuleFn's malloc'd buffer is handed over
+    // as it is. Only a Config allocator's heap needs its own copy.
+    char* source = wrenpp::VM::loadModuleFn(mod);
+    if (source == nullptr || boundState->heap.headerless)
+    {
+        return source;
+    }
+    char* copy = copyToHeap(vm, source, std::strlen(source));
+    std::free(source);
+    return copy;
+}
+
+// The process-wide cache of the sources which ModuleLoaders have mapped, by path
+struct CachedSource
+{
+    std::shared_ptr<const wrenpp::ModuleLoader::Source> source;
+    // the modification time in nanoseconds
+    std::int64_t modified;
+    decltype(stat::st_size) size;
+    decltype(stat::st_dev) device;
+    decltype(stat::st_ino) inode;
+};
+
+// the modification time, to the nanosecond where the platform keeps it
+std::int64_t modifiedTime(const struct stat& info)
+{
+    const std::int64_t nanoseconds = 1000000000;
+#if defined(_WIN32)
+    return std::int64_t(info.st_mtime) * nanoseconds;
+#elif defined(__APPLE__)
+    return std::int64_t(info.st_mtimespec.tv_sec) * nanoseconds + info.st_mtimespec.tv_nsec;
+#else
+    return std::int64_t(info.st_mtim.tv_sec) * nanoseconds + info.st_mtim.tv_nsec;
+#endif
+}
+
+// the absolute path, without links, . or .., so that every spelling of a file shares its entry
+std::string normalizedPath(const std::string& path)
+{
+#ifdef _WIN32
+    char full[_MAX_PATH];
+    return _fullpath(full, path.c_str(), _MAX_PATH) != nullptr ? std::string(full) : path;
+#else
+    char* resolved = realpath(path.c_str(), nullptr);
+    if (resolved == nullptr)
+    {
+        return path;
+    }
+    std::string result(resolved);
+    std::free(resolved);
+    return result;
+#endif
+}
+
+std::mutex& sourceCacheMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::unordered_map<std::string, CachedSource>& sourceCache()
+{
+    static std::unordered_map<std::string, CachedSource> cache;
+    return cache;
+}
+
+struct MappedFile
+{
+    const char* data;
+    std::size_t mappedSize;
+};
+
+MappedFile mapFile(const std::string& path, std::size_t size)
+{
+#ifdef _WIN32
+    // without mmap, the source is read into memory instead, and is always null-terminated
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return MappedFile{nullptr, 0u};
+    }
+    char* data = static_cast<char*>(std::malloc(size + 1u));
+    const std::size_t read = std::fread(data, 1u, size, file);
+    std::fclose(file);
+    data[read] = '\0';
+    return MappedFile{data, 0u};
+#else
+    if (size == 0u)
+    {
+        return MappedFile{"", 0u};
+    }
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return MappedFile{nullptr, 0u};
+    }
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return MappedFile{nullptr, 0u};
+    }
+    return MappedFile{static_cast<const char*>(data), size};
+#endif
+}
+
+// A bundle starts with a header of four 32 bit little-endian words: the magic, the version, the
+// number of modules, and the number of slots in the hash table. The slots follow, each holding
+// the index of a module plus one, or zero when empty. Then come the module entries, of four words
+// each: the name's hash, the offset of the name, the offset of the source, and the source's
+// length. The names and sources are null-terminated.
+constexpr char BundleMagic[4] = {'W', 'R', 'P', 'B'};
+constexpr std::uint32_t BundleVersion = 1u;
+constexpr std::size_t BundleHeaderSize = 16u;
+constexpr std::size_t BundleEntrySize = 16u;
+
+// FNV-1a
+std::uint32_t bundleHash(const char* name)
+{
+    std::uint32_t hash = 2166136261u;
+    for (; *name != '\0'; ++name)
+    {
+        hash ^= std::uint8_t(*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+std::uint32_t readWord(const char* bytes)
+{
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(bytes);
+    return std::uint32_t(b[0]) | std::uint32_t(b[1]) << 8 | std::uint32_t(b[2]) << 16 |
+           std::uint32_t(b[3]) << 24;
+}
+
+void writeWord(std::string& bytes, std::size_t offset, std::uint32_t word)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        bytes[offset + i] = char((word >> (8 * i)) & 0xffu);
+    }
+}
+
+void throwMalformedBundle()
+{
+    throw std::runtime_error("wrenpp::ModuleBundle: malformed bundle");
+}
+
+bool isNullTerminated(std::size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    return true;
+#else
+    static const std::size_t pageSize = std::size_t(sysconf(_SC_PAGESIZE));
+    return size % pageSize != 0u;
+#endif
+}
+} // namespace
+
+namespace wrenpp
+{
+namespace detail
+{
+constexpr std::uint8_t ForeignObject::Pointer;
+constexpr std::uint8_t ForeignObject::Shared;
+
+void registerFunction(
+    WrenVM* vm,
+    const std::string& mod,
+    const std::string& cName,
+    bool isStatic,
+    std::string sig,
+    WrenForeignMethodFn function)
+{
+    BoundState* boundState = (BoundState*)wrenGetUserData(vm);
+    boundState->methods.insert(
+        {mod.c_str(), cName.c_str(), sig.c_str(), isStatic ? "s" : ""}, function);
+}
+
+HeapScope::HeapScope(WrenVM* vm) : previous_{activeHeap}
+{
+    activeHeap = &static_cast<BoundState*>(wrenGetUserData(vm))->heap;
+}
+
+HeapScope::~HeapScope() { activeHeap = previous_; }
+
+void storeBoundName(
+    std::atomic<const BoundName*>& storage,
+    const std::string& module,
+    const std::string& className)
+{
+    // the names live until the program exits, as any thread may still be reading them
+    static std::mutex mutex;
+    static std::vector<std::unique_ptr<BoundName>> names;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (storage.load(std::memory_order_relaxed) == nullptr)
+    {
+        names.emplace_back(new BoundName{module, className});
+        storage.store(names.back().get(), std::memory_order_release);
+    }
+}
+
+void setSlotClass(WrenVM* vm, int slot, std::uint32_t typeId, const BoundName& name)
+{
+    BoundState* boundState = (BoundState*)wrenGetUserData(vm);
+    if (typeId >= boundState->classHandles.size())
+    {
+        boundState->classHandles.resize(typeId + 1u, nullptr);
+    }
+
+    WrenHandle*& handle = boundState->classHandles[typeId];
+    if (handle)
+    {
+        wrenSetSlotHandle(vm, slot, handle);
+        return;
+    }
+
+    wrenGetVariable(vm, name.module.c_str(), name.className.c_str(), slot);
+    handle = wrenGetSlotHandle(vm, slot);
+}
+
+void registerClass(
+    WrenVM* vm,
+    const std::string& mod,
+    std::string cName,
+    WrenForeignClassMethods methods)
+{
+    BoundState* boundState = (BoundState*)wrenGetUserData(vm);
+    boundState->classes.insert({mod.c_str(), cName.c_str()}, methods);
+}
+} // namespace detail
+
+constexpr std::size_t Value::InlineCapacity;
+
+Value null = Value();
+
+Value::Value(const Value& other)
+    : type_{other.type_}, mode_{other.mode_}, length_{other.length_}, data_(other.data_)
+{
+    if (mode_ == StringMode::Heap)
+    {
+        assignString(other.data_.heap, other.length_);
+    }
+}
+
+Value::Value(Value&& other) noexcept
+    : type_{other.type_}, mode_{other.mode_}, length_{other.length_}, data_(other.data_)
+{
+    // the heap buffer, if any, now belongs to this instance
+    other.type_ = WREN_TYPE_NULL;
+    other.mode_ = StringMode::Inline;
+    other.length_ = 0u;
+}
+
+Value& Value::operator=(const Value& rhs)
+{
+    if (&rhs != this)
+    {
+        *this = Value(rhs);
+    }
+    return *this;
+}
+
+Value& Value::operator=(Value&& rhs) noexcept
+{
+    if (&rhs != this)
+    {
+        release();
+        type_ = rhs.type_;
+        mode_ = rhs.mode_;
+        length_ = rhs.length_;
+        data_ = rhs.data_;
+        rhs.type_ = WREN_TYPE_NULL;
+        rhs.mode_ = StringMode::Inline;
+        rhs.length_ = 0u;
+    }
+    return *this;
+}
+
+Value::Value(bool val) : type_{WREN_TYPE_BOOL} { data_.boolean = val; }
+
+Value::Value(float val) : type_{WREN_TYPE_NUM} { data_.number = double(val); }
+
+Value::Value(double val) : type_{WREN_TYPE_NUM} { data_.number = val; }
+
+Value::Value(int val) : type_{WREN_TYPE_NUM} { data_.number = double(val); }
+
+Value::Value(unsigned int val) : type_{WREN_TYPE_NUM} { data_.number = double(val); }
+
+Value::Value(const char* str) : type_{WREN_TYPE_STRING} { assignString(str, std::strlen(str)); }
+
+Value::Value(const char* str, std::size_t length) : type_{WREN_TYPE_STRING}
+{
+    assignString(str, length);
+}
+
+Value::~Value() { release(); }
+
+Value Value::fromSlot(WrenVM* vm, int slot)
+{
+    switch (wrenGetSlotType(vm, slot))
+    {
+    case WREN_TYPE_BOOL: return Value(wrenGetSlotBool(vm, slot));
+    case WREN_TYPE_NUM: return Value(wrenGetSlotDouble(vm, slot));
+    case WREN_TYPE_STRING:
+    {
+        int length = 0;
+        const char* bytes = wrenGetSlotBytes(vm, slot, &length);
+        return Value(bytes, std::size_t(length));
+    }
+    case WREN_TYPE_FOREIGN:
+    {
+        return Value(detail::objectPtr(wrenGetSlotForeign(vm, slot)));
+    }
+    default: return Value();
+    }
+}
+
+Value Value::borrowSlot(WrenVM* vm, int slot)
+{
+    if (wrenGetSlotType(vm, slot) != WREN_TYPE_STRING)
+    {
+        return fromSlot(vm, slot);
+    }
+
+    int length = 0;
+    Value value;
+    value.type_ = WREN_TYPE_STRING;
+    value.mode_ = StringMode::Borrowed;
+    value.data_.borrowed = wrenGetSlotBytes(vm, slot, &length);
+    value.length_ = std::uint32_t(length);
+    return value;
+}
+
+void Value::assignString(const char* str, std::size_t length)
+{
+    length_ = std::uint32_t(length);
+    char* buffer = data_.inline_;
+    mode_ = StringMode::Inline;
+    if (length > InlineCapacity)
+    {
+        buffer = (char*)std::malloc(length + 1u);
+        assert(buffer != nullptr);
+        data_.heap = buffer;
+        mode_ = StringMode::Heap;
+    }
+    std::memcpy(buffer, str, length);
+    buffer[length] = '\0';
+}
+
+void Value::release()
+{
+    if (mode_ == StringMode::Heap)
+    {
+        std::free(data_.heap);
+        mode_ = StringMode::Inline;
+    }
+}
+
+Method::Method(VM* vm, WrenHandle* variable, WrenHandle* method)
+    : vm_(vm), method_(method), variable_(variable)
+{
+}
+
+Method::Method(Method&& other) : vm_(other.vm_), method_(other.method_), variable_(other.variable_)
+{
+    other.vm_ = nullptr;
+    other.method_ = nullptr;
+    other.variable_ = nullptr;
+}
+
+Method::~Method()
+{
+    if (vm_)
+    {
+        assert(method_ && variable_);
+        wrenReleaseHandle(vm_->ptr(), method_);
+        wrenReleaseHandle(vm_->ptr(), variable_);
+    }
+}
+
+Method& Method::operator=(Method&& rhs)
+{
+    if (&rhs != this)
+    {
+        vm_ = rhs.vm_;
+        method_ = rhs.method_;
+        variable_ = rhs.variable_;
+        rhs.vm_ = nullptr;
+        rhs.method_ = nullptr;
+        rhs.variable_ = nullptr;
+    }
+
+    return *this;
+}
+
+ClassContext ModuleContext::beginClass(std::string c) { return ClassContext(c, *this); }
+
+void ModuleContext::endModule() {}
+
+ModuleContext& ClassContext::endClass() { return module_; }
+
+ClassContext::ClassContext(std::string c, ModuleContext& mod) : module_(mod), class_(c) {}
+
+ClassContext& ClassContext::bindCFunction(
+    bool isStatic,
+    std::string signature,
+    WrenForeignMethodFn function)
+{
+    detail::registerFunction(module_.vm_, module_.name_, class_, isStatic, signature, function);
+    return *this;
+}
+
+/*
+ * Returns the source as a null-terminated, heap-allocated string.
+ * Uses malloc, because the VM copies it into its own heap, and frees the
+ * returned buffer with std::free.
+ * */
+LoadModuleFn VM::loadModuleFn = [](const char* mod) -> char* {
+    std::string path(mod);
+    path += ".wren";
+    std::string source;
+    try
+    {
+        source = wrenpp::detail::fileToString(path);
+    }
+    catch (const std::exception&)
+    {
+        return NULL;
+    }
+    char* buffer = (char*)malloc(source.size() + 1u);
+    assert(buffer != nullptr);
+    memcpy(buffer, source.c_str(), source.size() + 1u);
+    return buffer;
+};
+
+WriteFn VM::writeFn = [](const char* text) -> void { std::cout << text; };
+
+ErrorFn VM::errorFn =
+    [](WrenErrorType type, const char* module_name, int line, const char* message) -> void {
+    const char* typeStr = errorTypeToString(type);
+    if (module_name)
+    {
+        std::cout << typeStr << " in " << module_name << ":" << line << "> " << message
+                  << std::endl;
+    }
+    else
+    {
+        std::cout << typeStr << "> " << message << std::endl;
+    }
+};
+
+VM::VM() : VM(Config{}) {}
+
+VM::VM(const Config& config) : vm_{nullptr}
+{
+    BoundState* boundState = new BoundState();
+    detail::Heap& heap = boundState->heap;
+    heap.fn = config.allocatorFn ? config.allocatorFn : systemReallocate;
+    heap.headerless = config.allocatorFn == nullptr;
+    heap.userData = config.allocatorData;
+    heap.minHeapSize = config.minHeapSize;
+    heap.heapGrowthPercent = config.heapGrowthPercent;
+    heap.threshold = config.initialHeapSize;
+    heap.scheduler = config.scheduler;
+    boundState->moduleLoader = config.moduleLoader;
+    boundState->moduleBundle = config.moduleBundle;
+    if (heap.scheduler != nullptr)
+    {
+        heap.scheduler->seed(heap.windowGrowth, heap.pausePerByte);
+    }
+
+    WrenConfiguration configuration{};
+    wrenInitConfiguration(&configuration);
+    configuration.reallocateFn = heap.headerless ? headerlessReallocate : heapReallocate;
+    // the heap triggers collections itself, Wren's own thresholds are only a fallback
+    configuration.initialHeapSize = fallbackThreshold(config.initialHeapSize);
+    configuration.minHeapSize = fallbackThreshold(config.minHeapSize);
+    configuration.heapGrowthPercent = 100 + 2 * config.heapGrowthPercent;
+    configuration.bindForeignMethodFn = foreignMethodProvider;
+    configuration.loadModuleFn = loadModuleFnWrapper;
+    configuration.bindForeignClassFn = foreignClassProvider;
+    configuration.writeFn = writeFnWrapper;
+    configuration.errorFn = errorFnWrapper;
+    configuration.userData = boundState;
+
+    // the VM isn't there yet to look the heap up from
+    Heap* previous = activeHeap;
+    activeHeap = &heap;
+    vm_ = wrenNewVM(&configuration);
+    activeHeap = previous;
+    heap.vm = vm_;
+}
+
+VM::VM(VM&& other) : vm_{other.vm_} { other.vm_ = nullptr; }
+
+VM& VM::operator=(VM&& rhs)
+{
+    if (&rhs != this)
+    {
+        vm_ = rhs.vm_;
+        rhs.vm_ = nullptr;
+    }
+    return *this;
+}
+
+VM::~VM()
+{
+    if (vm_ != nullptr)
+    {
+        BoundState* boundState = (BoundState*)wrenGetUserData(vm_);
+        for (WrenHandle* handle : boundState->classHandles)
+        {
+            if (handle)
+            {
+                wrenReleaseHandle(vm_, handle);
+            }
+        }
+        for (WrenHandle* handle :
+             {boundState->valueTokens,
+              boundState->flattenValue,
+              boundState->rebuildValue,
+              boundState->channelClass,
+              boundState->deliverMessage})
+        {
+            if (handle)
+            {
+                wrenReleaseHandle(vm_, handle);
+            }
+        }
+        for (const auto& inbound : boundState->inbound)
+        {
+            wrenReleaseHandle(vm_, inbound.second);
+        }
+        detail::Heap& heap = boundState->heap;
+        if (heap.scheduler != nullptr)
+        {
+            // without a collection, all of the heap may have been live
+            const std::size_t settledBytes =
+                heap.stats.collections != 0u ? heap.maxSettledBytes : heap.stats.liveBytes;
+            heap.scheduler->report(
+                settledBytes, heap.windowGrowth, heap.maxWindowGrowth, heap.pausePerByte);
+        }
+        // the heap must outlive the VM's memory
+        heap.vm = nullptr;
+        {
+            // so that a headerless heap counts its frees
+            detail::HeapScope scope(vm_);
+            wrenFreeVM(vm_);
+        }
+        delete boundState;
+    }
+}
+
+Result VM::executeModule(const std::string& mod)
+{
+    const BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm_));
+    if (boundState->moduleBundle != nullptr)
+    {
+        const char* source = boundState->moduleBundle->find(mod.c_str());
+        if (source != nullptr)
+        {
+            detail::HeapScope scope(vm_);
+            return detail::toResult(wrenInterpret(vm_, mod.c_str(), source));
+        }
+    }
+    if (boundState->moduleLoader != nullptr)
+    {
+        const std::shared_ptr<const ModuleLoader::Source> source =
+            boundState->moduleLoader->find(mod);
+        if (!source)
+        {
+            errorFn(WREN_ERROR_COMPILE, mod.c_str(), 0, "Could not find the module");
+            return Result::CompileError;
+        }
+        detail::HeapScope scope(vm_);
+        if (source->isNullTerminated())
+        {
+            return detail::toResult(wrenInterpret(vm_, mod.c_str(), source->data()));
+        }
+        const std::string terminated(source->data(), source->size());
+        return detail::toResult(wrenInterpret(vm_, mod.c_str(), terminated.c_str()));
+    }
+
+    char* source = loadModuleFn(mod.c_str());
+    if (source == nullptr)
+    {
+        errorFn(WREN_ERROR_COMPILE, mod.c_str(), 0, "Could not find the module");
+        return Result::CompileError;
+    }
+    detail::HeapScope scope(vm_);
+    const Result result = detail::toResult(wrenInterpret(vm_, mod.c_str(), source));
+    std::free(source);
+    return result;
+}
+
+Result VM::executeString(const std::string& code)
+{
+    detail::HeapScope scope(vm_);
+    return detail::toResult(wrenInterpret(vm_, "main", code.c_str()));
+}
+
+void VM::collectGarbage()
+{
+    detail::HeapScope scope(vm_);
+    collect(static_cast<BoundState*>(wrenGetUserData(vm_))->heap, Collection::Explicit);
+}
+
+HeapStats VM::heapStats() const
+{
+    return static_cast<BoundState*>(wrenGetUserData(vm_))->heap.stats;
+}
+
+void VM::setBindingProfiling(bool enabled)
+{
+#ifdef WRENPP_PROFILE_BINDINGS
+    static_cast<BoundState*>(wrenGetUserData(vm_))->profiler.enabled = enabled;
+#else
+    (void)enabled;
+#endif
+}
+
+void VM::resetBindingProfile()
+{
+#ifdef WRENPP_PROFILE_BINDINGS
+    for (ProfileRecord& record : static_cast<BoundState*>(wrenGetUserData(vm_))->profiler.records)
+    {
+        record.calls = 0u;
+        record.totalTime = std::chrono::nanoseconds::zero();
+        record.maxTime = std::chrono::nanoseconds::zero();
+    }
+#endif
+}
+
+std::size_t VM::unprofiledBindings() const
+{
+#ifdef WRENPP_PROFILE_BINDINGS
+    return static_cast<BoundState*>(wrenGetUserData(vm_))->profiler.unprofiled;
+#else
+    return 0u;
+#endif
+}
+
+std::vector<BindingProfile> VM::hottestBindings(std::size_t count) const
+{
+    std::vector<BindingProfile> bindings;
+#ifdef WRENPP_PROFILE_BINDINGS
+    for (const ProfileRecord& record :
+         static_cast<BoundState*>(wrenGetUserData(vm_))->profiler.records)
+    {
+        if (record.calls != 0u)
+        {
+            bindings.push_back(BindingProfile{
+                record.module,
+                record.className,
+                record.signature,
+                record.isStatic,
+                record.calls,
+                record.totalTime,
+                record.maxTime});
+        }
+    }
+#endif
+    count = std::min(count, bindings.size());
+    std::partial_sort(
+        bindings.begin(),
+        bindings.begin() + count,
+        bindings.end(),
+        [](const BindingProfile& lhs, const BindingProfile& rhs) {
+            return lhs.totalTime > rhs.totalTime;
+        });
+    bindings.resize(count);
+    return bindings;
+}
+
+void VM::reportHottestBindings(std::ostream& out, std::size_t count) const
+{
+    char line[64];
+    std::snprintf(line, sizeof(line), "%12s %14s %12s  ", "calls", "total us", "max us");
+    out << line << "binding\n";
+    for (const BindingProfile& binding : hottestBindings(count))
+    {
+        std::snprintf(
+            line,
+            sizeof(line),
+            "%12llu %14.3f %12.3f  ",
+            (unsigned long long)binding.calls,
+            binding.totalTime.count() / 1000.0,
+            binding.maxTime.count() / 1000.0);
+        out << line << binding.module << ": " << (binding.isStatic ? "static " : "")
+            << binding.className << '.' << binding.signature << '\n';
+    }
+#ifdef WRENPP_PROFILE_BINDINGS
+    const std::size_t unprofiled = unprofiledBindings();
+    if (unprofiled != 0u)
+    {
+        out << unprofiled << " more bindings weren't profiled, past the limit of "
+            << ProfiledBindings << ". Raise it by defining WRENPP_PROFILED_BINDINGS.\n";
+    }
+#endif
+}
+
+bool VM::idle(std::chrono::nanoseconds budget)
+{
+    detail::Heap& heap = static_cast<BoundState*>(wrenGetUserData(vm_))->heap;
+    const HeapStats& stats = heap.stats;
+
+    // before the first call, the VM was busy loading scripts, which isn't a window
+    if (heap.idling)
+    {
+        const double growth = double(stats.allocatedBytes - heap.allocatedAtLastIdle);
+        heap.windowGrowth = average(heap.windowGrowth, growth);
+        heap.maxWindowGrowth = std::max(heap.maxWindowGrowth, growth);
+    }
+    heap.idling = true;
+    heap.allocatedAtLastIdle = stats.allocatedBytes;
+
+    // Collecting now only pays off if the heap would otherwise reach its threshold before the next
+    // idle window. Twice the usual growth leaves room for a busier than average window.
+    if (double(stats.liveBytes) + 2.0 * heap.windowGrowth <= double(heap.threshold))
+    {
+        return false;
+    }
+    // the first collection has to be made to find out how long it takes
+    if (heap.pausePerByte * double(stats.liveBytes) > double(budget.count()))
+    {
+        return false;
+    }
+
+    detail::HeapScope scope(vm_);
+    collect(heap, Collection::Idle);
+    return true;
+}
+
+Method VM::method(const std::string& mod, const std::string& var, const std::string& sig)
+{
+    detail::HeapScope scope(vm_);
+    wrenEnsureSlots(vm_, 1);
+    wrenGetVariable(vm_, mod.c_str(), var.c_str(), 0);
+    WrenHandle* variable = wrenGetSlotHandle(vm_, 0);
+    WrenHandle* handle = wrenMakeCallHandle(vm_, sig.c_str());
+    return Method(this, variable, handle);
+}
+
+ModuleContext VM::beginModule(std::string name) { return ModuleContext(vm_, name); }
+
+void VM::listen(Channel& channel, const std::string& module, const std::string& variable)
+{
+    BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm_));
+    assert(boundState->deliverMessage && "VM::listen: call bindChannels first");
+    detail::HeapScope scope(vm_);
+    wrenEnsureSlots(vm_, 1);
+    wrenGetVariable(vm_, module.c_str(), variable.c_str(), 0);
+    boundState->inbound.emplace_back(&channel, wrenGetSlotHandle(vm_, 0));
+}
+
+std::size_t VM::drainChannels(std::size_t maxPerChannel)
+{
+    BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm_));
+    detail::HeapScope scope(vm_);
+    std::string message;
+    std::size_t delivered = 0u;
+    // a handler may listen on another channel, which moves the list
+    for (std::size_t i = 0u; i < boundState->inbound.size(); ++i)
+    {
+        for (std::size_t n = 0u;
+             n < maxPerChannel && boundState->inbound[i].first->tryReceiveMessage(message);
+             ++n)
+        {
+            try
+            {
+                readValue(vm_, 2, message, nullptr);
+            }
+            catch (const FormatError& error)
+            {
+                // there's no fiber to abort, so the message is reported like a runtime error
+                const std::string text = std::string("The message can't be read: ") + error.what();
+                errorFn(WREN_ERROR_RUNTIME, nullptr, -1, text.c_str());
+                continue;
+            }
+            wrenSetSlotHandle(vm_, 0, boundState->channelClass);
+            wrenSetSlotHandle(vm_, 1, boundState->inbound[i].second);
+            wrenCall(vm_, boundState->deliverMessage);
+            ++delivered;
+        }
+    }
+    return delivered;
+}
+
+Result bindTypedArrays(VM& vm, const std::string& module)
+{
+    ModuleContext context = vm.beginModule(module);
+    bindTypedArray<float>(context, "Float32Array");
+    bindTypedArray<double>(context, "Float64Array");
+    bindTypedArray<std::int32_t>(context, "Int32Array");
+    context.endModule();
+
+    // Interpreting the declarations under the module's name creates the module, so that
+    // scripts can import it without going through loadModuleFn.
+    std::string source = typedArrayDeclaration("Float32Array");
+    source += typedArrayDeclaration("Float64Array");
+    source += typedArrayDeclaration("Int32Array");
+    detail::HeapScope scope(vm.ptr());
+    return detail::toResult(wrenInterpret(vm.ptr(), module.c_str(), source.c_str()));
+}
+
+SharedBuffer::SharedBuffer(const void* data, std::size_t size)
+{
+    std::shared_ptr<char> owner(new char[size], std::default_delete<char[]>());
+    std::memcpy(owner.get(), data, size);
+    data_ = owner.get();
+    size_ = size;
+    owner_ = std::move(owner);
+}
+
+PublishedBuffer::PublishedBuffer(SharedBuffer initial)
+    : current_{std::make_shared<const Version>(Version{std::move(initial), 0u})}
+{
+}
+
+std::uint64_t PublishedBuffer::publish(SharedBuffer buffer)
+{
+    // if no reader holds the previous version, it's freed once the lock is released
+    std::shared_ptr<const Version> previous;
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::uint64_t number = current_->number + 1u;
+    previous = std::move(current_);
+    current_ = std::make_shared<const Version>(Version{std::move(buffer), number});
+    return number;
+}
+
+SharedBuffer PublishedBuffer::current() const
+{
+    std::shared_ptr<const Version> version;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        version = current_;
+    }
+    return version->buffer;
+}
+
+std::uint64_t PublishedBuffer::version() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return current_->number;
+}
+
+Result bindSharedBuffers(VM& vm, const std::string& module)
+{
+    ModuleContext context = vm.beginModule(module);
+    context.bindClass<SharedBuffer>("SharedBuffer")
+        .bindCFunction(false, "byteCount", sharedBufferByteCount)
+        .bindCFunction(false, "uint8(_)", sharedBufferRead<std::uint8_t>)
+        .bindCFunction(false, "int32(_)", sharedBufferRead<std::int32_t>)
+        .bindCFunction(false, "float32(_)", sharedBufferRead<float>)
+        .bindCFunction(false, "float64(_)", sharedBufferRead<double>);
+    context.bindClass<PublishedBuffer>("PublishedBuffer")
+        .bindCFunction(false, "current", publishedBufferCurrent)
+        .bindCFunction(false, "version", publishedBufferVersion);
+    context.endModule();
+
+    detail::HeapScope scope(vm.ptr());
+    return detail::toResult(wrenInterpret(vm.ptr(), module.c_str(), SharedBufferSource));
+}
+
+Channel::Channel(std::size_t capacity)
+{
+    std::size_t size = 2u;
+    while (size < capacity)
+    {
+        size *= 2u;
+    }
+    cells_.reset(new Cell[size]);
+    for (std::size_t i = 0u; i < size; ++i)
+    {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    mask_ = size - 1u;
+}
+
+bool Channel::empty() const
+{
+    const std::size_t position = receive_.value.load(std::memory_order_relaxed);
+    return cells_[position & mask_].sequence.load(std::memory_order_acquire) != position + 1u;
+}
+
+bool Channel::full() const
+{
+    const std::size_t position = send_.value.load(std::memory_order_relaxed);
+    const std::size_t sequence = cells_[position & mask_].sequence.load(std::memory_order_acquire);
+    return std::ptrdiff_t(sequence - position) < 0;
+}
+
+bool Channel::trySend(double number)
+{
+    std::string message(1u, SerializedVersion);
+    appendSerializedNumber(message, number);
+    return trySendMessage(std::move(message));
+}
+
+bool Channel::trySend(const std::string& string)
+{
+    std::string message(1u, SerializedVersion);
+    message += SerializedString;
+    appendSerializedBytes(message, string.data(), string.size());
+    return trySendMessage(std::move(message));
+}
+
+bool Channel::trySendMessage(std::string message)
+{
+    std::size_t position = send_.value.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true)
+    {
+        cell = &cells_[position & mask_];
+        const std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const std::ptrdiff_t lap = std::ptrdiff_t(sequence - position);
+        if (lap == 0)
+        {
+            // the cell is free, so claim the position
+            if (send_.value.compare_exchange_weak(
+                    position, position + 1u, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (lap < 0)
+        {
+            // the receiver hasn't emptied the cell since the last lap
+            return false;
+        }
+        else
+        {
+            // another sender claimed the position
+            position = send_.value.load(std::memory_order_relaxed);
+        }
+    }
+    cell->message = std::move(message);
+    cell->sequence.store(position + 1u, std::memory_order_release);
+    return true;
+}
+
+bool Channel::tryReceiveMessage(std::string& message)
+{
+    const std::size_t position = receive_.value.load(std::memory_order_relaxed);
+    Cell& cell = cells_[position & mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != position + 1u)
+    {
+        return false;
+    }
+    message = std::move(cell.message);
+    // frees the cell for the sender one lap ahead
+    cell.sequence.store(position + mask_ + 1u, std::memory_order_release);
+    receive_.value.store(position + 1u, std::memory_order_relaxed);
+    return true;
+}
+
+Result bindChannels(VM& vm, const std::string& module)
+{
+    ModuleContext context = vm.beginModule(module);
+    context.bindClass<Channel>("Channel")
+        .bindCFunction(false, "capacity", channelCapacity)
+        .bindCFunction(false, "isEmpty", channelIsEmpty)
+        .bindCFunction(false, "isFull", channelIsFull)
+        .bindCFunction(false, "trySend_(_)", channelTrySend)
+        .bindCFunction(false, "receive_()", channelReceive)
+        .bindCFunction(false, "waitForSpace_()", channelWait<false>)
+        .bindCFunction(false, "waitForMessage_()", channelWait<true>);
+    context.endModule();
+
+    WrenVM* ptr = vm.ptr();
+    detail::HeapScope scope(ptr);
+    if (!declareValueTokens(ptr))
+    {
+        return Result::CompileError;
+    }
+    const Result result = detail::toResult(wrenInterpret(ptr, module.c_str(), ChannelSource));
+    if (result != Result::Success)
+    {
+        return result;
+    }
+    BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(ptr));
+    if (boundState->channelClass == nullptr)
+    {
+        wrenEnsureSlots(ptr, 1);
+        wrenGetVariable(ptr, module.c_str(), "Channel", 0);
+        boundState->channelClass = wrenGetSlotHandle(ptr, 0);
+        boundState->deliverMessage = wrenMakeCallHandle(ptr, "deliver_(_,_)");
+    }
+    return result;
+}
+
+Serializer::Serializer(VM& vm) : vm_{vm.ptr()}
+{
+    detail::HeapScope scope(vm_);
+    if (!declareValueTokens(vm_))
+    {
+        throw std::runtime_error("wrenpp::Serializer: can't declare the ValueTokens class");
+    }
+}
+
+std::string Serializer::serialize(WrenHandle* value)
+{
+    detail::HeapScope scope(vm_);
+    const BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm_));
+    wrenEnsureSlots(vm_, 2);
+    wrenSetSlotHandle(vm_, 0, boundState->valueTokens);
+    wrenSetSlotHandle(vm_, 1, value);
+    if (wrenCall(vm_, boundState->flattenValue) != WREN_RESULT_SUCCESS)
+    {
+        throw std::runtime_error("wrenpp::Serializer::serialize: flattening the value aborted");
+    }
+    std::string out;
+    const std::string error = writeValue(vm_, 0, out, &hooks_);
+    if (!error.empty())
+    {
+        throw std::runtime_error("wrenpp::Serializer::serialize: " + error);
+    }
+    return out;
+}
+
+std::string Serializer::serialize(const std::string& module, const std::string& variable)
+{
+    detail::HeapScope scope(vm_);
+    wrenEnsureSlots(vm_, 1);
+    wrenGetVariable(vm_, module.c_str(), variable.c_str(), 0);
+    WrenHandle* value = wrenGetSlotHandle(vm_, 0);
+    try
+    {
+        std::string out = serialize(value);
+        wrenReleaseHandle(vm_, value);
+        return out;
+    }
+    catch (...)
+    {
+        wrenReleaseHandle(vm_, value);
+        throw;
+    }
+}
+
+WrenHandle* Serializer::deserialize(const std::string& bytes)
+{
+    detail::HeapScope scope(vm_);
+    const BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm_));
+    try
+    {
+        readValue(vm_, 1, bytes, &hooks_);
+    }
+    catch (const FormatError& error)
+    {
+        throw std::runtime_error(std::string("wrenpp::Serializer::deserialize: ") + error.what());
+    }
+    if (wrenGetSlotType(vm_, 1) == WREN_TYPE_LIST)
+    {
+        wrenSetSlotHandle(vm_, 0, boundState->valueTokens);
+        if (wrenCall(vm_, boundState->rebuildValue) != WREN_RESULT_SUCCESS)
+        {
+            throw std::runtime_error(
+                "wrenpp::Serializer::deserialize: a map has a key it can't hold");
+        }
+        return wrenGetSlotHandle(vm_, 0);
+    }
+    return wrenGetSlotHandle(vm_, 1);
+}
+
+// The Wren side of FiberScheduler. resume_ returns a ticket when the fiber awaits one, true when
+// it yielded, false when it finished, and the error when it aborted.
+const char* const SchedulerSource =
+    "class Scheduler {\n"
+    "  foreign static add_(fiber)\n"
+    "  static spawn(fn) { add_(Fiber.new { fn.call() }) }\n"
+    "  static yield() { Fiber.yield() }\n"
+    "  static await(ticket) {\n"
+    "    Fiber.yield(ticket)\n"
+    "    if (__error != null) Fiber.abort(__error)\n"
+    "    return __result\n"
+    "  }\n"
+    "  static resume_(fiber, result, error) {\n"
+    "    __result = result\n"
+    "    __error = error\n"
+    "    var ticket = fiber.try()\n"
+    "    __result = null\n"
+    "    if (fiber.error != null) return fiber.error.toString\n"
+    "    if (fiber.isDone) return false\n"
+    "    return ticket is Num ? ticket : true\n"
+    "  }\n"
+    "}\n";
+
+struct FiberScheduler::Task
+{
+    WrenHandle* fiber;
+    // the ticket the fiber awaits, or zero
+    std::uint64_t awaiting{0u};
+    // the operations the fiber started, which are dropped along with it
+    std::vector<std::uint64_t> operations{};
+};
+
+FiberScheduler::FiberScheduler(VM& vm, const std::string& module) : vm_{vm.ptr()}
+{
+    BoundState* boundState = static_cast<BoundState*>(wrenGetUserData(vm_));
+    if (boundState->fiberScheduler != nullptr)
+    {
+        throw std::logic_error("wrenpp::FiberScheduler: the VM already has a scheduler");
+    }
+
+    vm.beginModule(module).beginClass("Scheduler").bindCFunction(true, "add_(_)", addFiber);
+    detail::HeapScope scope(vm_);
+    if (wrenInterpret(vm_, module.c_str(), SchedulerSource) != WREN_RESULT_SUCCESS)
+    {
+        throw std::runtime_error("wrenpp::FiberScheduler: can't declare the Scheduler class");
+    }
+    wrenEnsureSlots(vm_, 1);
+    wrenGetVariable(vm_, module.c_str(), "Scheduler", 0);
+    class_ = wrenGetSlotHandle(vm_, 0);
+    spawn_ = wrenMakeCallHandle(vm_, "spawn(_)");
+    resume_ = wrenMakeCallHandle(vm_, "resume_(_,_,_)");
+    boundState->fiberScheduler = this;
+}
+
+FiberScheduler::~FiberScheduler()
+{
+    static_cast<BoundState*>(wrenGetUserData(vm_))->fiberScheduler = nullptr;
+    for (auto& task : ready_)
+    {
+        wrenReleaseHandle(vm_, task->fiber);
+    }
+    for (auto& task : awaiting_)
+    {
+        wrenReleaseHandle(vm_, task->fiber);
+    }
+    wrenReleaseHandle(vm_, class_);
+    wrenReleaseHandle(vm_, spawn_);
+    wrenReleaseHandle(vm_, resume_);
+}
+
+void FiberScheduler::spawn(const std::string& module, const std::string& variable)
+{
+    detail::HeapScope scope(vm_);
+    wrenEnsureSlots(vm_, 2);
+    wrenSetSlotHandle(vm_, 0, class_);
+    wrenGetVariable(vm_, module.c_str(), variable.c_str(), 1);
+    if (wrenCall(vm_, spawn_) != WREN_RESULT_SUCCESS)
+    {
+        throw std::runtime_error("wrenpp::FiberScheduler::spawn: can't create the fiber");
+    }
+}
+
+std::size_t FiberScheduler::tick(std::chrono::nanoseconds budget)
+{
+    const auto deadline = std::chrono::steady_clock::now() + budget;
+
+    // wake up the fibers whose results are in, or which await an unknown ticket
+    auto awaiting = awaiting_.begin();
+    for (auto& task : awaiting_)
+    {
+        auto operation = operations_.find(task->awaiting);
+        if (operation == operations_.end() || operation->second->ready())
+        {
+            ready_.push_back(std::move(task));
+        }
+        else
+        {
+            *awaiting++ = std::move(task);
+        }
+    }
+    awaiting_.erase(awaiting, awaiting_.end());
+
+    const std::size_t count = ready_.size();
+    std::size_t resumed = 0u;
+    while (resumed < count &&
+           (resumed == 0u || std::chrono::steady_clock::now() < deadline))
+    {
+        std::unique_ptr<Task> task = std::move(ready_.front());
+        ready_.pop_front();
+        resume(std::move(task));
+        ++resumed;
+    }
+    return resumed;
+}
+
+std::size_t FiberScheduler::fiberCount() const { return ready_.size() + awaiting_.size(); }
+
+std::size_t FiberScheduler::awaitingCount() const { return awaiting_.size(); }
+
+void FiberScheduler::addFiber(WrenVM* vm)
+{
+    FiberScheduler* scheduler = static_cast<BoundState*>(wrenGetUserData(vm))->fiberScheduler;
+    scheduler->ready_.push_back(std::unique_ptr<Task>(new Task{wrenGetSlotHandle(vm, 1)}));
+}
+
+void FiberScheduler::resume(std::unique_ptr<Task> task)
+{
+    detail::HeapScope scope(vm_);
+    wrenEnsureSlots(vm_, 4);
+    wrenSetSlotHandle(vm_, 0, class_);
+    wrenSetSlotHandle(vm_, 1, task->fiber);
+    wrenSetSlotNull(vm_, 2);
+    wrenSetSlotNull(vm_, 3);
+    if (task->awaiting != 0u)
+    {
+        auto operation = operations_.find(task->awaiting);
+        if (operation == operations_.end())
+        {
+            wrenSetSlotString(vm_, 3, "Scheduler.await: not a pending operation.");
+        }
+        else
+        {
+            try
+            {
+                operation->second->setResult(vm_, 2);
+            }
+            catch (const std::exception& e)
+            {
+                wrenSetSlotString(vm_, 3, e.what());
+            }
+            operations_.erase(operation);
+        }
+        auto& started = task->operations;
+        started.erase(std::remove(started.begin(), started.end(), task->awaiting), started.end());
+        task->awaiting = 0u;
+    }
+
+    running_ = task.get();
+    const WrenInterpretResult result = wrenCall(vm_, resume_);
+    running_ = nullptr;
+    if (result != WREN_RESULT_SUCCESS)
+    {
+        finish(std::move(task));
+        return;
+    }
+
+    switch (wrenGetSlotType(vm_, 0))
+    {
+    case WREN_TYPE_NUM:
+        task->awaiting = std::uint64_t(wrenGetSlotDouble(vm_, 0));
+        awaiting_.push_back(std::move(task));
+        break;
+    case WREN_TYPE_BOOL:
+        if (wrenGetSlotBool(vm_, 0))
+        {
+            ready_.push_back(std::move(task));
+        }
+        else
+        {
+            finish(std::move(task));
+        }
+        break;
+    default:
+        VM::errorFn(WREN_ERROR_RUNTIME, nullptr, -1, wrenGetSlotString(vm_, 0));
+        finish(std::move(task));
+        break;
+    }
+}
+
+void FiberScheduler::finish(std::unique_ptr<Task> task)
+{
+    for (std::uint64_t ticket : task->operations)
+    {
+        operations_.erase(ticket);
+    }
+    wrenReleaseHandle(vm_, task->fiber);
+}
+
+namespace detail
+{
+void startAsync(WrenVM* vm, std::unique_ptr<AsyncOperation> operation)
+{
+    FiberScheduler* scheduler = static_cast<BoundState*>(wrenGetUserData(vm))->fiberScheduler;
+    if (scheduler == nullptr || scheduler->running_ == nullptr)
+    {
+        wrenSetSlotString(vm, 0, "Async methods can only be called from a scheduled fiber.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    const std::uint64_t ticket = scheduler->nextTicket_++;
+    scheduler->operations_.emplace(ticket, std::move(operation));
+    scheduler->running_->operations.push_back(ticket);
+    wrenSetSlotDouble(vm, 0, double(ticket));
+}
+} // namespace detail
+
+struct Executor::Worker
+{
+    std::thread thread{};
+    std::unique_ptr<VM> vm{};
+    // the methods looked up so far, by module, variable and signature
+    std::unordered_map<std::string, Method> methods{};
+    // The owner takes chunks from the front, thieves from the back.
+    std::mutex mutex{};
+    std::deque<std::pair<std::size_t, std::size_t>> chunks{};
+};
+
+Executor::Executor(std::size_t workers, Setup setup, const Config& config)
+{
+    if (workers == 0u)
+    {
+        throw std::invalid_argument("wrenpp::Executor: needs at least one worker");
+    }
+    for (std::size_t i = 0u; i < workers; ++i)
+    {
+        workers_.emplace_back(new Worker());
+    }
+    try
+    {
+        for (std::size_t i = 0u; i < workers; ++i)
+        {
+            workers_[i]->thread =
+                std::thread([this, i, &setup, &config]() { work(i, setup, config); });
+        }
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    // setup and config are borrowed until every worker has started
+    done_.wait(lock, [this]() { return started_ == workers_.size(); });
+    if (error_)
+    {
+        lock.unlock();
+        stop();
+        std::rethrow_exception(error_);
+    }
+}
+
+Executor::~Executor() { stop(); }
+
+void Executor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::unique_ptr<Worker>& worker : workers_)
+    {
+        if (worker->thread.joinable())
+        {
+            worker->thread.join();
+        }
+    }
+}
+
+void Executor::run(
+    const std::string& module,
+    const std::string& variable,
+    const std::string& signature,
+    std::size_t count,
+    const Job& job)
+{
+    if (count == 0u)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> runLock(runMutex_);
+
+    const std::size_t workers = workers_.size();
+    const std::size_t chunkSize =
+        chunkSize_ != 0u ? chunkSize_ : std::max<std::size_t>(1u, count / (workers * 8u));
+    const std::size_t chunks = (count + chunkSize - 1u) / chunkSize;
+    // each worker starts with a contiguous block of chunks
+    for (std::size_t i = 0u; i < workers; ++i)
+    {
+        Worker& worker = *workers_[i];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        for (std::size_t chunk = i * chunks / workers; chunk < (i + 1u) * chunks / workers; ++chunk)
+        {
+            const std::size_t begin = chunk * chunkSize;
+            worker.chunks.emplace_back(begin, std::min(count, begin + chunkSize));
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = &job;
+    module_ = module;
+    variable_ = variable;
+    signature_ = signature;
+    active_ = workers;
+    ++generation_;
+    wake_.notify_all();
+    // A worker gives up once it finds no chunk left to take, after finishing the one it had. So
+    // when every worker has, the job is done, and none can take a chunk of the next job by mistake.
+    done_.wait(lock, [this]() { return active_ == 0u; });
+    job_ = nullptr;
+    if (error_)
+    {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void Executor::work(std::size_t index, const Setup& setup, const Config& config)
+{
+    Worker& worker = *workers_[index];
+    try
+    {
+        worker.vm.reset(new VM(config));
+        setup(*worker.vm);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_)
+        {
+            error_ = std::current_exception();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++started_;
+    }
+    done_.notify_all();
+
+    std::uint64_t seen = 0u;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        wake_.wait(lock, [this, seen]() { return stopping_ || generation_ != seen; });
+        if (stopping_)
+        {
+            break;
+        }
+        seen = generation_;
+        const Job& job = *job_;
+        lock.unlock();
+
+        const Method& method = lookUp(worker);
+        std::pair<std::size_t, std::size_t> chunk{};
+        while (takeChunk(index, chunk))
+        {
+            try
+            {
+                job(method, chunk.first, chunk.second);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> errorLock(mutex_);
+                if (!error_)
+                {
+                    error_ = std::current_exception();
+                }
+            }
+        }
+
+        lock.lock();
+        --active_;
+        if (active_ == 0u)
+        {
+            done_.notify_all();
+        }
+    }
+    lock.unlock();
+
+    // the VM is freed on the thread which used it
+    worker.methods.clear();
+    worker.vm.reset();
+}
+
+const Method& Executor::lookUp(Worker& worker)
+{
+    std::string key = module_;
+    key.append(1u, '\0').append(variable_).append(1u, '\0').append(signature_);
+    auto found = worker.methods.find(key);
+    if (found == worker.methods.end())
+    {
+        Method method = worker.vm->method(module_, variable_, signature_);
+        found = worker.methods.emplace(std::move(key), std::move(method)).first;
+    }
+    return found->second;
+}
+
+bool Executor::takeChunk(std::size_t thief, std::pair<std::size_t, std::size_t>& chunk)
+{
+    {
+        Worker& own = *workers_[thief];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.chunks.empty())
+        {
+            chunk = own.chunks.front();
+            own.chunks.pop_front();
+            return true;
+        }
+    }
+    for (std::size_t i = 1u; i < workers_.size(); ++i)
+    {
+        Worker& victim = *workers_[(thief + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.chunks.empty())
+        {
+            chunk = victim.chunks.back();
+            victim.chunks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+VMPool::Lease::Lease(VMPool* pool, std::unique_ptr<VM> vm, std::size_t uses)
+    : pool_{pool}, vm_{std::move(vm)}, uses_{uses}
+{
+}
+
+VMPool::Lease::Lease(Lease&& other) noexcept
+    : pool_{other.pool_}, vm_{std::move(other.vm_)}, uses_{other.uses_}, discard_{other.discard_}
+{
+    other.pool_ = nullptr;
+}
+
+VMPool::Lease& VMPool::Lease::operator=(Lease&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (vm_)
+        {
+            pool_->release(*this);
+        }
+        pool_ = other.pool_;
+        vm_ = std::move(other.vm_);
+        uses_ = other.uses_;
+        discard_ = other.discard_;
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+VMPool::Lease::~Lease()
+{
+    if (vm_)
+    {
+        pool_->release(*this);
+    }
+}
+
+VMPool::VMPool(Setup setup, Options options)
+    : setup_{std::move(setup)}, options_{std::move(options)}
+{
+    for (std::size_t i = 0u; i < options_.size; ++i)
+    {
+        idle_.emplace_back(create(), 0u);
+    }
+    live_ = options_.size;
+}
+
+VMPool::~VMPool() { assert(idle_.size() == live_ && "a VMPool outlived by one of its leases"); }
+
+VMPool::Lease VMPool::acquire()
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++stats_.acquisitions;
+    if (!idle_.empty())
+    {
+        ++stats_.hits;
+    }
+    while (idle_.empty() && live_ >= options_.size)
+    {
+        available_.wait(lock);
+    }
+
+    Lease lease;
+    if (!idle_.empty())
+    {
+        Idle idle = std::move(idle_.back());
+        idle_.pop_back();
+        lease = Lease(this, std::move(idle.first), idle.second);
+    }
+    else
+    {
+        // a VM was destroyed, so set up its replacement without holding up the other threads
+        ++live_;
+        lock.unlock();
+        try
+        {
+            lease = Lease(this, create(), 0u);
+        }
+        catch (...)
+        {
+            lock.lock();
+            --live_;
+            available_.notify_one();
+            throw;
+        }
+        lock.lock();
+    }
+
+    const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start);
+    stats_.totalWait += wait;
+    stats_.maxWait = std::max(stats_.maxWait, wait);
+    return lease;
+}
+
+void VMPool::refill()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (live_ < options_.size)
+    {
+        ++live_;
+        lock.unlock();
+        std::unique_ptr<VM> vm;
+        try
+        {
+            vm = create();
+        }
+        catch (...)
+        {
+            lock.lock();
+            --live_;
+            throw;
+        }
+        lock.lock();
+        idle_.emplace_back(std::move(vm), 0u);
+        available_.notify_one();
+    }
+}
+
+VMPool::Stats VMPool::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.size = live_;
+    stats.idle = idle_.size();
+    return stats;
+}
+
+std::unique_ptr<VM> VMPool::create() const
+{
+    std::unique_ptr<VM> vm(new VM(options_.config));
+    if (setup_)
+    {
+        setup_(*vm);
+    }
+    return vm;
+}
+
+void VMPool::release(Lease& lease)
+{
+    std::unique_ptr<VM> vm = std::move(lease.vm_);
+    const std::size_t uses = lease.uses_ + 1u;
+    bool keep = !lease.discard_ && (options_.maxUses == 0u || uses < options_.maxUses);
+    if (keep && options_.reset)
+    {
+        try
+        {
+            options_.reset(*vm);
+        }
+        catch (...)
+        {
+            keep = false;
+        }
+    }
+    if (keep && options_.maxLiveBytes != 0u && vm->heapStats().liveBytes > options_.maxLiveBytes)
+    {
+        // the live bytes include garbage until the VM collects it
+        vm->collectGarbage();
+        keep = vm->heapStats().liveBytes <= options_.maxLiveBytes;
+    }
+    if (!keep)
+    {
+        vm.reset();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (keep)
+    {
+        idle_.emplace_back(std::move(vm), uses);
+    }
+    else
+    {
+        --live_;
+        ++stats_.recycled;
+    }
+    available_.notify_one();
+}
+
+ModuleLoader::Source::Source(
+    const char* data,
+    std::size_t size,
+    std::size_t mappedSize,
+    bool nullTerminated)
+    : data_{data}, size_{size}, mappedSize_{mappedSize}, nullTerminated_{nullTerminated}
+{
+}
+
+ModuleLoader::Source::~Source()
+{
+#ifdef _WIN32
+    std::free(const_cast<char*>(data_));
+#else
+    if (mappedSize_ != 0u)
+    {
+        munmap(const_cast<char*>(data_), mappedSize_);
+    }
+#endif
+}
+
+ModuleLoader::ModuleLoader(std::vector<std::string> searchPaths)
+    : searchPaths_{std::move(searchPaths)}
+{
+}
+
+void ModuleLoader::addSearchPath(std::string path) { searchPaths_.push_back(std::move(path)); }
+
+std::shared_ptr<const ModuleLoader::Source> ModuleLoader::find(const std::string& module) const
+{
+    for (const std::string& directory : searchPaths_)
+    {
+        std::string path = directory;
+        if (!path.empty() && path.back() != '/')
+        {
+            path += '/';
+        }
+        path += module;
+        path += ".wren";
+
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+        {
+            continue;
+        }
+
+        path = normalizedPath(path);
+        const std::int64_t modified = modifiedTime(info);
+        std::lock_guard<std::mutex> lock(sourceCacheMutex());
+        CachedSource& cached = sourceCache()[path];
+        if (cached.source && cached.modified == modified && cached.size == info.st_size &&
+            cached.device == info.st_dev && cached.inode == info.st_ino)
+        {
+            return cached.source;
+        }
+
+        const std::size_t size = std::size_t(info.st_size);
+        const MappedFile file = mapFile(path, size);
+        if (file.data == nullptr)
+        {
+            sourceCache().erase(path);
+            return nullptr;
+        }
+        // VMs still holding the old source keep it mapped until they let go of it
+        cached.source.reset(new Source(file.data, size, file.mappedSize, isNullTerminated(size)));
+        cached.modified = modified;
+        cached.size = info.st_size;
+        cached.device = info.st_dev;
+        cached.inode = info.st_ino;
+        return cached.source;
+    }
+    return nullptr;
+}
+
+void ModuleLoader::clearCache()
+{
+    std::lock_guard<std::mutex> lock(sourceCacheMutex());
+    std::unordered_map<std::string, CachedSource>& cache = sourceCache();
+    for (auto it = cache.begin(); it != cache.end();)
+    {
+        if (it->second.source.use_count() == 1)
+        {
+            it = cache.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+ModuleBundle::ModuleBundle(const void* data, std::size_t size)
+    : data_{static_cast<const char*>(data)}, size_{size}, moduleCount_{0u}, slotCount_{0u}
+{
+    validate();
+}
+
+ModuleBundle::ModuleBundle(const std::string& path)
+    : data_{nullptr}, size_{0u}, moduleCount_{0u}, slotCount_{0u}
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+    {
+        throw std::runtime_error("wrenpp::ModuleBundle: could not find " + path);
+    }
+    const std::size_t size = std::size_t(info.st_size);
+    const MappedFile file = mapFile(path, size);
+    if (file.data == nullptr)
+    {
+        throw std::runtime_error("wrenpp::ModuleBundle: could not read " + path);
+    }
+    file_.reset(new ModuleLoader::Source(file.data, size, file.mappedSize, isNullTerminated(size)));
+    data_ = file.data;
+    size_ = size;
+    validate();
+}
+
+const char* ModuleBundle::find(const char* module, std::size_t* size) const
+{
+    const std::uint32_t hash = bundleHash(module);
+    const std::uint32_t mask = slotCount_ - 1u;
+    const char* slots = data_ + BundleHeaderSize;
+    const char* entries = slots + 4u * slotCount_;
+    for (std::uint32_t i = hash & mask;; i = (i + 1u) & mask)
+    {
+        const std::uint32_t index = readWord(slots + 4u * i);
+        if (index == 0u)
+        {
+            return nullptr;
+        }
+        const char* entry = entries + BundleEntrySize * (index - 1u);
+        if (readWord(entry) == hash && std::strcmp(data_ + readWord(entry + 4u), module) == 0)
+        {
+            if (size != nullptr)
+            {
+                *size = readWord(entry + 12u);
+            }
+            return data_ + readWord(entry + 8u);
+        }
+    }
+}
+
+std::string ModuleBundle::pack(const std::vector<std::pair<std::string, std::string>>& modules)
+{
+    // at most half of the slots are used, so that probe sequences stay short
+    std::uint32_t slotCount = 1u;
+    while (slotCount < 2u * modules.size() + 1u)
+    {
+        slotCount <<= 1u;
+    }
+    const std::size_t slotsOffset = BundleHeaderSize;
+    const std::size_t entriesOffset = slotsOffset + 4u * slotCount;
+
+    std::string bundle(entriesOffset + BundleEntrySize * modules.size(), '\0');
+    bundle.replace(0u, 4u, BundleMagic, 4u);
+    writeWord(bundle, 4u, BundleVersion);
+    writeWord(bundle, 8u, std::uint32_t(modules.size()));
+    writeWord(bundle, 12u, slotCount);
+
+    for (std::uint32_t index = 0u; index < modules.size(); ++index)
+    {
+        const std::string& name = modules[index].first;
+        const std::string& source = modules[index].second;
+        const std::uint32_t hash = bundleHash(name.c_str());
+        for (std::uint32_t i = hash & (slotCount - 1u);; i = (i + 1u) & (slotCount - 1u))
+        {
+            const std::uint32_t other = readWord(bundle.data() + slotsOffset + 4u * i);
+            if (other == 0u)
+            {
+                writeWord(bundle, slotsOffset + 4u * i, index + 1u);
+                break;
+            }
+            if (modules[other - 1u].first == name)
+            {
+                throw std::runtime_error("wrenpp::ModuleBundle: duplicate module " + name);
+            }
+        }
+
+        const std::size_t entry = entriesOffset + BundleEntrySize * index;
+        writeWord(bundle, entry, hash);
+        writeWord(bundle, entry + 4u, std::uint32_t(bundle.size()));
+        bundle.append(name.c_str(), name.size() + 1u);
+        writeWord(bundle, entry + 8u, std::uint32_t(bundle.size()));
+        writeWord(bundle, entry + 12u, std::uint32_t(source.size()));
+        bundle.append(source.c_str(), source.size() + 1u);
+        if (bundle.size() > UINT32_MAX)
+        {
+            throw std::runtime_error("wrenpp::ModuleBundle: the bundle exceeds 4 GiB");
+        }
+    }
+    return bundle;
+}
+
+void ModuleBundle::validate()
+{
+    if (size_ < BundleHeaderSize || std::memcmp(data_, BundleMagic, 4u) != 0 ||
+        readWord(data_ + 4u) != BundleVersion)
+    {
+        throwMalformedBundle();
+    }
+    moduleCount_ = readWord(data_ + 8u);
+    slotCount_ = readWord(data_ + 12u);
+    // a power of two, with at least one empty slot to end every probe sequence
+    if ((slotCount_ & (slotCount_ - 1u)) != 0u || slotCount_ <= moduleCount_)
+    {
+        throwMalformedBundle();
+    }
+    const std::uint64_t entriesOffset = BundleHeaderSize + 4ull * slotCount_;
+    if (entriesOffset + std::uint64_t(BundleEntrySize) * moduleCount_ > size_)
+    {
+        throwMalformedBundle();
+    }
+
+    std::uint32_t usedSlots = 0u;
+    for (std::uint32_t i = 0u; i < slotCount_; ++i)
+    {
+        const std::uint32_t index = readWord(data_ + BundleHeaderSize + 4u * i);
+        if (index > moduleCount_)
+        {
+            throwMalformedBundle();
+        }
+        usedSlots += index != 0u ? 1u : 0u;
+    }
+    if (usedSlots != moduleCount_)
+    {
+        throwMalformedBundle();
+    }
+
+    for (std::uint32_t i = 0u; i < moduleCount_; ++i)
+    {
+        const char* entry = data_ + entriesOffset + BundleEntrySize * i;
+        const std::uint32_t nameOffset = readWord(entry + 4u);
+        const std::uint64_t sourceEnd = std::uint64_t(readWord(entry + 8u)) + readWord(entry + 12u);
+        if (nameOffset >= size_ ||
+            std::memchr(data_ + nameOffset, '\0', size_ - nameOffset) == nullptr ||
+            sourceEnd >= size_ || data_[sourceEnd] != '\0')
+        {
+            throwMalformedBundle();
+        }
+    }
+}
+
+Config GcScheduler::configure(const Config& base)
+{
+    Config config = base;
+    config.scheduler = this;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (reports_ == 0u)
+    {
+        return config;
+    }
+    // Leave room for the growth of the two busiest idle windows on top of the settled heap, so that
+    // the heap fills up over windows, not within one.
+    const std::size_t headroom = std::size_t(2.0 * maxWindowGrowth_);
+    config.minHeapSize = settledBytes_ + headroom;
+    config.initialHeapSize = config.minHeapSize;
+    if (settledBytes_ != 0u)
+    {
+        config.heapGrowthPercent =
+            std::max(base.heapGrowthPercent, int(100u * headroom / settledBytes_) + 1);
+    }
+    return config;
+}
+
+std::size_t GcScheduler::reports() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reports_;
+}
+
+void GcScheduler::seed(double& windowGrowth, double& pausePerByte) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    windowGrowth = windowGrowth_;
+    pausePerByte = pausePerByte_;
+}
+
+void GcScheduler::report(
+    std::size_t settledBytes,
+    double windowGrowth,
+    double maxWindowGrowth,
+    double pausePerByte)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++reports_;
+    settledBytes_ = std::max(settledBytes_, settledBytes);
+    maxWindowGrowth_ = std::max(maxWindowGrowth_, maxWindowGrowth);
+    if (windowGrowth != 0.0)
+    {
+        windowGrowth_ = average(windowGrowth_, windowGrowth);
+    }
+    if (pausePerByte != 0.0)
+    {
+        pausePerByte_ = average(pausePerByte_, pausePerByte);
+    }
+}
+
+namespace
+{
+// Sizes up to 256 bytes are rounded up to a multiple of 16, larger ones to a wide class.
+constexpr std::size_t SmallClassStep = 16u;
+constexpr std::size_t SmallClassLimit = 256u;
+constexpr std::size_t SmallClassCount = SmallClassLimit / SmallClassStep;
+constexpr std::array<std::size_t, 4> WideClasses{{384u, 512u, 768u, 1024u}};
+
+static_assert(
+    SmallClassCount + WideClasses.size() == PoolAllocator::SizeClassCount,
+    "Every size class needs a block size");
+
+std::size_t sizeClassIndex(std::size_t size)
+{
+    assert(size != 0u && size <= PoolAllocator::MaxBlockSize);
+    if (size <= SmallClassLimit)
+    {
+        return (size - 1u) / SmallClassStep;
+    }
+    std::size_t index = 0u;
+    while (WideClasses[index] < size)
+    {
+        ++index;
+    }
+    return SmallClassCount + index;
+}
+
+std::size_t sizeClassBlockSize(std::size_t index)
+{
+    return index < SmallClassCount ? (index + 1u) * SmallClassStep
+                                   : WideClasses[index - SmallClassCount];
+}
+
+// A counter which is only ever written by the thread owning it, but which any thread may read.
+// Writing it costs as much as a plain increment.
+class Counter
+{
+public:
+    void increment()
+    {
+        value_.store(value_.load(std::memory_order_relaxed) + 1u, std::memory_order_relaxed);
+    }
+    std::uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> value_{0u};
+};
+
+struct FreeBlock
+{
+    FreeBlock* next;
+};
+
+// The cache which the current thread last used, of the pool with the id
+struct CacheLookup
+{
+    std::uint64_t pool;
+    void* cache;
+};
+
+thread_local CacheLookup lastCache{0u, nullptr};
+
+// pool ids are never reused, so that a stale lookup can't match a new pool at the same address
+std::atomic<std::uint64_t> nextPoolId{1u};
+} // namespace
+
+struct PoolAllocator::ThreadCache
+{
+    std::thread::id thread{};
+    std::array<FreeBlock*, SizeClassCount> freeLists{};
+    // the unused end of the slab which blocks are carved from
+    char* bump{nullptr};
+    char* bumpEnd{nullptr};
+    std::array<Counter, SizeClassCount> allocations{};
+    std::array<Counter, SizeClassCount> frees{};
+    Counter largeAllocations{};
+    Counter largeFrees{};
+};
+
+constexpr std::size_t PoolAllocator::SizeClassCount;
+constexpr std::size_t PoolAllocator::MaxBlockSize;
+
+PoolAllocator::PoolAllocator(std::size_t slabSize)
+    : id_{nextPoolId.fetch_add(1u, std::memory_order_relaxed)},
+      slabSize_{std::max(slabSize, MaxBlockSize)}
+{
+}
+
+PoolAllocator::~PoolAllocator()
+{
+    for (void* slab : slabs_)
+    {
+        std::free(slab);
+    }
+}
+
+void* PoolAllocator::reallocate(
+    void* memory,
+    std::size_t oldSize,
+    std::size_t newSize,
+    void* pool)
+{
+    PoolAllocator& self = *static_cast<PoolAllocator*>(pool);
+    ThreadCache& cache = self.threadCache();
+    if (memory == nullptr)
+    {
+        return newSize == 0u ? nullptr : self.allocate(cache, newSize);
+    }
+    if (newSize == 0u)
+    {
+        self.release(cache, memory, oldSize);
+        return nullptr;
+    }
+
+    const bool oldLarge = oldSize > MaxBlockSize;
+    const bool newLarge = newSize > MaxBlockSize;
+    if (oldLarge && newLarge)
+    {
+        return std::realloc(memory, newSize);
+    }
+    if (!oldLarge && !newLarge && sizeClassIndex(oldSize) == sizeClassIndex(newSize))
+    {
+        return memory;
+    }
+
+    void* moved = self.allocate(cache, newSize);
+    if (moved != nullptr)
+    {
+        std::memcpy(moved, memory, std::min(oldSize, newSize));
+        self.release(cache, memory, oldSize);
+    }
+    return moved;
+}
+
+PoolAllocator::Stats PoolAllocator::stats() const
+{
+    Stats stats{};
+    for (std::size_t i = 0u; i < SizeClassCount; ++i)
+    {
+        stats.sizeClasses[i].blockSize = sizeClassBlockSize(i);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<ThreadCache>& cache : caches_)
+    {
+        for (std::size_t i = 0u; i < SizeClassCount; ++i)
+        {
+            stats.sizeClasses[i].allocations += cache->allocations[i].get();
+            stats.sizeClasses[i].frees += cache->frees[i].get();
+        }
+        stats.largeAllocations += cache->largeAllocations.get();
+        stats.largeFrees += cache->largeFrees.get();
+    }
+    stats.slabBytes = slabs_.size() * slabSize_;
+    return stats;
+}
+
+PoolAllocator::ThreadCache& PoolAllocator::threadCache()
+{
+    if (lastCache.pool == id_)
+    {
+        return *static_cast<ThreadCache*>(lastCache.cache);
+    }
+
+    // the slow path is taken once per thread, or when a thread alternates between pools
+    const std::thread::id thread = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(mutex_);
+    ThreadCache* cache = nullptr;
+    for (const std::unique_ptr<ThreadCache>& candidate : caches_)
+    {
+        if (candidate->thread == thread)
+        {
+            cache = candidate.get();
+            break;
+        }
+    }
+    if (cache == nullptr)
+    {
+        caches_.emplace_back(new ThreadCache());
+        cache = caches_.back().get();
+        cache->thread = thread;
+    }
+    lastCache = CacheLookup{id_, cache};
+    return *cache;
+}
+
+void* PoolAllocator::allocate(ThreadCache& cache, std::size_t size)
+{
+    if (size > MaxBlockSize)
+    {
+        cache.largeAllocations.increment();
+        return std::malloc(size);
+    }
+
+    const std::size_t index = sizeClassIndex(size);
+    cache.allocations[index].increment();
+    FreeBlock*& head = cache.freeLists[index];
+    if (head == nullptr)
+    {
+        return carve(cache, sizeClassBlockSize(index));
+    }
+    FreeBlock* block = head;
+    head = block->next;
+    return block;
+}
+
+void PoolAllocator::release(ThreadCache& cache, void* memory, std::size_t size)
+{
+    if (size > MaxBlockSize)
+    {
+        cache.largeFrees.increment();
+        std::free(memory);
+        return;
+    }
+
+    const std::size_t index = sizeClassIndex(size);
+    cache.frees[index].increment();
+    FreeBlock* block = static_cast<FreeBlock*>(memory);
+    block->next = cache.freeLists[index];
+    cache.freeLists[index] = block;
+}
+
+void* PoolAllocator::carve(ThreadCache& cache, std::size_t blockSize)
+{
+    if (std::size_t(cache.bumpEnd - cache.bump) < blockSize)
+    {
+        // the rest of the old slab, less than a block, is left unused
+        char* slab = static_cast<char*>(std::malloc(slabSize_));
+        if (slab == nullptr)
+        {
+            return nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slabs_.push_back(slab);
+        }
+        cache.bump = slab;
+        cache.bumpEnd = slab + slabSize_;
+    }
+    void* block = cache.bump;
+    cache.bump += blockSize;
+    return block;
+}
 } // namespace wrenpp
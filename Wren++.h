@@ -4,26 +4,191 @@
 extern "C" {
 #include "wren.h"
 }
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <functional> // for std::hash
+#include <unordered_map>
+#include <utility>
+#include <functional> // for std::function
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib> // for std::size_t
 #include <cstring> // for memcpy, strcpy
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <future>
 #include <sstream>
+#include <stdexcept>
 #include <sys/stat.h>
+#include <thread>
 #include <vector>
 #include <type_traits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#define WRENPP_HAS_STRING_VIEW
+#endif
 
 namespace wrenpp
 {
 
 using LoadModuleFn = std::function<char*(const char*)>;
 using WriteFn = std::function<void(const char*)>;
-using ReallocateFn = std::function<void*(void*, std::size_t)>;
 using ErrorFn = std::function<void(WrenErrorType, const char*, int, const char*)>;
 
+/*
+ * An allocator follows Wren's reallocate contract, with the size of the existing block and the
+ * allocator's user pointer passed along:
+ *   memory == nullptr: allocate newSize bytes.
+ *   newSize == 0: free memory, which is oldSize bytes. Return nullptr.
+ *   otherwise: grow or shrink memory to newSize bytes, preserving its contents.
+ * Returned memory must be aligned for any fundamental type, like malloc's.
+ */
+using AllocatorFn =
+    void* (*)(void* memory, std::size_t oldSize, std::size_t newSize, void* userData);
+
+class GcScheduler;
+class ModuleLoader;
+class ModuleBundle;
+class Channel;
+
+// The settings for a single VM. The defaults match Wren's own.
+struct Config
+{
+    // When null, the VM allocates with std::realloc and std::free.
+    AllocatorFn allocatorFn = nullptr;
+    void* allocatorData = nullptr;
+    // The number of bytes Wren will allocate before triggering the first garbage collection.
+    std::size_t initialHeapSize = 0xA00000u;
+    // The heap size, in bytes, below which collections will not be carried out.
+    std::size_t minHeapSize = 0x100000u;
+    // After a collection, the heap may grow by this percentage before the next one.
+    int heapGrowthPercent = 50;
+    // When set, the VM reports how it used its heap to the scheduler when it's destroyed.
+    GcScheduler* scheduler = nullptr;
+    // When set, imports and VM::executeModule load modules with this, instead of
+    // VM::loadModuleFn. The loader must outlive the VM.
+    ModuleLoader* moduleLoader = nullptr;
+    // When set, modules are looked up in the bundle first. The bundle must outlive the VM.
+    const ModuleBundle* moduleBundle = nullptr;
+};
+
+// What a VM's heap has been up to, since the VM was created. With a Config allocator, sizes count
+// the bytes Wren asked for, not including the allocator's own overhead. Without one, they count
+// the bytes malloc reserved. Memory allocated outside of Wren++ calls isn't counted.
+struct HeapStats
+{
+    std::size_t liveBytes;
+    std::size_t peakBytes;
+    // the sum of every allocation and growth
+    std::uint64_t allocatedBytes;
+    std::uint64_t allocations;
+    std::uint64_t reallocations;
+    std::uint64_t frees;
+    // all collections, including the ones requested with VM::collectGarbage
+    std::uint64_t collections;
+    std::uint64_t explicitCollections;
+    // the collections made by VM::idle
+    std::uint64_t idleCollections;
+    std::chrono::nanoseconds totalPause;
+    std::chrono::nanoseconds maxPause;
+};
+
+// The calls made to one bound foreign method, getter, setter or C function. The times include
+// everything the binding called, such as Wren methods called back from C++.
+struct BindingProfile
+{
+    std::string module;
+    std::string className;
+    std::string signature;
+    bool isStatic;
+    std::uint64_t calls;
+    std::chrono::nanoseconds totalTime;
+    std::chrono::nanoseconds maxTime;
+};
+
+/*
+ * An owning pointer to an object which counts its own references. The count is kept through the
+ * free functions intrusive_ptr_add_ref(T*) and intrusive_ptr_release(T*), found by
+ * argument-dependent lookup. These are the functions boost::intrusive_ptr calls, so types
+ * written for it work here unchanged.
+ */
+template<typename T>
+class IntrusivePtr
+{
+public:
+    IntrusivePtr() = default;
+
+    // Takes a reference to the object, or adopts one which the caller holds if addRef is false.
+    explicit IntrusivePtr(T* object, bool addRef = true) : object_{object}
+    {
+        if (object_ && addRef)
+        {
+            intrusive_ptr_add_ref(object_);
+        }
+    }
+
+    IntrusivePtr(const IntrusivePtr& other) : IntrusivePtr(other.object_) {}
+    IntrusivePtr(IntrusivePtr&& other) noexcept : object_{other.object_}
+    {
+        other.object_ = nullptr;
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr other) noexcept
+    {
+        std::swap(object_, other.object_);
+        return *this;
+    }
+
+    ~IntrusivePtr()
+    {
+        if (object_)
+        {
+            intrusive_ptr_release(object_);
+        }
+    }
+
+    T* get() const { return object_; }
+    T& operator*() const { return *object_; }
+    T* operator->() const { return object_; }
+    explicit operator bool() const { return object_ != nullptr; }
+
+    // Gives up the pointer, without releasing its reference.
+    T* detach()
+    {
+        T* object = object_;
+        object_ = nullptr;
+        return object;
+    }
+
+private:
+    T* object_{nullptr};
+};
+
+/*
+ * Trivially destructible classes are bound without a finalizer, which spares the GC a call for
+ * each object it sweeps. A class whose objects Wren holds through a std::shared_ptr or
+ * IntrusivePtr needs one to release the reference, so such a class opts in by specializing this
+ * before it's bound:
+ *
+ *   namespace wrenpp {
+ *   template<>
+ *   struct SharedForeignClass<Frame> : std::true_type {};
+ *   }
+ */
+template<typename T>
+struct SharedForeignClass : std::false_type
+{
+};
+
 namespace detail
 {
 
@@ -35,16 +200,18 @@ namespace detail
  *        /___/_/
  */
 
-inline uint32_t& typeId()
+// Type ids may be assigned from several threads at once, each running its own VM.
+inline std::atomic<uint32_t>& typeId()
 {
-    static uint32_t id{0u};
+    static std::atomic<uint32_t> id{0u};
     return id;
 }
 
 template<typename T>
 uint32_t getTypeIdImpl()
 {
-    static uint32_t id = typeId()++;
+    // the initialization of a function-local static is thread-safe
+    static uint32_t id = typeId().fetch_add(1u, std::memory_order_relaxed);
     return id;
 }
 
@@ -62,128 +229,260 @@ uint32_t getTypeId()
  *                       /___/                |___/
  */
 
-inline std::vector<std::string>& classNameStorage()
-{
-    static std::vector<std::string> classNames{};
-    return classNames;
-}
-
-inline std::vector<std::string>& moduleNameStorage()
+// The Wren module and class that a C++ type is bound to.
+struct BoundName
 {
-    static std::vector<std::string> moduleNames{};
-    return moduleNames;
-}
+    std::string module;
+    std::string className;
+};
 
-inline void storeClassName(std::uint32_t index, const std::string& className)
+// Each type's name is published once, and never changes or moves after that, so reading it only
+// takes an atomic load. Binding the same type again, from any VM, keeps the first name.
+template<typename T>
+std::atomic<const BoundName*>& boundNameStorage()
 {
-    assert(classNameStorage().size() == index);
-    classNameStorage().push_back(className);
+    static std::atomic<const BoundName*> name{nullptr};
+    return name;
 }
 
-inline void storeModuleName(std::uint32_t index, const std::string& moduleName)
-{
-    assert(moduleNameStorage().size() == index);
-    moduleNameStorage().push_back(moduleName);
-}
+// Publishes the name in storage, unless a name was already published there. Serialized by a
+// mutex, which only the binding code ever takes.
+void storeBoundName(
+    std::atomic<const BoundName*>& storage,
+    const std::string& module,
+    const std::string& className);
 
 template<typename T>
-void bindTypeToClassName(const std::string& className)
+void bindTypeToName(const std::string& module, const std::string& className)
 {
-    std::uint32_t id = getTypeId<T>();
-    storeClassName(id, className);
+    std::atomic<const BoundName*>& storage = boundNameStorage<std::decay_t<T>>();
+    if (storage.load(std::memory_order_acquire) == nullptr)
+    {
+        storeBoundName(storage, module, className);
+    }
 }
 
 template<typename T>
-void bindTypeToModuleName(const std::string& moduleName)
+const BoundName& getBoundName()
 {
-    std::uint32_t id = getTypeId<T>();
-    storeModuleName(id, moduleName);
+    const BoundName* name = boundNameStorage<std::decay_t<T>>().load(std::memory_order_acquire);
+    assert(name != nullptr);
+    return *name;
 }
 
 template<typename T>
 const char* getWrenClassString()
 {
-    std::uint32_t id = getTypeId<T>();
-    assert(id < classNameStorage().size());
-    return classNameStorage()[id].c_str();
+    return getBoundName<T>().className.c_str();
 }
 
 template<typename T>
 const char* getWrenModuleString()
 {
-    std::uint32_t id = getTypeId<T>();
-    assert(id < moduleNameStorage().size());
-    return moduleNameStorage()[id].c_str();
+    return getBoundName<T>().module.c_str();
 }
 
 /*
- * The interface for getting the object pointer. The actual C++ object may lie within the Wren
- * object, or may live in C++.
+ * The header at the start of every foreign object's bytes. The actual C++ object may lie within
+ * the Wren object, right after the header, or may live in C++, in which case the header is
+ * followed by a pointer to it. The tag tells the two apart, so no vtable is needed.
  */
-class ForeignObject
+struct ForeignObject
 {
-public:
-    virtual ~ForeignObject() = default;
-    virtual void* objectPtr() = 0;
+    static constexpr std::uint8_t Pointer = 0u;
+    // held through a reference count, see ForeignObjectShared. Offsets are powers of two, so
+    // this is never one of them.
+    static constexpr std::uint8_t Shared = 0xffu;
+
+    // Pointer, Shared, or the offset of the C++ object from the start of the bytes
+    std::uint8_t tag;
 };
 
+// Places the Wren class bound to the type id in the slot. The class variable is looked up once
+// per VM, after which the slot is set from a cached handle.
+void setSlotClass(WrenVM* vm, int slot, std::uint32_t typeId, const BoundName& name);
+
 /*
  * This wraps a class object by value. The lifetimes of these objects are managed in Wren.
  */
 template<typename T>
-class ForeignObjectValue : public ForeignObject
+class ForeignObjectValue
 {
 public:
-    ForeignObjectValue() : data_() {}
+    static_assert(alignof(T) < 256u, "ForeignObjectValue: the alignment of T is too large");
 
-    virtual ~ForeignObjectValue()
+    // the object follows the one-byte header at the first offset aligned for it
+    static constexpr std::uint8_t Offset = std::uint8_t(alignof(T));
+
+    ForeignObjectValue() : header_{Offset}, data_() {}
+
+    T* object() { return reinterpret_cast<T*>(&data_); }
+
+    // Constructs the object from the arguments, right in a new foreign object in the slot.
+    template<typename... Args>
+    static void setInSlot(WrenVM* vm, int slot, Args&&... args)
     {
-        T* obj = static_cast<T*>(objectPtr());
-        obj->~T();
+        ForeignObjectValue<T>* val = newInSlot(vm, slot);
+        new (val->object()) T{std::forward<Args>(args)...};
+        val->header_.tag = Offset;
     }
 
-    void* objectPtr() override { return &data_; }
+    // Constructs the object from what make() returns, so that a returned prvalue is neither
+    // copied nor moved on its way into the foreign object.
+    template<typename Make>
+    static void emplaceInSlot(WrenVM* vm, int slot, Make&& make)
+    {
+        ForeignObjectValue<T>* val = newInSlot(vm, slot);
+        new (val->object()) T(make());
+        val->header_.tag = Offset;
+    }
 
-    template<typename... Args>
-    static void setInSlot(WrenVM* vm, int slot, Args... arg)
+private:
+    // Until its object has been constructed, the foreign object is tagged as a pointer, so that
+    // the finalizer leaves it alone if the construction throws.
+    static ForeignObjectValue<T>* newInSlot(WrenVM* vm, int slot)
     {
         wrenEnsureSlots(vm, slot + 1);
-        wrenGetVariable(vm, getWrenModuleString<T>(), getWrenClassString<T>(), slot);
+        setSlotClass(vm, slot, getTypeId<T>(), getBoundName<T>());
         ForeignObjectValue<T>* val =
             new (wrenSetSlotNewForeign(vm, slot, slot, sizeof(ForeignObjectValue<T>)))
                 ForeignObjectValue<T>();
-        new (val->objectPtr()) T{std::forward<Args>(arg)...};
+        val->header_.tag = ForeignObject::Pointer;
+        return val;
     }
 
-private:
+    ForeignObject header_;
     typename std::aligned_storage<sizeof(T), alignof(T)>::type data_;
 };
 
+template<typename T>
+constexpr std::uint8_t ForeignObjectValue<T>::Offset;
+
 /*
  * Wraps a pointer to a class object. The lifetimes of the pointed-to objects are managed by the
  * host program.
  */
 template<typename T>
-class ForeignObjectPtr : public ForeignObject
+class ForeignObjectPtr
 {
 public:
-    explicit ForeignObjectPtr(T* object) : object_{object} {}
-    virtual ~ForeignObjectPtr() = default;
+    explicit ForeignObjectPtr(T* object) : header_{ForeignObject::Pointer}, object_{object} {}
 
-    void* objectPtr() override { return object_; }
+    T* object() { return static_cast<T*>(object_); }
 
     static void setInSlot(WrenVM* vm, int slot, T* obj)
     {
         wrenEnsureSlots(vm, slot + 1);
-        wrenGetVariable(vm, getWrenModuleString<T>(), getWrenClassString<T>(), slot);
+        setSlotClass(vm, slot, getTypeId<T>(), getBoundName<T>());
         void* bytes = wrenSetSlotNewForeign(vm, slot, slot, sizeof(ForeignObjectPtr<T>));
         new (bytes) ForeignObjectPtr<T>{obj};
     }
 
 private:
-    T* object_;
+    ForeignObject header_;
+    // stored as void*, so that the layout is the same for every T
+    void* object_;
+};
+
+/*
+ * Holds a reference to a C++ object which counts its owners, through a std::shared_ptr or an
+ * IntrusivePtr. The object stays in C++, and the Wren object gives up its reference when it's
+ * finalized. Neither holder copies the object.
+ */
+class ForeignObjectShared
+{
+public:
+    ForeignObjectShared() : header_{ForeignObject::Pointer} {}
+
+    void* object() { return object_; }
+    // whether the object counts its own references, and was passed as an IntrusivePtr
+    bool intrusive() const { return intrusive_; }
+
+    // Another owner of the object, which keeps it alive past the Wren object.
+    std::shared_ptr<const void> share() { return share_(this); }
+    void release() { release_(this); }
+
+    template<typename T>
+    static void setInSlot(WrenVM* vm, int slot, std::shared_ptr<T> object)
+    {
+        ForeignObjectShared* shared = newInSlot<T>(vm, slot);
+        shared->object_ = const_cast<std::remove_const_t<T>*>(object.get());
+        new (&shared->owner_) Owner{std::move(object)};
+        shared->share_ = [](ForeignObjectShared* self) { return *self->owner(); };
+        shared->release_ = [](ForeignObjectShared* self) { self->owner()->~Owner(); };
+        shared->header_.tag = ForeignObject::Shared;
+    }
+
+    template<typename T>
+    static void setInSlot(WrenVM* vm, int slot, IntrusivePtr<T> object)
+    {
+        ForeignObjectShared* shared = newInSlot<T>(vm, slot);
+        shared->object_ = const_cast<std::remove_const_t<T>*>(object.detach());
+        shared->intrusive_ = true;
+        shared->share_ = [](ForeignObjectShared* self) {
+            IntrusivePtr<T> reference{static_cast<T*>(self->object_)};
+            return std::shared_ptr<const void>(reference.detach(), [](const void* object) {
+                IntrusivePtr<T> adopted{static_cast<T*>(const_cast<void*>(object)), false};
+            });
+        };
+        shared->release_ = [](ForeignObjectShared* self) {
+            IntrusivePtr<T> adopted{static_cast<T*>(self->object_), false};
+        };
+        shared->header_.tag = ForeignObject::Shared;
+    }
+
+private:
+    using Owner = std::shared_ptr<const void>;
+
+    // Tagged as a pointer until the holder is set, like ForeignObjectValue.
+    template<typename T>
+    static ForeignObjectShared* newInSlot(WrenVM* vm, int slot)
+    {
+        using Object = std::remove_const_t<T>;
+        static_assert(
+            !std::is_trivially_destructible<Object>::value || SharedForeignClass<Object>::value,
+            "ForeignObjectShared: specialize wrenpp::SharedForeignClass for a trivially "
+            "destructible class, so that it's bound with the finalizer which releases the "
+            "reference");
+        wrenEnsureSlots(vm, slot + 1);
+        setSlotClass(vm, slot, getTypeId<T>(), getBoundName<T>());
+        return new (wrenSetSlotNewForeign(vm, slot, slot, sizeof(ForeignObjectShared)))
+            ForeignObjectShared();
+    }
+
+    Owner* owner() { return reinterpret_cast<Owner*>(&owner_); }
+
+    ForeignObject header_;
+    void* object_{nullptr};
+    std::shared_ptr<const void> (*share_)(ForeignObjectShared*){nullptr};
+    void (*release_)(ForeignObjectShared*){nullptr};
+    bool intrusive_{false};
+    // the shared_ptr, which an IntrusivePtr doesn't need
+    typename std::aligned_storage<sizeof(Owner), alignof(Owner)>::type owner_;
 };
 
+// Returns the C++ object of a foreign object, whether it is held by value, by pointer, or through
+// a reference count.
+inline void* objectPtr(void* bytes)
+{
+    const std::uint8_t tag = static_cast<const ForeignObject*>(bytes)->tag;
+    if (tag == ForeignObject::Pointer)
+    {
+        return static_cast<ForeignObjectPtr<void>*>(bytes)->object();
+    }
+    if (tag == ForeignObject::Shared)
+    {
+        return static_cast<ForeignObjectShared*>(bytes)->object();
+    }
+    return static_cast<std::uint8_t*>(bytes) + tag;
+}
+
+template<typename T>
+T* foreignObjectInSlot(WrenVM* vm, int slot)
+{
+    return static_cast<T*>(objectPtr(wrenGetSlotForeign(vm, slot)));
+}
+
 /***
  *       ____             _                       __  __           __
  *      / __/__  _______ (_)__ ____    __ _  ___ / /_/ /  ___  ___/ /
@@ -192,24 +491,6 @@ private:
  *                       /___/
  */
 
-// given a Wren method signature, this returns a unique value
-inline std::size_t hashMethodSignature(
-    const char* module,
-    const char* className,
-    bool isStatic,
-    const char* signature)
-{
-    std::hash<std::string> hash;
-    std::string qualified(module);
-    qualified += className;
-    qualified += signature;
-    if (isStatic)
-    {
-        qualified += 's';
-    }
-    return hash(qualified);
-}
-
 template<typename F>
 struct FunctionTraits;
 
@@ -270,16 +551,59 @@ struct FunctionTraits<R (C::*)(Args...) const> : public FunctionTraits<R(Args...
 {
 };
 
+// Foreign objects held by value. A by-value parameter gets a copy of the Wren object.
 template<typename T>
 struct WrenSlotAPI
 {
+    // marks the types which are passed to Wren as foreign values
+    using ForeignValue = T;
+
     static T get(WrenVM* vm, int slot)
     {
-        ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-        return *static_cast<T*>(obj->objectPtr());
+        return *foreignObjectInSlot<T>(vm, slot);
+    }
+
+    static void set(WrenVM* vm, int slot, const T& t)
+    {
+        ForeignObjectValue<T>::setInSlot(vm, slot, t);
+    }
+
+    static void set(WrenVM* vm, int slot, T&& t)
+    {
+        ForeignObjectValue<T>::setInSlot(vm, slot, std::move(t));
     }
+};
+
+// An rvalue reference parameter gets a copy too, which the callee may move from. The script
+// may still refer to the Wren object, so it's never moved from.
+template<typename T>
+struct WrenSlotAPI<T&&>
+{
+    static T get(WrenVM* vm, int slot) { return WrenSlotAPI<T>::get(vm, slot); }
+
+    static void set(WrenVM* vm, int slot, T&& t) { WrenSlotAPI<T>::set(vm, slot, std::move(t)); }
+};
+
+template<typename T>
+struct HasForeignValue
+{
+    template<typename U>
+    static std::true_type test(typename WrenSlotAPI<U>::ForeignValue*);
+    template<typename U>
+    static std::false_type test(...);
+
+    static constexpr bool value = decltype(test<T>(nullptr))::value;
+};
 
-    static void set(WrenVM* vm, int slot, T t) { ForeignObjectValue<T>::setInSlot(vm, slot, t); }
+// Whether T is passed to Wren as a foreign value. Only class types are looked up, which keeps
+// WrenSlotAPI from being instantiated for void.
+template<typename T>
+struct IsForeignValue
+    : std::conditional_t<
+          std::is_class<T>::value,
+          HasForeignValue<T>,
+          std::false_type>
+{
 };
 
 template<typename T>
@@ -287,8 +611,7 @@ struct WrenSlotAPI<T&>
 {
     static T& get(WrenVM* vm, int slot)
     {
-        ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-        return *static_cast<T*>(obj->objectPtr());
+        return *foreignObjectInSlot<T>(vm, slot);
     }
 
     static void set(WrenVM* vm, int slot, T& t) { ForeignObjectPtr<T>::setInSlot(vm, slot, &t); }
@@ -299,13 +622,12 @@ struct WrenSlotAPI<const T&>
 {
     static const T& get(WrenVM* vm, int slot)
     {
-        ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-        return *static_cast<T*>(obj->objectPtr());
+        return *foreignObjectInSlot<T>(vm, slot);
     }
 
     static void set(WrenVM* vm, int slot, const T& t)
     {
-        ForeignObjectPtr<T>::setInSlot(vm, 0, const_cast<T*>(&t));
+        ForeignObjectPtr<T>::setInSlot(vm, slot, const_cast<T*>(&t));
     }
 };
 
@@ -314,8 +636,7 @@ struct WrenSlotAPI<T*>
 {
     static T* get(WrenVM* vm, int slot)
     {
-        ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-        return static_cast<T*>(obj->objectPtr());
+        return foreignObjectInSlot<T>(vm, slot);
     }
 
     static void set(WrenVM* vm, int slot, T* t) { ForeignObjectPtr<T>::setInSlot(vm, slot, t); }
@@ -326,8 +647,7 @@ struct WrenSlotAPI<const T*>
 {
     static const T* get(WrenVM* vm, int slot)
     {
-        ForeignObject* obj = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, slot));
-        return static_cast<const T*>(obj->objectPtr());
+        return foreignObjectInSlot<T>(vm, slot);
     }
 
     static void set(WrenVM* vm, int slot, const T* t)
@@ -336,6 +656,98 @@ struct WrenSlotAPI<const T*>
     }
 };
 
+// Thrown while reading a foreign call's arguments, when an argument can't be passed as the
+// parameter's type. The call is skipped, and its fiber aborted with the message.
+class ArgumentError : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// The reference counted holder of a Wren object, if it has one.
+inline ForeignObjectShared* sharedInSlot(WrenVM* vm, int slot)
+{
+    void* bytes = wrenGetSlotForeign(vm, slot);
+    return static_cast<const ForeignObject*>(bytes)->tag == ForeignObject::Shared
+               ? static_cast<ForeignObjectShared*>(bytes)
+               : nullptr;
+}
+
+// Foreign objects which Wren shares the ownership of. Only a Wren object holding a reference
+// count can share it with a parameter. Any other argument aborts the fiber, since Wren may free
+// the object while the callee still holds it.
+template<typename T>
+struct WrenSlotAPI<std::shared_ptr<T>>
+{
+    static std::shared_ptr<T> get(WrenVM* vm, int slot)
+    {
+        if (wrenGetSlotType(vm, slot) == WREN_TYPE_NULL)
+        {
+            return nullptr;
+        }
+        ForeignObjectShared* shared = sharedInSlot(vm, slot);
+        if (shared == nullptr)
+        {
+            throw ArgumentError("The object isn't shared with C++, and can't be passed as a "
+                                "std::shared_ptr.");
+        }
+        return std::shared_ptr<T>(shared->share(), static_cast<T*>(shared->object()));
+    }
+
+    static void set(WrenVM* vm, int slot, std::shared_ptr<T> t)
+    {
+        if (!t)
+        {
+            wrenEnsureSlots(vm, slot + 1);
+            wrenSetSlotNull(vm, slot);
+            return;
+        }
+        ForeignObjectShared::setInSlot(vm, slot, std::move(t));
+    }
+};
+
+template<typename T>
+struct WrenSlotAPI<const std::shared_ptr<T>&> : WrenSlotAPI<std::shared_ptr<T>>
+{
+};
+
+// Only an object which Wren got as an IntrusivePtr is known to be counted, and on the heap. A
+// reference to any other would end with the count deleting memory it doesn't own.
+template<typename T>
+struct WrenSlotAPI<IntrusivePtr<T>>
+{
+    static IntrusivePtr<T> get(WrenVM* vm, int slot)
+    {
+        if (wrenGetSlotType(vm, slot) == WREN_TYPE_NULL)
+        {
+            return IntrusivePtr<T>{};
+        }
+        ForeignObjectShared* shared = sharedInSlot(vm, slot);
+        if (shared == nullptr || !shared->intrusive())
+        {
+            throw ArgumentError("The object isn't reference counted by C++, and can't be passed "
+                                "as an IntrusivePtr.");
+        }
+        return IntrusivePtr<T>{static_cast<T*>(shared->object())};
+    }
+
+    static void set(WrenVM* vm, int slot, IntrusivePtr<T> t)
+    {
+        if (!t)
+        {
+            wrenEnsureSlots(vm, slot + 1);
+            wrenSetSlotNull(vm, slot);
+            return;
+        }
+        ForeignObjectShared::setInSlot(vm, slot, std::move(t));
+    }
+};
+
+template<typename T>
+struct WrenSlotAPI<const IntrusivePtr<T>&> : WrenSlotAPI<IntrusivePtr<T>>
+{
+};
+
 template<>
 struct WrenSlotAPI<float>
 {
@@ -379,6 +791,18 @@ struct WrenSlotAPI<bool>
     static void set(WrenVM* vm, int slot, bool val) { wrenSetSlotBool(vm, slot, val); }
 };
 
+// Passes a value held by a handle. A handle read from a slot must be released by the caller.
+template<>
+struct WrenSlotAPI<WrenHandle*>
+{
+    static WrenHandle* get(WrenVM* vm, int slot) { return wrenGetSlotHandle(vm, slot); }
+
+    static void set(WrenVM* vm, int slot, WrenHandle* handle)
+    {
+        wrenSetSlotHandle(vm, slot, handle);
+    }
+};
+
 template<>
 struct WrenSlotAPI<const char*>
 {
@@ -412,69 +836,312 @@ struct WrenSlotAPI<const std::string&>
     }
 };
 
-struct ExpandType
+// Reserves a slot past the ones currently in use, for reading or writing list elements.
+inline int reserveElementSlot(WrenVM* vm)
 {
-    template<typename... T>
-    ExpandType(T&&...)
+    const int slot = wrenGetSlotCount(vm);
+    wrenEnsureSlots(vm, slot + 1);
+    return slot;
+}
+
+} // namespace detail
+
+/*
+ * A non-owning view of a Wren list, for use as a foreign function parameter. The elements are
+ * read from the list as they are accessed, instead of being copied into a container up front.
+ * The view is only valid for the duration of the foreign call.
+ */
+template<typename T>
+class ListView
+{
+public:
+    class Iterator
+    {
+    public:
+        Iterator(const ListView* view, std::size_t index) : view_(view), index_(index) {}
+
+        T operator*() const { return (*view_)[index_]; }
+        Iterator& operator++()
+        {
+            ++index_;
+            return *this;
+        }
+        bool operator==(const Iterator& rhs) const { return index_ == rhs.index_; }
+        bool operator!=(const Iterator& rhs) const { return index_ != rhs.index_; }
+
+    private:
+        const ListView* view_;
+        std::size_t index_;
+    };
+
+    ListView(WrenVM* vm, int slot)
+        : vm_(vm),
+          slot_(slot),
+          elementSlot_(detail::reserveElementSlot(vm)),
+          size_(std::size_t(wrenGetListCount(vm, slot)))
+    {
+    }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0u; }
+
+    T operator[](std::size_t index) const
     {
+        assert(index < size_);
+        wrenGetListElement(vm_, slot_, int(index), elementSlot_);
+        return detail::WrenSlotAPI<T>::get(vm_, elementSlot_);
     }
+
+    Iterator begin() const { return Iterator(this, 0u); }
+    Iterator end() const { return Iterator(this, size_); }
+
+private:
+    WrenVM* vm_;
+    int slot_;
+    int elementSlot_;
+    std::size_t size_;
 };
 
-// a helper for passing arguments to Wren
-// explained here:
-// http://stackoverflow.com/questions/17339789/how-to-call-a-function-on-all-variadic-template-args
-template<typename... Args, std::size_t... index>
-void passArgumentsToWren(
-    WrenVM* vm,
-    const std::tuple<Args...>& tuple,
-    std::index_sequence<index...>)
+namespace detail
 {
-    using Traits = ParameterPackTraits<Args...>;
-    ExpandType{0,
-               (WrenSlotAPI<typename Traits::template ParameterType<index>>::set(
-                    vm, index + 1, std::get<index>(tuple)),
-                0)...};
-}
 
-template<typename Function, std::size_t... index>
-decltype(auto) invokeHelper(WrenVM* vm, Function&& f, std::index_sequence<index...>)
+template<typename T>
+struct WrenSlotAPI<ListView<T>>
 {
-    using Traits = FunctionTraits<std::remove_reference_t<decltype(f)>>;
-    return f(WrenSlotAPI<typename Traits::template ArgumentType<index>>::get(vm, index + 1)...);
-}
+    static ListView<T> get(WrenVM* vm, int slot) { return ListView<T>(vm, slot); }
+};
 
-template<typename Function>
-decltype(auto) invokeWithWrenArguments(WrenVM* vm, Function&& f)
+template<typename Container>
+void listFromSlot(WrenVM* vm, int slot, Container& container)
 {
-    constexpr auto Arity = FunctionTraits<std::remove_reference_t<decltype(f)>>::Arity;
-    return invokeHelper<Function>(vm, std::forward<Function>(f), std::make_index_sequence<Arity>{});
+    using Element = typename Container::value_type;
+    const int count = wrenGetListCount(vm, slot);
+    const int elementSlot = reserveElementSlot(vm);
+    container.reserve(std::size_t(count));
+    for (int i = 0; i < count; ++i)
+    {
+        wrenGetListElement(vm, slot, i, elementSlot);
+        container.push_back(WrenSlotAPI<Element>::get(vm, elementSlot));
+    }
 }
 
-template<typename R, typename C, typename... Args, std::size_t... index>
-decltype(auto) invokeHelper(WrenVM* vm, R (C::*f)(Args...), std::index_sequence<index...>)
+template<typename Iterator>
+void listToSlot(WrenVM* vm, int slot, Iterator first, Iterator last)
 {
-    using Traits = FunctionTraits<decltype(f)>;
-    ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-    C* obj = static_cast<C*>(objWrapper->objectPtr());
-    return (obj->*f)(
-        WrenSlotAPI<typename Traits::template ArgumentType<index>>::get(vm, index + 1)...);
+    using Element = typename std::iterator_traits<Iterator>::value_type;
+    wrenSetSlotNewList(vm, slot);
+    const int elementSlot = reserveElementSlot(vm);
+    for (; first != last; ++first)
+    {
+        WrenSlotAPI<Element>::set(vm, elementSlot, *first);
+        wrenInsertInList(vm, slot, -1, elementSlot);
+    }
 }
 
-// const variant
-template<typename R, typename C, typename... Args, std::size_t... index>
-decltype(auto) invokeHelper(WrenVM* vm, R (C::*f)(Args...) const, std::index_sequence<index...>)
-{
-    using Traits = FunctionTraits<decltype(f)>;
-    ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-    const C* obj = static_cast<const C*>(objWrapper->objectPtr());
-    return (obj->*f)(
-        WrenSlotAPI<typename Traits::template ArgumentType<index>>::get(vm, index + 1)...);
+// The Wren slot API has no access to maps, so maps are passed as lists of [key, value] pairs.
+// In Wren, a map is converted to pairs with map.map { |e| [e.key, e.value] }.toList.
+template<typename Map>
+void mapFromSlot(WrenVM* vm, int slot, Map& map)
+{
+    using Key = typename Map::key_type;
+    using Mapped = typename Map::mapped_type;
+    const int count = wrenGetListCount(vm, slot);
+    const int pairSlot = reserveElementSlot(vm);
+    const int elementSlot = reserveElementSlot(vm);
+    for (int i = 0; i < count; ++i)
+    {
+        wrenGetListElement(vm, slot, i, pairSlot);
+        assert(wrenGetListCount(vm, pairSlot) == 2);
+        wrenGetListElement(vm, pairSlot, 0, elementSlot);
+        Key key = WrenSlotAPI<Key>::get(vm, elementSlot);
+        wrenGetListElement(vm, pairSlot, 1, elementSlot);
+        map.emplace(std::move(key), WrenSlotAPI<Mapped>::get(vm, elementSlot));
+    }
 }
 
-template<typename R, typename C, typename... Args>
-decltype(auto) invokeWithWrenArguments(WrenVM* vm, R (C::*f)(Args...))
+template<typename Map>
+void mapToSlot(WrenVM* vm, int slot, const Map& map)
 {
-    constexpr auto Arity = FunctionTraits<decltype(f)>::Arity;
+    using Key = typename Map::key_type;
+    using Mapped = typename Map::mapped_type;
+    wrenSetSlotNewList(vm, slot);
+    const int pairSlot = reserveElementSlot(vm);
+    const int elementSlot = reserveElementSlot(vm);
+    for (const auto& entry : map)
+    {
+        wrenSetSlotNewList(vm, pairSlot);
+        WrenSlotAPI<Key>::set(vm, elementSlot, entry.first);
+        wrenInsertInList(vm, pairSlot, -1, elementSlot);
+        WrenSlotAPI<Mapped>::set(vm, elementSlot, entry.second);
+        wrenInsertInList(vm, pairSlot, -1, elementSlot);
+        wrenInsertInList(vm, slot, -1, pairSlot);
+    }
+}
+
+template<typename T, typename Alloc>
+struct WrenSlotAPI<std::vector<T, Alloc>>
+{
+    static std::vector<T, Alloc> get(WrenVM* vm, int slot)
+    {
+        std::vector<T, Alloc> vec;
+        listFromSlot(vm, slot, vec);
+        return vec;
+    }
+
+    static void set(WrenVM* vm, int slot, const std::vector<T, Alloc>& vec)
+    {
+        listToSlot(vm, slot, vec.begin(), vec.end());
+    }
+};
+
+template<typename T, typename Alloc>
+struct WrenSlotAPI<const std::vector<T, Alloc>&> : WrenSlotAPI<std::vector<T, Alloc>>
+{
+};
+
+template<typename T, std::size_t N>
+struct WrenSlotAPI<std::array<T, N>>
+{
+    static std::array<T, N> get(WrenVM* vm, int slot)
+    {
+        assert(wrenGetListCount(vm, slot) == int(N));
+        std::array<T, N> arr;
+        const int elementSlot = reserveElementSlot(vm);
+        for (std::size_t i = 0u; i < N; ++i)
+        {
+            wrenGetListElement(vm, slot, int(i), elementSlot);
+            arr[i] = WrenSlotAPI<T>::get(vm, elementSlot);
+        }
+        return arr;
+    }
+
+    static void set(WrenVM* vm, int slot, const std::array<T, N>& arr)
+    {
+        listToSlot(vm, slot, arr.begin(), arr.end());
+    }
+};
+
+template<typename T, std::size_t N>
+struct WrenSlotAPI<const std::array<T, N>&> : WrenSlotAPI<std::array<T, N>>
+{
+};
+
+template<typename K, typename V, typename Compare, typename Alloc>
+struct WrenSlotAPI<std::map<K, V, Compare, Alloc>>
+{
+    static std::map<K, V, Compare, Alloc> get(WrenVM* vm, int slot)
+    {
+        std::map<K, V, Compare, Alloc> map;
+        mapFromSlot(vm, slot, map);
+        return map;
+    }
+
+    static void set(WrenVM* vm, int slot, const std::map<K, V, Compare, Alloc>& map)
+    {
+        mapToSlot(vm, slot, map);
+    }
+};
+
+template<typename K, typename V, typename Compare, typename Alloc>
+struct WrenSlotAPI<const std::map<K, V, Compare, Alloc>&>
+    : WrenSlotAPI<std::map<K, V, Compare, Alloc>>
+{
+};
+
+template<typename K, typename V, typename Hash, typename Equal, typename Alloc>
+struct WrenSlotAPI<std::unordered_map<K, V, Hash, Equal, Alloc>>
+{
+    static std::unordered_map<K, V, Hash, Equal, Alloc> get(WrenVM* vm, int slot)
+    {
+        std::unordered_map<K, V, Hash, Equal, Alloc> map;
+        map.reserve(std::size_t(wrenGetListCount(vm, slot)));
+        mapFromSlot(vm, slot, map);
+        return map;
+    }
+
+    static void set(WrenVM* vm, int slot, const std::unordered_map<K, V, Hash, Equal, Alloc>& map)
+    {
+        mapToSlot(vm, slot, map);
+    }
+};
+
+template<typename K, typename V, typename Hash, typename Equal, typename Alloc>
+struct WrenSlotAPI<const std::unordered_map<K, V, Hash, Equal, Alloc>&>
+    : WrenSlotAPI<std::unordered_map<K, V, Hash, Equal, Alloc>>
+{
+};
+
+struct ExpandType
+{
+    template<typename... T>
+    ExpandType(T&&...)
+    {
+    }
+};
+
+// a helper for passing arguments to Wren
+// explained here:
+// http://stackoverflow.com/questions/17339789/how-to-call-a-function-on-all-variadic-template-args
+template<typename... Args, std::size_t... index>
+void passArgumentsToWren(
+    WrenVM* vm,
+    const std::tuple<Args...>& tuple,
+    std::index_sequence<index...>)
+{
+    using Traits = ParameterPackTraits<Args...>;
+    ExpandType{0,
+               (WrenSlotAPI<typename Traits::template ParameterType<index>>::set(
+                    vm, index + 1, std::get<index>(tuple)),
+                0)...};
+}
+
+// like passArgumentsToWren, but forwards the arguments straight into the slots without storing
+// them in a tuple first
+template<typename... Args, std::size_t... index>
+void forwardArgumentsToWren(WrenVM* vm, std::index_sequence<index...>, Args&&... args)
+{
+    (void)vm; // unused when there are no arguments
+    ExpandType{
+        0, (WrenSlotAPI<std::decay_t<Args>>::set(vm, index + 1, std::forward<Args>(args)), 0)...};
+}
+
+template<typename Function, std::size_t... index>
+decltype(auto) invokeHelper(WrenVM* vm, Function&& f, std::index_sequence<index...>)
+{
+    using Traits = FunctionTraits<std::remove_reference_t<decltype(f)>>;
+    return f(WrenSlotAPI<typename Traits::template ArgumentType<index>>::get(vm, index + 1)...);
+}
+
+template<typename Function>
+decltype(auto) invokeWithWrenArguments(WrenVM* vm, Function&& f)
+{
+    constexpr auto Arity = FunctionTraits<std::remove_reference_t<decltype(f)>>::Arity;
+    return invokeHelper<Function>(vm, std::forward<Function>(f), std::make_index_sequence<Arity>{});
+}
+
+template<typename R, typename C, typename... Args, std::size_t... index>
+decltype(auto) invokeHelper(WrenVM* vm, R (C::*f)(Args...), std::index_sequence<index...>)
+{
+    using Traits = FunctionTraits<decltype(f)>;
+    C* obj = foreignObjectInSlot<C>(vm, 0);
+    return (obj->*f)(
+        WrenSlotAPI<typename Traits::template ArgumentType<index>>::get(vm, index + 1)...);
+}
+
+// const variant
+template<typename R, typename C, typename... Args, std::size_t... index>
+decltype(auto) invokeHelper(WrenVM* vm, R (C::*f)(Args...) const, std::index_sequence<index...>)
+{
+    using Traits = FunctionTraits<decltype(f)>;
+    const C* obj = foreignObjectInSlot<C>(vm, 0);
+    return (obj->*f)(
+        WrenSlotAPI<typename Traits::template ArgumentType<index>>::get(vm, index + 1)...);
+}
+
+template<typename R, typename C, typename... Args>
+decltype(auto) invokeWithWrenArguments(WrenVM* vm, R (C::*f)(Args...))
+{
+    constexpr auto Arity = FunctionTraits<decltype(f)>::Arity;
     return invokeHelper(vm, f, std::make_index_sequence<Arity>{});
 }
 
@@ -531,6 +1198,45 @@ struct InvokeWithoutReturningIf<false>
     }
 };
 
+// A free function's foreign value is constructed right in the return slot. Slot 0 only holds the
+// class there, which stays alive in its module once the slot is overwritten. A method's receiver
+// might not, so a method's foreign value is moved into the slot after the call instead.
+template<typename R, bool = IsForeignValue<R>::value>
+struct ReturnFromFunction
+{
+    template<typename Function>
+    static void invoke(WrenVM* vm, Function f)
+    {
+        InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, f);
+    }
+};
+
+template<typename R>
+struct ReturnFromFunction<R, true>
+{
+    template<typename Function>
+    static void invoke(WrenVM* vm, Function f)
+    {
+        ForeignObjectValue<R>::emplaceInSlot(
+            vm, 0, [vm, f]() -> R { return invokeWithWrenArguments(vm, Function(f)); });
+    }
+};
+
+// Makes a foreign call, or aborts its fiber if one of the call's arguments was refused.
+template<typename Call>
+void abortOnArgumentError(WrenVM* vm, Call&& call)
+{
+    try
+    {
+        call();
+    }
+    catch (const ArgumentError& error)
+    {
+        wrenSetSlotString(vm, 0, error.what());
+        wrenAbortFiber(vm, 0);
+    }
+}
+
 template<typename Signature, Signature>
 struct ForeignMethodWrapper;
 
@@ -541,7 +1247,7 @@ struct ForeignMethodWrapper<R (*)(Args...), f>
 
     static void call(WrenVM* vm)
     {
-        InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, f);
+        abortOnArgumentError(vm, [vm] { ReturnFromFunction<R>::invoke(vm, f); });
     }
 };
 
@@ -552,7 +1258,8 @@ struct ForeignMethodWrapper<R (C::*)(Args...), m>
 
     static void call(WrenVM* vm)
     {
-        InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, m);
+        abortOnArgumentError(
+            vm, [vm] { InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, m); });
     }
 };
 
@@ -563,7 +1270,101 @@ struct ForeignMethodWrapper<R (C::*)(Args...) const, m>
 
     static void call(WrenVM* vm)
     {
-        InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, m);
+        abortOnArgumentError(
+            vm, [vm] { InvokeWithoutReturningIf<std::is_void<R>::value>::invoke(vm, m); });
+    }
+};
+
+// A result which a FiberScheduler waits on, before resuming the fiber which awaits it.
+class AsyncOperation
+{
+public:
+    virtual ~AsyncOperation() = default;
+
+    virtual bool ready() const = 0;
+    // Writes the result to the slot, or throws what the operation failed with.
+    virtual void setResult(WrenVM* vm, int slot) = 0;
+};
+
+template<typename R>
+class FutureOperation : public AsyncOperation
+{
+public:
+    explicit FutureOperation(std::future<R> future) : future_{std::move(future)} {}
+
+    bool ready() const override
+    {
+        return !future_.valid() ||
+               future_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void setResult(WrenVM* vm, int slot) override { WrenSlotAPI<R>::set(vm, slot, future_.get()); }
+
+private:
+    std::future<R> future_;
+};
+
+template<>
+class FutureOperation<void> : public AsyncOperation
+{
+public:
+    explicit FutureOperation(std::future<void> future) : future_{std::move(future)} {}
+
+    bool ready() const override
+    {
+        return !future_.valid() ||
+               future_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void setResult(WrenVM* vm, int slot) override
+    {
+        future_.get();
+        wrenSetSlotNull(vm, slot);
+    }
+
+private:
+    std::future<void> future_;
+};
+
+// Hands the operation to the VM's FiberScheduler, and returns the ticket to await it by in slot 0.
+void startAsync(WrenVM* vm, std::unique_ptr<AsyncOperation> operation);
+
+template<typename Signature, Signature>
+struct AsyncMethodWrapper;
+
+// free function variant
+template<typename R, typename... Args, std::future<R> (*f)(Args...)>
+struct AsyncMethodWrapper<std::future<R> (*)(Args...), f>
+{
+    static void call(WrenVM* vm)
+    {
+        abortOnArgumentError(vm, [vm] {
+            startAsync(vm, std::make_unique<FutureOperation<R>>(invokeWithWrenArguments(vm, f)));
+        });
+    }
+};
+
+// method variant
+template<typename R, typename C, typename... Args, std::future<R> (C::*m)(Args...)>
+struct AsyncMethodWrapper<std::future<R> (C::*)(Args...), m>
+{
+    static void call(WrenVM* vm)
+    {
+        abortOnArgumentError(vm, [vm] {
+            startAsync(vm, std::make_unique<FutureOperation<R>>(invokeWithWrenArguments(vm, m)));
+        });
+    }
+};
+
+// const method variant
+template<typename R, typename C, typename... Args, std::future<R> (C::*m)(Args...) const>
+struct AsyncMethodWrapper<std::future<R> (C::*)(Args...) const, m>
+{
+    static void call(WrenVM* vm)
+    {
+        abortOnArgumentError(vm, [vm] {
+            startAsync(vm, std::make_unique<FutureOperation<R>>(invokeWithWrenArguments(vm, m)));
+        });
     }
 };
 
@@ -601,17 +1402,15 @@ struct SetFieldInSlot<false>
 template<typename T, typename U, U T::*Field>
 void propertyGetter(WrenVM* vm)
 {
-    ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-    T* obj = static_cast<T*>(objWrapper->objectPtr());
+    T* obj = foreignObjectInSlot<T>(vm, 0);
     SetFieldInSlot<std::is_class<U>::value>::set(vm, 0, obj->*Field);
 }
 
 template<typename T, typename U, U T::*Field>
 void propertySetter(WrenVM* vm)
 {
-    ForeignObject* objWrapper = static_cast<ForeignObject*>(wrenGetSlotForeign(vm, 0));
-    T* obj = static_cast<T*>(objWrapper->objectPtr());
-    obj->*Field = WrenSlotAPI<U>::get(vm, 1);
+    T* obj = foreignObjectInSlot<T>(vm, 0);
+    abortOnArgumentError(vm, [vm, obj] { obj->*Field = WrenSlotAPI<U>::get(vm, 1); });
 }
 
 /***
@@ -622,15 +1421,6 @@ void propertySetter(WrenVM* vm)
  *                       /___/
  */
 
-// given a Wren class signature, this returns a unique value
-inline std::size_t hashClassSignature(const char* module, const char* className)
-{
-    std::hash<std::string> hash;
-    std::string qualified(module);
-    qualified += className;
-    return hash(qualified);
-}
-
 template<typename T, typename... Args, std::size_t... index>
 void construct(WrenVM* vm, void* memory, std::index_sequence<index...>)
 {
@@ -638,7 +1428,7 @@ void construct(WrenVM* vm, void* memory, std::index_sequence<index...>)
     ForeignObjectValue<T>* obj = new (memory) ForeignObjectValue<T>{};
     constexpr std::size_t arity = sizeof...(Args);
     wrenEnsureSlots(vm, arity);
-    new (obj->objectPtr())
+    new (obj->object())
         T{WrenSlotAPI<typename Traits::template ParameterType<index>>::get(vm, index + 1)...};
 }
 
@@ -646,16 +1436,45 @@ template<typename T, typename... Args>
 void allocate(WrenVM* vm)
 {
     void* memory = wrenSetSlotNewForeign(vm, 0, 0, sizeof(ForeignObjectValue<T>));
-    construct<T, Args...>(
-        vm, memory, std::make_index_sequence<ParameterPackTraits<Args...>::size>{});
+    try
+    {
+        construct<T, Args...>(
+            vm, memory, std::make_index_sequence<ParameterPackTraits<Args...>::size>{});
+    }
+    catch (const ArgumentError& error)
+    {
+        // the object was never constructed, which the finalizer must know. The new object stays
+        // in slot 0, as Wren expects it there.
+        static_cast<ForeignObject*>(memory)->tag = ForeignObject::Pointer;
+        wrenSetSlotString(vm, 1, error.what());
+        wrenAbortFiber(vm, 1);
+    }
 }
 
 template<typename T>
 void finalize(void* bytes)
 {
-    // might be a foreign value OR ptr
-    ForeignObject* objWrapper = static_cast<ForeignObject*>(bytes);
-    objWrapper->~ForeignObject();
+    // might be a foreign value, ptr or shared reference. Values are owned by Wren, and a shared
+    // reference is Wren's share of the ownership.
+    const std::uint8_t tag = static_cast<ForeignObject*>(bytes)->tag;
+    if (tag == ForeignObject::Shared)
+    {
+        static_cast<ForeignObjectShared*>(bytes)->release();
+    }
+    else if (tag != ForeignObject::Pointer)
+    {
+        static_cast<ForeignObjectValue<T>*>(bytes)->object()->~T();
+    }
+}
+
+// Trivially destructible types need no finalizer, which spares the GC from calling one for each
+// object it sweeps, unless Wren may hold them shared.
+template<typename T>
+constexpr WrenFinalizerFn finalizerFor()
+{
+    return std::is_trivially_destructible<T>::value && !SharedForeignClass<T>::value
+        ? nullptr
+        : &finalize<T>;
 }
 
 void registerFunction(
@@ -698,12 +1517,59 @@ inline std::string fileToString(const std::string& file)
 class VM;
 class Method;
 
+enum class Result
+{
+    Success,
+    CompileError,
+    RuntimeError
+};
+
+namespace detail
+{
+struct Heap;
+
+// Makes the VM's heap the one that new Wren allocations on this thread come from. Wren doesn't
+// tell its reallocate hook which VM is allocating, so every wrenpp call into Wren holds one of
+// these. Scopes nest, so a foreign method may call into another VM.
+class HeapScope
+{
+public:
+    explicit HeapScope(WrenVM* vm);
+    HeapScope(const HeapScope&) = delete;
+    HeapScope& operator=(const HeapScope&) = delete;
+    ~HeapScope();
+
+private:
+    Heap* previous_;
+};
+
+inline Result toResult(WrenInterpretResult result)
+{
+    switch (result)
+    {
+    case WREN_RESULT_COMPILE_ERROR: return Result::CompileError;
+    case WREN_RESULT_RUNTIME_ERROR: return Result::RuntimeError;
+    default: return Result::Success;
+    }
+}
+} // namespace detail
+
 // This class can hold any one of the values corresponding to the WrenType
 // enum defined in wren.h
+//
+// Strings of up to InlineCapacity characters are stored within the Value itself, longer ones
+// are allocated with std::malloc. A Value can also borrow a string which is owned by Wren, see
+// borrowSlot.
 class Value
 {
 public:
+    static constexpr std::size_t InlineCapacity = 23u;
+
     Value() = default;
+    Value(const Value&);
+    Value(Value&&) noexcept;
+    Value& operator=(const Value&);
+    Value& operator=(Value&&) noexcept;
     ~Value();
 
     Value(bool);
@@ -712,19 +1578,46 @@ public:
     Value(int);
     Value(unsigned int);
     Value(const char*);
+    Value(const char*, std::size_t length);
     template<typename T>
     Value(T*);
 
+    // Copies the value in the slot. Foreign objects are stored as a pointer to the C++ object.
+    static Value fromSlot(WrenVM* vm, int slot);
+    // Like fromSlot, but a string is not copied. The Value points to the string owned by Wren,
+    // and is only valid until the next call into the VM.
+    static Value borrowSlot(WrenVM* vm, int slot);
+
     template<typename T>
     T as() const;
 
+    inline WrenType type() const { return type_; }
+    inline bool isBorrowed() const { return mode_ == StringMode::Borrowed; }
+
 private:
-    template<typename T>
-    void set(T&& t);
+    enum class StringMode : std::uint8_t
+    {
+        Inline,
+        Heap,
+        Borrowed
+    };
+
+    void assignString(const char* str, std::size_t length);
+    void release();
+    const char* string() const;
 
     WrenType type_{WREN_TYPE_NULL};
-    char* string_{nullptr};
-    std::uint8_t storage_[8]{0u, 0u, 0u, 0u, 0u, 0u, 0u, 0u};
+    StringMode mode_{StringMode::Inline};
+    std::uint32_t length_{0u};
+    union
+    {
+        double number;
+        bool boolean;
+        void* foreign;
+        char* heap;
+        const char* borrowed;
+        char inline_[InlineCapacity + 1u];
+    } data_{};
 };
 
 extern Value null;
@@ -750,7 +1643,48 @@ public:
     template<typename... Args>
     Value operator()(Args... args) const;
 
+    /**
+     * Typed call path. The arguments are forwarded straight into the slots, and the return
+     * value is read directly from the return slot as R, without going through a Value.
+     * Throws std::runtime_error if the call aborts. The error itself has already been
+     * reported through VM::errorFn by then. A const char* result points into the VM, and is
+     * only valid until the next call into it.
+     */
+    template<typename R, typename... Args>
+    R call(Args&&... args) const;
+
+    // Like call<R>, but ignores the return value and reports errors by return code.
+    template<typename... Args>
+    Result callVoid(Args&&... args) const;
+
+    /**
+     * Batched call paths, for calling the method over many inputs at once. Call i passes
+     * element i of each argument column, and writes its return value to results[i]. Returns
+     * the number of calls made. If that's less than count, the next call aborted, and the error
+     * has been reported through VM::errorFn.
+     */
+    template<typename R, typename... Args>
+    std::size_t callBatch(std::size_t count, R* results, const Args*... columns) const;
+    template<typename... Args>
+    std::size_t callBatchVoid(std::size_t count, const Args*... columns) const;
+    // Calls the method on receivers[i], instead of on the variable it was looked up in.
+    template<typename R, typename... Args>
+    std::size_t callBatchOn(
+        WrenHandle* const* receivers,
+        std::size_t count,
+        R* results,
+        const Args*... columns) const;
+
 private:
+    template<typename... Args>
+    WrenInterpretResult invoke(Args&&... args) const;
+    template<typename R, typename... Args>
+    std::size_t batch(
+        WrenHandle* const* receivers,
+        std::size_t count,
+        R* results,
+        const Args*... columns) const;
+
     mutable VM* vm_{nullptr};
     mutable WrenHandle* method_{nullptr};
     mutable WrenHandle* variable_{nullptr};
@@ -767,6 +1701,9 @@ public:
 
     template<typename F, F f>
     ClassContext& bindFunction(bool isStatic, std::string signature);
+    // f returns a std::future, see FiberScheduler
+    template<typename F, F f>
+    ClassContext& bindAsyncFunction(bool isStatic, std::string signature);
     ClassContext& bindCFunction(bool isStatic, std::string signature, WrenForeignMethodFn function);
 
     ModuleContext& endClass();
@@ -786,6 +1723,9 @@ public:
 
     template<typename F, F f>
     RegisteredClassContext& bindMethod(bool isStatic, std::string signature);
+    // f returns a std::future, see FiberScheduler
+    template<typename F, F f>
+    RegisteredClassContext& bindAsyncMethod(bool isStatic, std::string signature);
     template<typename U, U T::*Field>
     RegisteredClassContext& bindGetter(std::string signature);
     template<typename U, U T::*Field>
@@ -818,17 +1758,11 @@ private:
     std::string name_;
 };
 
-enum class Result
-{
-    Success,
-    CompileError,
-    RuntimeError
-};
-
 class VM
 {
 public:
     VM();
+    explicit VM(const Config&);
     VM(const VM&) = delete;
     VM(VM&&);
     VM& operator=(const VM&) = delete;
@@ -844,25 +1778,58 @@ public:
 
     void collectGarbage();
 
+    HeapStats heapStats() const;
+
     /**
-     * The signature consists of the name of the method, followed by a
-     * parenthesis enclosed list of of underscores representing each argument.
+     * Tells the VM that the host is idle for about the given time, for instance between frames.
+     * The VM collects garbage now if its heap is expected to fill up before the next call,
+     * and the collection is expected to fit in the budget. Returns whether it collected.
      */
-    Method method(
-        const std::string& module,
+    bool idle(std::chrono::nanoseconds budget);
+
+    /**
+     * Binding profiling is compiled in by defining WRENPP_PROFILE_BINDINGS when building
+     * Wren++.cpp, and is then switched on and off per VM. Without the define, these do nothing
+     * and no bindings are reported.
+     */
+    void setBindingProfiling(bool enabled);
+    void resetBindingProfile();
+    // the bindings which took the most time in total, most first
+    std::vector<BindingProfile> hottestBindings(std::size_t count) const;
+    // writes hottestBindings(count) as a table, followed by the number of unprofiled bindings
+    void reportHottestBindings(std::ostream& out, std::size_t count) const;
+    // The bindings Wren looked up after the limit set by WRENPP_PROFILED_BINDINGS was reached,
+    // 4096 by default, which are called without being profiled.
+    std::size_t unprofiledBindings() const;
+
+    /**
+     * The signature consists of the name of the method, followed by a
+     * parenthesis enclosed list of of underscores representing each argument.
+     */
+    Method method(
+        const std::string& module,
         const std::string& variable,
         const std::string& signature);
 
     ModuleContext beginModule(std::string name);
 
+    /**
+     * Makes the channel one of the VM's inbound channels. drainChannels calls the Fn in the
+     * variable with each message which arrives on it. The VM must be the channel's only
+     * receiver, and bindChannels must have been called on it. The channel must outlive the VM.
+     */
+    void listen(Channel& channel, const std::string& module, const std::string& variable);
+
+    // Delivers up to maxPerChannel messages from each inbound channel, and returns how many it
+    // delivered. A handler which aborts is reported through errorFn, and the rest still run. A
+    // message which can't be read is reported the same way, and dropped.
+    std::size_t drainChannels(std::size_t maxPerChannel = 64u);
+
+    // These are shared by every VM. Set them before any VM is created, and don't change them while
+    // VMs are running on other threads. Heap settings are per VM, see Config.
     static LoadModuleFn loadModuleFn;
     static WriteFn writeFn;
-    static ReallocateFn reallocateFn;
     static ErrorFn errorFn;
-    static std::size_t initialHeapSize;
-    static std::size_t minHeapSize;
-    static int heapGrowthPercent;
-    static std::size_t chunkSize;
 
 private:
     friend class ModuleContext;
@@ -875,50 +1842,93 @@ private:
 };
 
 template<typename T>
-Value::Value(T* t) : type_{WREN_TYPE_FOREIGN}, string_{nullptr}
+Value::Value(T* t) : type_{WREN_TYPE_FOREIGN}
 {
-    std::memcpy(storage_, &t, sizeof(T*));
+    data_.foreign = const_cast<std::remove_const_t<T>*>(t);
+}
+
+inline const char* Value::string() const
+{
+    switch (mode_)
+    {
+    case StringMode::Heap: return data_.heap;
+    case StringMode::Borrowed: return data_.borrowed;
+    default: return data_.inline_;
+    }
+}
+
+// foreign object pointers
+template<typename T>
+T Value::as() const
+{
+    static_assert(std::is_pointer<T>::value, "Value::as<T>: the type is invalid!");
+    assert(type_ == WREN_TYPE_FOREIGN);
+    return static_cast<T>(data_.foreign);
 }
 
 template<>
 inline float Value::as<float>() const
 {
     assert(type_ == WREN_TYPE_NUM);
-    return *reinterpret_cast<const float*>(&storage_[0]);
+    return float(data_.number);
 }
 
-template<typename T>
-void Value::set(T&& t)
+template<>
+inline double Value::as<double>() const
+{
+    assert(type_ == WREN_TYPE_NUM);
+    return data_.number;
+}
+
+template<>
+inline int Value::as<int>() const
 {
-    static_assert(sizeof(T) <= 8, "The type is invalid!");
-    std::memcpy(storage_, &t, sizeof(T));
+    assert(type_ == WREN_TYPE_NUM);
+    return int(data_.number);
 }
 
 template<>
-inline double Value::as<double>() const
+inline unsigned Value::as<unsigned>() const
 {
     assert(type_ == WREN_TYPE_NUM);
-    return *reinterpret_cast<const double*>(&storage_[0]);
+    return unsigned(data_.number);
 }
 
 template<>
 inline bool Value::as<bool>() const
 {
     assert(type_ == WREN_TYPE_BOOL);
-    return *reinterpret_cast<const bool*>(&storage_[0]);
+    return data_.boolean;
 }
 
 template<>
 inline const char* Value::as<const char*>() const
 {
     assert(type_ == WREN_TYPE_STRING);
-    return string_;
+    return string();
+}
+
+template<>
+inline std::string Value::as<std::string>() const
+{
+    assert(type_ == WREN_TYPE_STRING);
+    return std::string(string(), length_);
 }
 
+#ifdef WRENPP_HAS_STRING_VIEW
+template<>
+inline std::string_view Value::as<std::string_view>() const
+{
+    assert(type_ == WREN_TYPE_STRING);
+    return std::string_view(string(), length_);
+}
+#endif
+
 template<typename... Args>
 Value Method::operator()(Args... args) const
 {
     assert(vm_ && variable_ && method_);
+    detail::HeapScope scope(vm_->ptr());
     constexpr const std::size_t Arity = sizeof...(Args);
     wrenEnsureSlots(vm_->ptr(), Arity + 1u);
     wrenSetSlotHandle(vm_->ptr(), 0, variable_);
@@ -934,10 +1944,10 @@ Value Method::operator()(Args... args) const
 
         switch (type)
         {
-        case WREN_TYPE_BOOL: return Value(wrenGetSlotBool(vm_->ptr(), 0));
-        case WREN_TYPE_NUM: return Value(wrenGetSlotDouble(vm_->ptr(), 0));
-        case WREN_TYPE_STRING: return Value(wrenGetSlotString(vm_->ptr(), 0));
-        case WREN_TYPE_FOREIGN: return Value(wrenGetSlotForeign(vm_->ptr(), 0));
+        case WREN_TYPE_BOOL:
+        case WREN_TYPE_NUM:
+        case WREN_TYPE_STRING:
+        case WREN_TYPE_FOREIGN: return Value::fromSlot(vm_->ptr(), 0);
         default: assert("Invalid Wren type"); break;
         }
     }
@@ -945,19 +1955,126 @@ Value Method::operator()(Args... args) const
     return null;
 }
 
+template<typename... Args>
+WrenInterpretResult Method::invoke(Args&&... args) const
+{
+    assert(vm_ && variable_ && method_);
+    detail::HeapScope scope(vm_->ptr());
+    constexpr const std::size_t Arity = sizeof...(Args);
+    wrenEnsureSlots(vm_->ptr(), Arity + 1u);
+    wrenSetSlotHandle(vm_->ptr(), 0, variable_);
+    detail::forwardArgumentsToWren(
+        vm_->ptr(), std::make_index_sequence<Arity>{}, std::forward<Args>(args)...);
+    return wrenCall(vm_->ptr(), method_);
+}
+
+template<typename R, typename... Args>
+R Method::call(Args&&... args) const
+{
+    static_assert(!std::is_void<R>::value, "Use callVoid to ignore the return value");
+    // reading a container allocates slots, which the VM's heap has to see too
+    detail::HeapScope scope(vm_->ptr());
+    if (invoke(std::forward<Args>(args)...) != WREN_RESULT_SUCCESS)
+    {
+        throw std::runtime_error("wrenpp::Method::call: the called method aborted");
+    }
+    return detail::WrenSlotAPI<R>::get(vm_->ptr(), 0);
+}
+
+template<typename... Args>
+Result Method::callVoid(Args&&... args) const
+{
+    return detail::toResult(invoke(std::forward<Args>(args)...));
+}
+
+namespace detail
+{
+template<typename... Args, std::size_t... index>
+void setBatchArguments(
+    WrenVM* vm,
+    std::size_t item,
+    std::index_sequence<index...>,
+    const Args*... columns)
+{
+    ExpandType{0, (WrenSlotAPI<Args>::set(vm, int(index + 1), columns[item]), 0)...};
+}
+
+template<typename R>
+struct BatchResult
+{
+    static_assert(
+        !std::is_same<R, const char*>::value,
+        "A string in a slot only lives until the next call, collect std::string instead");
+
+    static void store(WrenVM* vm, R* results, std::size_t item)
+    {
+        results[item] = WrenSlotAPI<R>::get(vm, 0);
+    }
+};
+
+template<>
+struct BatchResult<void>
+{
+    static void store(WrenVM*, void*, std::size_t) {}
+};
+} // namespace detail
+
+template<typename R, typename... Args>
+std::size_t Method::batch(
+    WrenHandle* const* receivers,
+    std::size_t count,
+    R* results,
+    const Args*... columns) const
+{
+    assert(vm_ && variable_ && method_);
+    WrenVM* vm = vm_->ptr();
+    detail::HeapScope scope(vm);
+    constexpr const std::size_t Arity = sizeof...(Args);
+    for (std::size_t i = 0u; i < count; ++i)
+    {
+        // a call leaves just the return slot behind, but the slots don't need to grow again
+        wrenEnsureSlots(vm, Arity + 1u);
+        wrenSetSlotHandle(vm, 0, receivers ? receivers[i] : variable_);
+        detail::setBatchArguments(vm, i, std::make_index_sequence<Arity>{}, columns...);
+        if (wrenCall(vm, method_) != WREN_RESULT_SUCCESS)
+        {
+            return i;
+        }
+        detail::BatchResult<R>::store(vm, results, i);
+    }
+    return count;
+}
+
+template<typename R, typename... Args>
+std::size_t Method::callBatch(std::size_t count, R* results, const Args*... columns) const
+{
+    return batch(nullptr, count, results, columns...);
+}
+
+template<typename... Args>
+std::size_t Method::callBatchVoid(std::size_t count, const Args*... columns) const
+{
+    return batch(nullptr, count, static_cast<void*>(nullptr), columns...);
+}
+
+template<typename R, typename... Args>
+std::size_t Method::callBatchOn(
+    WrenHandle* const* receivers,
+    std::size_t count,
+    R* results,
+    const Args*... columns) const
+{
+    return batch(receivers, count, results, columns...);
+}
+
 template<typename T, typename... Args>
 RegisteredClassContext<T> ModuleContext::bindClass(std::string className)
 {
-    WrenForeignClassMethods wrapper{&detail::allocate<T, Args...>, &detail::finalize<T>};
+    WrenForeignClassMethods wrapper{&detail::allocate<T, Args...>, detail::finalizerFor<T>()};
     detail::registerClass(vm_, name_, className, wrapper);
 
     // store the name and module if not already done
-    if (detail::classNameStorage().size() == detail::getTypeId<T>())
-    {
-        assert(detail::classNameStorage().size() == detail::moduleNameStorage().size());
-        detail::bindTypeToModuleName<T>(name_);
-        detail::bindTypeToClassName<T>(className);
-    }
+    detail::bindTypeToName<T>(name_, className);
     return RegisteredClassContext<T>(className, *this);
 }
 
@@ -974,6 +2091,19 @@ ClassContext& ClassContext::bindFunction(bool isStatic, std::string s)
     return *this;
 }
 
+template<typename F, F f>
+ClassContext& ClassContext::bindAsyncFunction(bool isStatic, std::string s)
+{
+    detail::registerFunction(
+        module_.vm_,
+        module_.name_,
+        class_,
+        isStatic,
+        s,
+        detail::AsyncMethodWrapper<decltype(f), f>::call);
+    return *this;
+}
+
 template<typename T>
 template<typename F, F f>
 RegisteredClassContext<T>& RegisteredClassContext<T>::bindMethod(bool isStatic, std::string s)
@@ -988,6 +2118,20 @@ RegisteredClassContext<T>& RegisteredClassContext<T>::bindMethod(bool isStatic,
     return *this;
 }
 
+template<typename T>
+template<typename F, F f>
+RegisteredClassContext<T>& RegisteredClassContext<T>::bindAsyncMethod(bool isStatic, std::string s)
+{
+    detail::registerFunction(
+        module_.vm_,
+        module_.name_,
+        class_,
+        isStatic,
+        s,
+        detail::AsyncMethodWrapper<decltype(f), f>::call);
+    return *this;
+}
+
 template<typename T>
 template<typename U, U T::*Field>
 RegisteredClassContext<T>& RegisteredClassContext<T>::bindGetter(std::string s)
@@ -1019,8 +2163,7 @@ RegisteredClassContext<T>& RegisteredClassContext<T>::bindCFunction(
 template<typename T>
 T* getSlotForeign(WrenVM* vm, int slot)
 {
-    detail::ForeignObject* obj = static_cast<detail::ForeignObject*>(wrenGetSlotForeign(vm, slot));
-    return static_cast<T*>(obj->objectPtr());
+    return detail::foreignObjectInSlot<T>(vm, slot);
 }
 
 template<typename T>
@@ -1029,12 +2172,924 @@ void setSlotForeignValue(WrenVM* vm, int slot, const T& obj)
     detail::ForeignObjectValue<T>::setInSlot(vm, slot, obj);
 }
 
+// Constructs the object from the arguments, right in the new Wren object.
+template<typename T, typename... Args>
+void emplaceSlotForeignValue(WrenVM* vm, int slot, Args&&... args)
+{
+    detail::ForeignObjectValue<T>::setInSlot(vm, slot, std::forward<Args>(args)...);
+}
+
 template<typename T>
 void setSlotForeignPtr(WrenVM* vm, int slot, T* obj)
 {
     detail::ForeignObjectPtr<T>::setInSlot(vm, slot, obj);
 }
 
+namespace detail
+{
+
+// integer arrays are scaled in double precision, floating point arrays in their own precision
+template<typename T>
+using KernelScalar = std::conditional_t<std::is_floating_point<T>::value, T, double>;
+
+// The kernels are plain loops over contiguous memory, which the compiler can vectorize. The
+// reductions use several independent accumulators, so that they aren't serialized on one add.
+template<typename T>
+double sumKernel(const T* data, std::size_t count)
+{
+    double acc[4] = {0.0, 0.0, 0.0, 0.0};
+    std::size_t i = 0u;
+    for (; i + 4u <= count; i += 4u)
+    {
+        acc[0] += double(data[i]);
+        acc[1] += double(data[i + 1u]);
+        acc[2] += double(data[i + 2u]);
+        acc[3] += double(data[i + 3u]);
+    }
+    for (; i < count; ++i)
+    {
+        acc[0] += double(data[i]);
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+template<typename T>
+void scaleKernel(T* data, std::size_t count, KernelScalar<T> factor)
+{
+    for (std::size_t i = 0u; i < count; ++i)
+    {
+        data[i] = T(KernelScalar<T>(data[i]) * factor);
+    }
+}
+
+// y = a * x + y
+template<typename T>
+void axpyKernel(KernelScalar<T> a, const T* x, T* y, std::size_t count)
+{
+    for (std::size_t i = 0u; i < count; ++i)
+    {
+        y[i] = T(a * KernelScalar<T>(x[i]) + KernelScalar<T>(y[i]));
+    }
+}
+
+template<typename T, typename Compare>
+T reduceKernel(const T* data, std::size_t count, Compare compare)
+{
+    assert(count > 0u);
+    T acc[4] = {data[0], data[0], data[0], data[0]};
+    std::size_t i = 0u;
+    for (; i + 4u <= count; i += 4u)
+    {
+        for (std::size_t j = 0u; j < 4u; ++j)
+        {
+            acc[j] = compare(data[i + j], acc[j]) ? data[i + j] : acc[j];
+        }
+    }
+    for (; i < count; ++i)
+    {
+        acc[0] = compare(data[i], acc[0]) ? data[i] : acc[0];
+    }
+    T result = acc[0];
+    for (std::size_t j = 1u; j < 4u; ++j)
+    {
+        result = compare(acc[j], result) ? acc[j] : result;
+    }
+    return result;
+}
+
+} // namespace detail
+
+/*
+ * A fixed-size array of numbers, which Wren can operate on in bulk without converting each
+ * element to a Num in a List. The array either owns its elements, or is a view of memory owned
+ * by the host. Bind the family to a VM with bindTypedArrays, and pass a view to Wren by pointer,
+ * for instance with setSlotForeignPtr, or by value if the Wren object should own the view.
+ */
+template<typename T>
+class TypedArray
+{
+public:
+    using ValueType = T;
+
+    // An owning, zero-filled array of `count` elements
+    explicit TypedArray(unsigned count)
+        : storage_(count, T(0)), data_(storage_.data()), count_(count)
+    {
+    }
+
+    // A view of host memory. The memory must outlive the array.
+    TypedArray(T* data, std::size_t count) : storage_(), data_(data), count_(count) {}
+
+    TypedArray(const TypedArray& other)
+        : storage_(other.storage_),
+          data_(other.isView() ? other.data_ : storage_.data()),
+          count_(other.count_)
+    {
+    }
+
+    TypedArray& operator=(const TypedArray& rhs)
+    {
+        if (&rhs != this)
+        {
+            storage_ = rhs.storage_;
+            data_ = rhs.isView() ? rhs.data_ : storage_.data();
+            count_ = rhs.count_;
+        }
+        return *this;
+    }
+
+    // Moving hands the elements over, which a vector keeps in place, and leaves other empty.
+    TypedArray(TypedArray&& other) noexcept
+        : storage_(std::move(other.storage_)), data_(other.data_), count_(other.count_)
+    {
+        other.data_ = other.storage_.data();
+        other.count_ = 0u;
+    }
+
+    TypedArray& operator=(TypedArray&& rhs) noexcept
+    {
+        if (&rhs != this)
+        {
+            storage_ = std::move(rhs.storage_);
+            data_ = rhs.data_;
+            count_ = rhs.count_;
+            rhs.data_ = rhs.storage_.data();
+            rhs.count_ = 0u;
+        }
+        return *this;
+    }
+
+    ~TypedArray() = default;
+
+    bool isView() const { return data_ != storage_.data(); }
+    std::size_t count() const { return count_; }
+    T* data() { return data_; }
+    const T* data() const { return data_; }
+    T& operator[](std::size_t i) { return data_[i]; }
+    const T& operator[](std::size_t i) const { return data_[i]; }
+
+    void fill(double value) { std::fill_n(data_, count_, T(value)); }
+
+    // Copies as many elements from source as fit. The arrays may overlap.
+    void copy(const TypedArray& source)
+    {
+        std::memmove(data_, source.data_, std::min(count_, source.count_) * sizeof(T));
+    }
+
+    double sum() const { return detail::sumKernel(data_, count_); }
+
+    void scale(double factor)
+    {
+        detail::scaleKernel(data_, count_, detail::KernelScalar<T>(factor));
+    }
+
+    // this = a * x + this, over as many elements as both arrays have
+    void axpy(double a, const TypedArray& x)
+    {
+        detail::axpyKernel(detail::KernelScalar<T>(a), x.data_, data_, std::min(count_, x.count_));
+    }
+
+    // NaN for an empty array
+    double min() const
+    {
+        return count_ == 0u ? std::nan("")
+                            : double(detail::reduceKernel(
+                                  data_, count_, [](T lhs, T rhs) { return lhs < rhs; }));
+    }
+
+    double max() const
+    {
+        return count_ == 0u ? std::nan("")
+                            : double(detail::reduceKernel(
+                                  data_, count_, [](T lhs, T rhs) { return lhs > rhs; }));
+    }
+
+    std::vector<T> toVector() const { return std::vector<T>(data_, data_ + count_); }
+
+private:
+    std::vector<T> storage_;
+    T* data_;
+    std::size_t count_;
+};
+
+using Float32Array = TypedArray<float>;
+using Float64Array = TypedArray<double>;
+using Int32Array = TypedArray<std::int32_t>;
+
+/**
+ * Binds Float32Array, Float64Array and Int32Array to the VM, and declares them in the given
+ * module, so that scripts can import them from it.
+ */
+Result bindTypedArrays(VM& vm, const std::string& module = "typed_array");
+
+/*
+ * An immutable block of bytes, which VMs on any number of threads can hold at once without
+ * copying it. Copies of a buffer share the bytes, which are freed along with the last copy. A Wren
+ * object holding a buffer gives up its reference when it's finalized. Bind the class to a VM with
+ * bindSharedBuffers, and pass buffers to Wren by value.
+ */
+class SharedBuffer
+{
+public:
+    // an empty buffer
+    SharedBuffer() = default;
+
+    // Copies the bytes, once.
+    SharedBuffer(const void* data, std::size_t size);
+
+    // Takes over the elements, without copying them.
+    template<typename T>
+    explicit SharedBuffer(std::vector<T>&& elements)
+    {
+        static_assert(
+            std::is_trivially_copyable<T>::value, "SharedBuffer only holds plain old data");
+        auto owner = std::make_shared<const std::vector<T>>(std::move(elements));
+        data_ = reinterpret_cast<const char*>(owner->data());
+        size_ = owner->size() * sizeof(T);
+        owner_ = std::move(owner);
+    }
+
+    const void* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    // the number of whole elements of type T the buffer holds
+    template<typename T>
+    std::size_t count() const
+    {
+        return size_ / sizeof(T);
+    }
+
+    // Reads element `index` of the buffer, viewed as an array of T.
+    template<typename T>
+    T read(std::size_t index) const
+    {
+        assert(index < count<T>());
+        T value;
+        std::memcpy(&value, data_ + index * sizeof(T), sizeof(T));
+        return value;
+    }
+
+    // the number of buffers, and Wren objects, sharing these bytes
+    long useCount() const { return owner_.use_count(); }
+
+private:
+    std::shared_ptr<const void> owner_{};
+    const char* data_{nullptr};
+    std::size_t size_{0u};
+};
+
+/*
+ * Holds the current version of a SharedBuffer, which the host replaces with new versions while
+ * VMs are reading it. Whoever gets the current buffer keeps a consistent snapshot, until they let
+ * go of it: publishing doesn't wait for readers, and old versions are freed by the last reader.
+ * Pass the holder to Wren by pointer, with setSlotForeignPtr, once bindSharedBuffers has bound
+ * it. It must outlive the Wren objects pointing at it.
+ */
+class PublishedBuffer
+{
+public:
+    explicit PublishedBuffer(SharedBuffer initial = SharedBuffer{});
+    PublishedBuffer(const PublishedBuffer&) = delete;
+    PublishedBuffer& operator=(const PublishedBuffer&) = delete;
+
+    // Replaces the current buffer, and returns the new version number.
+    std::uint64_t publish(SharedBuffer buffer);
+
+    SharedBuffer current() const;
+    // starts at zero, and counts the publishes
+    std::uint64_t version() const;
+
+private:
+    struct Version
+    {
+        SharedBuffer buffer;
+        std::uint64_t number;
+    };
+
+    // The lock is only held to swap or copy the pointer, never while a buffer is read.
+    mutable std::mutex mutex_{};
+    std::shared_ptr<const Version> current_;
+};
+
+/**
+ * Binds SharedBuffer and PublishedBuffer to the VM, and declares them in the given module:
+ *
+ *   foreign class SharedBuffer {
+ *     foreign byteCount
+ *     foreign uint8(index)   // element `index` of the buffer, viewed as an array of that type
+ *     foreign int32(index)
+ *     foreign float32(index)
+ *     foreign float64(index)
+ *   }
+ *   foreign class PublishedBuffer {
+ *     foreign current        // a SharedBuffer
+ *     foreign version
+ *   }
+ */
+Result bindSharedBuffers(VM& vm, const std::string& module = "shared_buffer");
+
+/**
+ * A bounded queue of messages between VMs, which any number of threads may send to, and one VM
+ * at a time receives from. Sending and receiving don't lock. Scripts send numbers, strings,
+ * booleans, null, and lists and maps of those, which are written in Serializer's format and
+ * rebuilt by the receiver. The host owns the channel, and passes it to Wren by pointer, once
+ * bindChannels has bound the class:
+ *
+ *   channel.send(value)    // waits while the channel is full
+ *   channel.trySend(value) // returns false instead
+ *   channel.receive()      // waits while the channel is empty
+ *
+ * Waiting parks the fiber until the next FiberScheduler tick at which it can go on, so it only
+ * works in a fiber the scheduler runs.
+ */
+class Channel
+{
+public:
+    // The capacity is rounded up to a power of two.
+    explicit Channel(std::size_t capacity = 1024u);
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    std::size_t capacity() const { return mask_ + 1u; }
+    // These are only exact when no other thread sends or receives at the same time.
+    bool empty() const;
+    bool full() const;
+
+    // Messages from the host. These return false if the channel is full.
+    bool trySend(double number);
+    bool trySend(const std::string& string);
+
+    // Serialized messages, as written and read by scripts. Receiving a message which isn't in
+    // Serializer's format, or holds a foreign object, aborts the receiving fiber.
+    bool trySendMessage(std::string message);
+    bool tryReceiveMessage(std::string& message);
+
+private:
+    struct Cell
+    {
+        // Tells which lap of the ring the cell is ready for: sending to position p waits for the
+        // cell to hold p, and receiving from it waits for p + 1.
+        std::atomic<std::size_t> sequence;
+        std::string message;
+    };
+
+    // The senders and the receiver update these from different threads, so each is kept a cache
+    // line apart from the other, and from the fields after them.
+    struct Position
+    {
+        std::atomic<std::size_t> value{0u};
+        char padding[64u - sizeof(std::atomic<std::size_t>)];
+    };
+
+    Position send_{};
+    Position receive_{};
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+};
+
+// Binds Channel to the VM, and declares it in the given module, which imports ValueTokens from
+// the "wrenpp/values" module to flatten messages and rebuild them.
+Result bindChannels(VM& vm, const std::string& module = "channel");
+
+namespace detail
+{
+
+// how Serializer writes the objects of a foreign class, and rebuilds them
+struct ForeignHook
+{
+    std::function<void(WrenVM*, int slot, std::string& bytes)> save;
+    std::function<void(WrenVM*, int slot, const std::string& bytes)> load;
+};
+
+// the hooks by class name
+using ForeignHooks = std::unordered_map<std::string, ForeignHook>;
+
+} // namespace detail
+
+/**
+ * Writes Wren values to bytes, and rebuilds them, in the same VM or another one. Values are
+ * numbers, strings, booleans, null, lists and maps of those, and foreign objects of the classes
+ * registered with registerForeign. A list or map is written once, however many times it's
+ * referenced, and the value is rebuilt with the same sharing and cycles. Values are walked
+ * without recursion, so nesting only costs memory. Channel messages use the same format.
+ *
+ * The serializer calls into the VM, so it can't be used from a foreign method. Both directions
+ * throw std::runtime_error on values or bytes they can't handle.
+ */
+class Serializer
+{
+public:
+    explicit Serializer(VM& vm);
+    Serializer(const Serializer&) = delete;
+    Serializer& operator=(const Serializer&) = delete;
+
+    /**
+     * Serializes foreign objects of type T, which is bound to Wren as the class of the given
+     * name, by the bytes save returns. load rebuilds an object from them. The class must be bound
+     * in the VM which deserializes the object.
+     */
+    template<typename T>
+    void registerForeign(
+        const std::string& className,
+        std::function<std::string(const T&)> save,
+        std::function<T(const std::string&)> load);
+
+    std::string serialize(WrenHandle* value);
+    std::string serialize(const std::string& module, const std::string& variable);
+
+    // Rebuilds the value, and returns a handle to it, which the caller releases.
+    WrenHandle* deserialize(const std::string& bytes);
+
+private:
+    WrenVM* vm_;
+    detail::ForeignHooks hooks_{};
+};
+
+template<typename T>
+void Serializer::registerForeign(
+    const std::string& className,
+    std::function<std::string(const T&)> save,
+    std::function<T(const std::string&)> load)
+{
+    detail::ForeignHook& hook = hooks_[className];
+    hook.save = [save](WrenVM* vm, int slot, std::string& bytes) {
+        bytes = save(*detail::foreignObjectInSlot<T>(vm, slot));
+    };
+    hook.load = [load](WrenVM* vm, int slot, const std::string& bytes) {
+        emplaceSlotForeignValue<T>(vm, slot, load(bytes));
+    };
+}
+
+/**
+ * Runs many script fibers on one VM, taking turns. A foreign method bound with bindAsyncFunction
+ * or bindAsyncMethod returns a std::future, and Wren gets a ticket for it. A fiber suspends
+ * itself until the future is ready with Scheduler.await(ticket), which returns the future's
+ * value, or aborts the fiber with the exception's message. The scheduler declares the Scheduler
+ * class in the given module:
+ *
+ *   import "scheduler" for Scheduler
+ *   Scheduler.spawn {
+ *     var text = Scheduler.await(Files.read("level.txt"))
+ *     Scheduler.yield() // lets the other fibers run until the next tick
+ *   }
+ *
+ * Await and yield only work in a fiber the scheduler runs, not in a fiber it has created.
+ * A VM has at most one scheduler, which must be destroyed before the VM.
+ */
+class FiberScheduler
+{
+public:
+    explicit FiberScheduler(VM& vm, const std::string& module = "scheduler");
+    FiberScheduler(const FiberScheduler&) = delete;
+    FiberScheduler& operator=(const FiberScheduler&) = delete;
+    ~FiberScheduler();
+
+    // Runs the Fn, or any object with a call() method, in the variable in a new fiber.
+    void spawn(const std::string& module, const std::string& variable);
+
+    /**
+     * Resumes the fibers which are ready to run, until each of them has had a turn or the
+     * budget is spent. At least one fiber runs, if one is ready. Fibers which are spawned or
+     * yield during the tick run on the next one. Returns the number of fibers resumed.
+     */
+    std::size_t tick(std::chrono::nanoseconds budget);
+
+    // the fibers which haven't finished yet, including the ones awaiting a result
+    std::size_t fiberCount() const;
+    std::size_t awaitingCount() const;
+
+private:
+    struct Task;
+
+    friend void detail::startAsync(WrenVM*, std::unique_ptr<detail::AsyncOperation>);
+    static void addFiber(WrenVM* vm);
+    void resume(std::unique_ptr<Task> task);
+    void finish(std::unique_ptr<Task> task);
+
+    WrenVM* vm_;
+    WrenHandle* class_{nullptr};
+    WrenHandle* spawn_{nullptr};
+    WrenHandle* resume_{nullptr};
+    std::deque<std::unique_ptr<Task>> ready_{};
+    std::vector<std::unique_ptr<Task>> awaiting_{};
+    // the operations which haven't been awaited yet, by ticket
+    std::unordered_map<std::uint64_t, std::unique_ptr<detail::AsyncOperation>> operations_{};
+    std::uint64_t nextTicket_{1u};
+    // the task being resumed, which owns the operations it starts
+    Task* running_{nullptr};
+};
+
+/**
+ * Runs a Wren method over many inputs on several threads. Each worker thread owns a VM, which
+ * the setup function binds and loads modules into on that thread. The inputs are split into
+ * chunks, and a worker which runs out of chunks steals them from the others.
+ *
+ *   wrenpp::Executor executor{4, [](wrenpp::VM& vm) { vm.executeModule("transform"); }};
+ *   executor.map("transform", "scale", "call(_)", count, results.data(), inputs.data());
+ */
+class Executor
+{
+public:
+    using Setup = std::function<void(VM&)>;
+
+    // Throws whatever a setup call threw, once every worker has stopped.
+    Executor(std::size_t workers, Setup setup, const Config& config = Config{});
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    ~Executor();
+
+    std::size_t workerCount() const { return workers_.size(); }
+
+    // The number of items in a chunk. The default, zero, makes about eight chunks per worker.
+    void setChunkSize(std::size_t size) { chunkSize_ = size; }
+
+    /**
+     * Calls the method once per item, on every worker's VM, like Method::callBatch does on one:
+     * call i is passed element i of each column, and writes results[i]. Returns once every call
+     * has been made, with the number of calls which aborted. Their errors have been reported
+     * through VM::errorFn, which must be safe to call from several threads.
+     */
+    template<typename R, typename... Args>
+    std::size_t map(
+        const std::string& module,
+        const std::string& variable,
+        const std::string& signature,
+        std::size_t count,
+        R* results,
+        const Args*... columns);
+
+private:
+    struct Worker;
+    using Job = std::function<void(const Method&, std::size_t begin, std::size_t end)>;
+
+    void run(
+        const std::string& module,
+        const std::string& variable,
+        const std::string& signature,
+        std::size_t count,
+        const Job& job);
+    void work(std::size_t index, const Setup& setup, const Config& config);
+    void stop();
+    const Method& lookUp(Worker& worker);
+    bool takeChunk(std::size_t thief, std::pair<std::size_t, std::size_t>& chunk);
+
+    std::vector<std::unique_ptr<Worker>> workers_{};
+    std::size_t chunkSize_{0u};
+    // one map at a time
+    std::mutex runMutex_{};
+
+    // the current job. Workers wait for the generation to change.
+    std::mutex mutex_{};
+    std::condition_variable wake_{};
+    std::condition_variable done_{};
+    std::uint64_t generation_{0u};
+    bool stopping_{false};
+    const Job* job_{nullptr};
+    std::string module_{};
+    std::string variable_{};
+    std::string signature_{};
+    // the workers which might still take a chunk of the job
+    std::size_t active_{0u};
+    std::size_t started_{0u};
+    std::exception_ptr error_{};
+};
+
+template<typename R, typename... Args>
+std::size_t Executor::map(
+    const std::string& module,
+    const std::string& variable,
+    const std::string& signature,
+    std::size_t count,
+    R* results,
+    const Args*... columns)
+{
+    std::atomic<std::size_t> failures{0u};
+    const Job job = [&failures, results, columns...](
+                        const Method& method, std::size_t begin, std::size_t end) {
+        while (begin < end)
+        {
+            begin += method.callBatch(end - begin, results + begin, (columns + begin)...);
+            if (begin < end)
+            {
+                // skip the call which aborted
+                ++failures;
+                ++begin;
+            }
+        }
+    };
+    run(module, variable, signature, count, job);
+    return failures;
+}
+
+struct VMPoolOptions
+{
+    // the number of VMs the pool holds, leased or not
+    std::size_t size = 4u;
+    // When not zero, a VM is destroyed instead of being returned after this many leases.
+    std::size_t maxUses = 0u;
+    // When not zero, a VM which still holds more than this many live bytes after a
+    // collection is destroyed instead of being returned.
+    std::size_t maxLiveBytes = 0u;
+    // Called on a VM returned to the pool, to clear whatever state the last lease left in its
+    // modules. A VM is destroyed instead if this throws.
+    std::function<void(VM&)> reset = nullptr;
+    Config config{};
+};
+
+/**
+ * Keeps VMs which have already been set up, for running many short scripts without binding and
+ * loading the same modules each time. A lease hands out a VM, and returns it to the pool when it
+ * ends. Leases must end before the pool is destroyed.
+ *
+ *   wrenpp::VMPool pool{[](wrenpp::VM& vm) { bindGame(vm); vm.executeModule("game"); }};
+ *   {
+ *       wrenpp::VMPool::Lease vm = pool.acquire();
+ *       vm->executeString(request);
+ *   }
+ */
+class VMPool
+{
+public:
+    using Setup = std::function<void(VM&)>;
+    using Options = VMPoolOptions;
+
+
+    struct Stats
+    {
+        // the VMs which exist, leased or idle
+        std::size_t size;
+        std::size_t idle;
+        std::uint64_t acquisitions;
+        // the acquisitions which found an idle VM right away
+        std::uint64_t hits;
+        // the VMs destroyed by maxUses, maxLiveBytes, reset, or Lease::discard
+        std::uint64_t recycled;
+        // the time spent in acquire, waiting for a VM or setting up a new one
+        std::chrono::nanoseconds totalWait;
+        std::chrono::nanoseconds maxWait;
+
+        double hitRate() const { return acquisitions == 0u ? 0.0 : double(hits) / acquisitions; }
+    };
+
+    class Lease
+    {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        ~Lease();
+
+        VM& operator*() const { return *vm_; }
+        VM* operator->() const { return vm_.get(); }
+        explicit operator bool() const { return vm_ != nullptr; }
+
+        // Destroys the VM when the lease ends, instead of returning it to the pool.
+        void discard() { discard_ = true; }
+
+    private:
+        friend class VMPool;
+        Lease(VMPool* pool, std::unique_ptr<VM> vm, std::size_t uses);
+
+        VMPool* pool_{nullptr};
+        std::unique_ptr<VM> vm_{};
+        std::size_t uses_{0u};
+        bool discard_{false};
+    };
+
+    // Sets up options.size VMs up front. Throws whatever setup throws.
+    explicit VMPool(Setup setup, Options options = Options{});
+    VMPool(const VMPool&) = delete;
+    VMPool& operator=(const VMPool&) = delete;
+    ~VMPool();
+
+    // Waits until a VM is idle, or sets up a new one to replace a destroyed VM.
+    Lease acquire();
+
+    // Sets up new VMs in place of the ones which were destroyed, until the pool is full again.
+    // The next acquisitions then don't have to.
+    void refill();
+
+    Stats stats() const;
+
+private:
+    using Idle = std::pair<std::unique_ptr<VM>, std::size_t>;
+
+    std::unique_ptr<VM> create() const;
+    void release(Lease& lease);
+
+    Setup setup_;
+    Options options_;
+
+    mutable std::mutex mutex_{};
+    std::condition_variable available_{};
+    std::vector<Idle> idle_{};
+    // the VMs which exist, or are being set up
+    std::size_t live_{0u};
+    Stats stats_{};
+};
+
+/**
+ * Loads modules from a list of directories, searched in order. Sources are memory-mapped once,
+ * and cached for the whole process by their absolute path, so that every VM importing a module
+ * shares the same pages. A cached source is mapped again once the file's modification time, size
+ * or inode changes. Wren takes ownership of the source of an import, so an import copies the source into
+ * the VM's heap once; executeModule doesn't copy it at all.
+ *
+ *   wrenpp::ModuleLoader loader{{"scripts", "scripts/lib"}};
+ *   wrenpp::Config config;
+ *   config.moduleLoader = &loader;
+ */
+class ModuleLoader
+{
+public:
+    // A module's source, which stays mapped for as long as it's referenced. Update module files by
+    // renaming a new file over them: a mapping sees writes made to the file in place, and reading
+    // a mapping past the end of a file which has since been truncated crashes.
+    class Source
+    {
+    public:
+        Source(const Source&) = delete;
+        Source& operator=(const Source&) = delete;
+        ~Source();
+
+        const char* data() const { return data_; }
+        std::size_t size() const { return size_; }
+        // Whether data()[size()] can be read, and is '\0'. The pages of a mapping are zero-filled
+        // past the end of the file, so this holds unless the file fills its last page.
+        bool isNullTerminated() const { return nullTerminated_; }
+
+    private:
+        friend class ModuleLoader;
+        friend class ModuleBundle;
+        Source(const char* data, std::size_t size, std::size_t mappedSize, bool nullTerminated);
+
+        const char* data_;
+        std::size_t size_;
+        // zero if the source isn't mapped
+        std::size_t mappedSize_;
+        bool nullTerminated_;
+    };
+
+    explicit ModuleLoader(std::vector<std::string> searchPaths = {"."});
+
+    void addSearchPath(std::string path);
+
+    // The source of module.wren, from the first search path which has it. Null if none does.
+    std::shared_ptr<const Source> find(const std::string& module) const;
+
+    // Unmaps every cached source which isn't referenced anymore.
+    static void clearCache();
+
+private:
+    std::vector<std::string> searchPaths_;
+};
+
+/**
+ * Many modules packed into a single file, or into a byte array compiled into the program, so
+ * that a VM can start up without touching the file system for every module. A bundle holds a
+ * hash table of the module names, followed by the null-terminated sources, so finding a module
+ * takes constant time and executeModule reads its source in place. Bundles are made with
+ * ModuleBundle::pack, or the wrenpack tool.
+ *
+ *   wrenpp::ModuleBundle bundle{"scripts.wrenb"};
+ *   wrenpp::Config config;
+ *   config.moduleBundle = &bundle;
+ *
+ * Constructing a bundle from malformed data throws std::runtime_error.
+ */
+class ModuleBundle
+{
+public:
+    // A bundle in memory, which must outlive the bundle and any VM using it.
+    ModuleBundle(const void* data, std::size_t size);
+    // Maps the bundle file into memory.
+    explicit ModuleBundle(const std::string& path);
+
+    // The module's null-terminated source, or null if the bundle doesn't have the module.
+    const char* find(const char* module, std::size_t* size = nullptr) const;
+
+    std::size_t moduleCount() const { return moduleCount_; }
+
+    // Packs (module name, source) pairs into a bundle.
+    static std::string pack(const std::vector<std::pair<std::string, std::string>>& modules);
+
+private:
+    void validate();
+
+    // the mapped file, when the bundle was loaded from one
+    std::shared_ptr<const ModuleLoader::Source> file_;
+    const char* data_;
+    std::size_t size_;
+    std::uint32_t moduleCount_;
+    std::uint32_t slotCount_;
+};
+
+/**
+ * Learns how VMs running the same scripts use their heap, and sizes the heaps of new VMs to
+ * match. The VMs report to the scheduler when they are destroyed, so that the threshold of the
+ * next VM sits above the heap which survives collections, with room for two of the busiest idle
+ * windows seen on top. Together with VM::idle, this moves collections out of busy windows.
+ * A scheduler may be shared by VMs on any number of threads, and must outlive them.
+ *
+ *   wrenpp::GcScheduler scheduler;
+ *   wrenpp::VM vm{scheduler.configure()};
+ */
+class GcScheduler
+{
+public:
+    GcScheduler() = default;
+    GcScheduler(const GcScheduler&) = delete;
+    GcScheduler& operator=(const GcScheduler&) = delete;
+
+    // The base config, with heap settings learned from the VMs which have reported so far, and
+    // with this scheduler set. Until a VM has reported, the heap settings are base's.
+    Config configure(const Config& base = Config{});
+
+    // The number of VMs which have reported.
+    std::size_t reports() const;
+
+    // For the VMs: the averages a new VM starts out with, and a destroyed VM's observations.
+    void seed(double& windowGrowth, double& pausePerByte) const;
+    void report(
+        std::size_t settledBytes,
+        double windowGrowth,
+        double maxWindowGrowth,
+        double pausePerByte);
+
+private:
+    mutable std::mutex mutex_;
+    std::size_t reports_{0u};
+    std::size_t settledBytes_{0u};
+    double windowGrowth_{0.0};
+    double maxWindowGrowth_{0.0};
+    double pausePerByte_{0.0};
+};
+
+/**
+ * An allocator for Config::allocatorFn, which serves the small, same-sized allocations Wren makes
+ * for its objects from size-classed free lists, and passes larger ones on to malloc.
+ *
+ * Each thread keeps its own free lists, so any number of VMs may share one pool without locking
+ * on the allocation path; memory freed on a thread is reused by that thread. The pool must
+ * outlive every VM which uses it. Memory is only returned to the system when the pool is
+ * destroyed.
+ *
+ *   wrenpp::PoolAllocator pool;
+ *   wrenpp::Config config;
+ *   config.allocatorFn = wrenpp::PoolAllocator::reallocate;
+ *   config.allocatorData = &pool;
+ */
+class PoolAllocator
+{
+public:
+    // Blocks are 16 byte multiples up to 256 bytes, followed by four wider classes.
+    static constexpr std::size_t SizeClassCount = 20u;
+    static constexpr std::size_t MaxBlockSize = 1024u;
+
+    struct SizeClassStats
+    {
+        std::size_t blockSize;
+        std::uint64_t allocations;
+        std::uint64_t frees;
+    };
+
+    struct Stats
+    {
+        std::array<SizeClassStats, SizeClassCount> sizeClasses;
+        // allocations larger than MaxBlockSize
+        std::uint64_t largeAllocations;
+        std::uint64_t largeFrees;
+        // the memory held in slabs, out of which blocks are carved
+        std::size_t slabBytes;
+    };
+
+    explicit PoolAllocator(std::size_t slabSize = 0x10000u);
+    PoolAllocator(const PoolAllocator&) = delete;
+    PoolAllocator& operator=(const PoolAllocator&) = delete;
+    ~PoolAllocator();
+
+    // An AllocatorFn, with the pool as its user data.
+    static void* reallocate(void* memory, std::size_t oldSize, std::size_t newSize, void* pool);
+
+    // The counters of every thread which has used the pool. Safe to call while the pool is in use,
+    // in which case the counters are a close, but not necessarily consistent, snapshot.
+    Stats stats() const;
+
+private:
+    struct ThreadCache;
+
+    ThreadCache& threadCache();
+    void* allocate(ThreadCache& cache, std::size_t size);
+    void release(ThreadCache& cache, void* memory, std::size_t size);
+    void* carve(ThreadCache& cache, std::size_t blockSize);
+
+    const std::uint64_t id_;
+    const std::size_t slabSize_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<ThreadCache>> caches_;
+    std::vector<void*> slabs_;
+};
+
 } // namespace wrenpp
 
 #endif // WRENPP_H_INCLUDED
@@ -0,0 +1,1207 @@
+#include "Wren++.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// runs body `iterations` times and returns the mean duration of one iteration in microseconds
+template<typename F>
+double measure(int iterations, F&& body)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        body();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+}
+
+// a measurement, which is identified between runs by its section and name
+struct Result
+{
+    std::string section;
+    std::string name;
+    double value;
+    const char* unit;
+};
+
+std::vector<Result> results;
+const char* currentSection = "";
+
+void report(const std::string& name, double microseconds)
+{
+    std::printf("%-40s %12.3f us\n", name.c_str(), microseconds);
+    results.push_back(Result{currentSection, name, microseconds, "us"});
+}
+
+void reportCount(const std::string& name, unsigned long long count)
+{
+    std::printf("%-40s %12llu\n", name.c_str(), count);
+    results.push_back(Result{currentSection, name, double(count), "count"});
+}
+
+void writeJsonString(std::ostream& out, const std::string& str)
+{
+    out << '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out << '\\';
+        }
+        out << c;
+    }
+    out << '"';
+}
+
+// writes the results as a JSON document, which is easy to compare between releases
+void writeJson(std::ostream& out)
+{
+    out << "{\n  \"results\": [";
+    for (std::size_t i = 0u; i < results.size(); ++i)
+    {
+        const Result& result = results[i];
+        out << (i == 0u ? "\n" : ",\n") << "    {\"section\": ";
+        writeJsonString(out, result.section);
+        out << ", \"name\": ";
+        writeJsonString(out, result.name);
+        char value[32];
+        std::snprintf(value, sizeof(value), "%.6g", result.value);
+        out << ", \"value\": " << value << ", \"unit\": \"" << result.unit << "\"}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void noop(WrenVM*) {}
+
+// the number of foreign classes, and foreign methods per class, bound for each VM
+constexpr int BoundClasses = 40;
+constexpr int MethodsPerClass = 50;
+
+std::vector<std::string> makeSignatures()
+{
+    std::vector<std::string> signatures;
+    for (int i = 0; i < MethodsPerClass; ++i)
+    {
+        signatures.push_back("method" + std::to_string(i) + "(_,_)");
+    }
+    return signatures;
+}
+
+// the Wren source which declares every bound method, so that executing it looks all of them up
+std::string makeBindingSource()
+{
+    std::string source;
+    for (int c = 0; c < BoundClasses; ++c)
+    {
+        source += "class Class" + std::to_string(c) + " {\n";
+        for (int m = 0; m < MethodsPerClass; ++m)
+        {
+            source += "  foreign static method" + std::to_string(m) + "(a, b)\n";
+        }
+        source += "}\n";
+    }
+    return source;
+}
+
+void bindAll(wrenpp::VM& vm, const std::vector<std::string>& signatures)
+{
+    wrenpp::ModuleContext module = vm.beginModule("main");
+    for (int c = 0; c < BoundClasses; ++c)
+    {
+        wrenpp::ClassContext cls = module.beginClass("Class" + std::to_string(c));
+        for (const std::string& signature : signatures)
+        {
+            cls.bindCFunction(true, signature, noop);
+        }
+    }
+}
+
+void benchBinding()
+{
+    const std::vector<std::string> signatures = makeSignatures();
+    const std::string source = makeBindingSource();
+    const int iterations = 50;
+
+    report("vm creation", measure(iterations, [] { wrenpp::VM vm; }));
+    report("vm creation + binding", measure(iterations, [&signatures] {
+               wrenpp::VM vm;
+               bindAll(vm, signatures);
+           }));
+    report("vm creation + binding + lookup", measure(iterations, [&signatures, &source] {
+               wrenpp::VM vm;
+               bindAll(vm, signatures);
+               vm.executeString(source);
+           }));
+}
+
+void benchPool()
+{
+    const std::vector<std::string> signatures = makeSignatures();
+    const std::string source = makeBindingSource();
+    const auto setup = [&signatures, &source](wrenpp::VM& vm) {
+        bindAll(vm, signatures);
+        vm.executeString(source);
+    };
+    // a short request, which leaves no module variables behind
+    const std::string request =
+        "{\n"
+        "  var sum = 0\n"
+        "  for (i in 0...100) sum = sum + i\n"
+        "  Class0.method0(sum, 1)\n"
+        "}\n";
+    const int iterations = 200;
+
+    report("request on a new VM", measure(iterations, [&] {
+               wrenpp::VM vm;
+               setup(vm);
+               vm.executeString(request);
+           }));
+
+    wrenpp::VMPool pool{setup};
+    report("request on a pooled VM", measure(iterations, [&] {
+               wrenpp::VMPool::Lease vm = pool.acquire();
+               vm->executeString(request);
+           }));
+
+    wrenpp::VMPool::Options options;
+    options.maxUses = 10u;
+    wrenpp::VMPool recycling{setup, options};
+    report("request on a pooled VM, recycled every 10 uses", measure(iterations, [&] {
+               wrenpp::VMPool::Lease vm = recycling.acquire();
+               vm->executeString(request);
+           }));
+    const wrenpp::VMPool::Stats stats = recycling.stats();
+    reportCount("recycling pool hit rate, percent", (unsigned long long)(stats.hitRate() * 100.0));
+    report("recycling pool mean wait", stats.totalWait.count() / 1000.0 / stats.acquisitions);
+}
+
+void benchMethodCalls()
+{
+    wrenpp::VM vm;
+    vm.executeString(
+        "var add = Fn.new { |a, b| a + b }\n"
+        "var greet = Fn.new { |name| \"Hello, %(name)\" }\n"
+        "var greetAtLength = Fn.new { |name| \"Hello there, %(name), how are you today?\" }\n");
+    wrenpp::Method add = vm.method("main", "add", "call(_,_)");
+    wrenpp::Method greet = vm.method("main", "greet", "call(_)");
+    wrenpp::Method greetAtLength = vm.method("main", "greetAtLength", "call(_)");
+    const int iterations = 200000;
+
+    double sum = 0.0;
+    report("Method::operator() -> double", measure(iterations, [&add, &sum] {
+               sum += add(1.0, 2.0).as<double>();
+           }));
+    report("Method::call<double>", measure(iterations, [&add, &sum] {
+               sum += add.call<double>(1.0, 2.0);
+           }));
+    report("Method::callVoid", measure(iterations, [&add] { add.callVoid(1.0, 2.0); }));
+
+    std::size_t length = 0u;
+    report("Method::operator() -> string", measure(iterations, [&greet, &length] {
+               wrenpp::Value greeting = greet("Wren");
+               length += std::strlen(greeting.as<const char*>());
+           }));
+    report("Method::call<const char*>", measure(iterations, [&greet, &length] {
+               length += std::strlen(greet.call<const char*>("Wren"));
+           }));
+    report("Method::operator() -> long string", measure(iterations, [&greetAtLength, &length] {
+               wrenpp::Value greeting = greetAtLength("Wren");
+               length += std::strlen(greeting.as<const char*>());
+           }));
+    report("Value::borrowSlot -> long string", measure(iterations, [&vm, &greetAtLength, &length] {
+               greetAtLength.callVoid("Wren");
+               wrenpp::Value greeting = wrenpp::Value::borrowSlot(vm, 0);
+               length += std::strlen(greeting.as<const char*>());
+           }));
+
+    // keep the results observable, so that the calls can't be optimized away
+    std::printf("(checksum %f %zu)\n", sum, length);
+}
+
+// the cost of one call, when calling a method once per item of a batch
+void benchBatchedCalls()
+{
+    wrenpp::VM vm;
+    vm.executeString("var scale = Fn.new { |x, factor| x * factor }\n");
+    wrenpp::Method scale = vm.method("main", "scale", "call(_,_)");
+    const std::size_t total = 100000u;
+    const std::vector<double> xs(total, 1.5);
+    const std::vector<double> factors(total, 2.0);
+    std::vector<double> results(total);
+
+    report("Method::operator()", measure(1, [&] {
+               for (std::size_t i = 0u; i < total; ++i)
+               {
+                   results[i] = scale(xs[i], factors[i]).as<double>();
+               }
+           }) / total);
+    report("Method::call<double>", measure(1, [&] {
+               for (std::size_t i = 0u; i < total; ++i)
+               {
+                   results[i] = scale.call<double>(xs[i], factors[i]);
+               }
+           }) / total);
+    for (std::size_t size : {std::size_t(1u), std::size_t(100u), std::size_t(10000u)})
+    {
+        report("Method::callBatch, batches of " + std::to_string(size), measure(1, [&] {
+                   for (std::size_t i = 0u; i < total; i += size)
+                   {
+                       scale.callBatch(size, &results[i], &xs[i], &factors[i]);
+                   }
+               }) / total);
+    }
+}
+
+double sumVector(const std::vector<double>& values)
+{
+    double sum = 0.0;
+    for (double value : values)
+    {
+        sum += value;
+    }
+    return sum;
+}
+
+double sumListView(wrenpp::ListView<double> values)
+{
+    double sum = 0.0;
+    for (double value : values)
+    {
+        sum += value;
+    }
+    return sum;
+}
+
+// the hand-written loop which the container marshalling replaces
+void sumByHand(WrenVM* vm)
+{
+    const int count = wrenGetListCount(vm, 1);
+    wrenEnsureSlots(vm, 3);
+    double sum = 0.0;
+    for (int i = 0; i < count; ++i)
+    {
+        wrenGetListElement(vm, 1, i, 2);
+        sum += wrenGetSlotDouble(vm, 2);
+    }
+    wrenSetSlotDouble(vm, 0, sum);
+}
+
+std::vector<double> makeList(int count) { return std::vector<double>(std::size_t(count), 1.0); }
+
+constexpr std::size_t ExecutorItems = 1000000u;
+
+void benchExecutor()
+{
+    // enough work per call that the scripts, rather than the chunk queues, dominate
+    const auto setup = [](wrenpp::VM& vm) {
+        vm.executeString(
+            "var transform = Fn.new { |x|\n"
+            "  var y = x\n"
+            "  for (i in 0...16) y = (y * 1.5 + i).sqrt\n"
+            "  return y\n"
+            "}\n");
+    };
+    std::vector<double> inputs(ExecutorItems);
+    std::vector<double> outputs(ExecutorItems);
+    for (std::size_t i = 0u; i < ExecutorItems; ++i)
+    {
+        inputs[i] = double(i);
+    }
+
+    const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned workers = 1u; workers <= hardware; workers *= 2u)
+    {
+        wrenpp::Executor executor{workers, setup};
+        report("Executor::map, " + std::to_string(workers) + " workers, per item", measure(1, [&] {
+                   executor.map(
+                       "main",
+                       "transform",
+                       "call(_)",
+                       ExecutorItems,
+                       outputs.data(),
+                       inputs.data());
+               }) / ExecutorItems);
+    }
+}
+
+constexpr int ChannelMessages = 200000;
+
+// sends ChannelMessages messages from the other VMs to one VM, each VM on its own thread
+void benchChannelThroughput(int vms)
+{
+    wrenpp::Channel channel{1024u};
+    const int producers = vms - 1;
+    const int perProducer = ChannelMessages / producers;
+
+    wrenpp::VM consumer;
+    wrenpp::bindChannels(consumer);
+    consumer.executeString("var onMessage = Fn.new { |message| }\n");
+    consumer.listen(channel, "main", "onMessage");
+
+    const double us = measure(1, [&] {
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; ++p)
+        {
+            threads.emplace_back([&channel, perProducer]() {
+                wrenpp::VM vm;
+                wrenpp::bindChannels(vm);
+                wrenpp::FiberScheduler scheduler(vm);
+                vm.executeString(
+                    "var out = null\n"
+                    "var setOut = Fn.new { |channel| out = channel }\n"
+                    "var producer = Fn.new {\n"
+                    "  for (i in 0..." +
+                    std::to_string(perProducer) +
+                    ") out.send(i)\n"
+                    "}\n");
+                vm.method("main", "setOut", "call(_)").callVoid(&channel);
+                scheduler.spawn("main", "producer");
+                while (scheduler.fiberCount() != 0u)
+                {
+                    if (scheduler.tick(std::chrono::milliseconds(1)) == 0u)
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        int received = 0;
+        while (received < producers * perProducer)
+        {
+            const std::size_t drained = consumer.drainChannels(256u);
+            received += int(drained);
+            if (drained == 0u)
+            {
+                std::this_thread::yield();
+            }
+        }
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    });
+    report(std::to_string(vms) + " VMs, per message", us / (producers * perProducer));
+}
+
+void benchChannels()
+{
+    for (int vms : {2, 4, 8})
+    {
+        benchChannelThroughput(vms);
+    }
+}
+
+constexpr int SerializedRecords = 10000;
+
+void benchSerializer()
+{
+    wrenpp::VM vm;
+    vm.executeString(
+        "var records = []\n"
+        "for (i in 0..." +
+        std::to_string(SerializedRecords) +
+        ") {\n"
+        "  records.add({\n"
+        "    \"id\": i,\n"
+        "    \"name\": \"record %(i)\",\n"
+        "    \"price\": i * 1.25,\n"
+        "    \"tags\": [\"a\", \"b\", \"c\"],\n"
+        "    \"active\": i % 2 == 0\n"
+        "  })\n"
+        "}\n"
+        // without an identity table, the diamond would be written as 2^40 lists
+        "var diamond = []\n"
+        "for (i in 0...40) diamond = [diamond, diamond]\n");
+    wrenpp::Serializer serializer{vm};
+    std::string bytes;
+    const double serialize =
+        measure(10, [&] { bytes = serializer.serialize("main", "records"); });
+    const double deserialize = measure(10, [&] {
+        WrenHandle* records = serializer.deserialize(bytes);
+        wrenReleaseHandle(vm, records);
+    });
+
+    reportCount("bytes, list of maps", bytes.size());
+    report("serialize, list of maps", serialize);
+    report("deserialize, list of maps", deserialize);
+    // bytes per microsecond are megabytes per second
+    reportCount("serialize, MB/s", (unsigned long long)(bytes.size() / serialize));
+    reportCount("deserialize, MB/s", (unsigned long long)(bytes.size() / deserialize));
+
+    std::string diamond;
+    const double serializeDiamond =
+        measure(10, [&] { diamond = serializer.serialize("main", "diamond"); });
+    reportCount("bytes, 40 level diamond", diamond.size());
+    report("serialize, 40 level diamond", serializeDiamond);
+}
+
+void benchContainers()
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Containers")
+        .bindFunction<decltype(&sumVector), &sumVector>(true, "sumVector(_)")
+        .bindFunction<decltype(&sumListView), &sumListView>(true, "sumListView(_)")
+        .bindCFunction(true, "sumByHand(_)", sumByHand)
+        .bindFunction<decltype(&makeList), &makeList>(true, "makeList(_)")
+        .endClass();
+    vm.executeString(
+        "class Containers {\n"
+        "  foreign static sumVector(list)\n"
+        "  foreign static sumListView(list)\n"
+        "  foreign static sumByHand(list)\n"
+        "  foreign static makeList(count)\n"
+        "}\n"
+        "var list = (0...500).toList\n"
+        "var sumVector = Fn.new { Containers.sumVector(list) }\n"
+        "var sumListView = Fn.new { Containers.sumListView(list) }\n"
+        "var sumByHand = Fn.new { Containers.sumByHand(list) }\n"
+        "var makeList = Fn.new { Containers.makeList(500) }\n");
+    const int iterations = 20000;
+
+    wrenpp::Method sumVectorFn = vm.method("main", "sumVector", "call()");
+    wrenpp::Method sumListViewFn = vm.method("main", "sumListView", "call()");
+    wrenpp::Method sumByHandFn = vm.method("main", "sumByHand", "call()");
+    wrenpp::Method makeListFn = vm.method("main", "makeList", "call()");
+    report("500 numbers -> std::vector", measure(iterations, [&sumVectorFn] {
+               sumVectorFn.callVoid();
+           }));
+    report("500 numbers -> ListView", measure(iterations, [&sumListViewFn] {
+               sumListViewFn.callVoid();
+           }));
+    report("500 numbers -> hand-written loop", measure(iterations, [&sumByHandFn] {
+               sumByHandFn.callVoid();
+           }));
+    report("std::vector -> 500 numbers", measure(iterations, [&makeListFn] {
+               makeListFn.callVoid();
+           }));
+}
+
+void benchTypedArrays()
+{
+    wrenpp::VM vm;
+    wrenpp::bindTypedArrays(vm);
+    vm.executeString(
+        "import \"typed_array\" for Float64Array\n"
+        "var count = 1000000\n"
+        "var list = List.filled(count, 1)\n"
+        "var array = Float64Array.new(count)\n"
+        "array.fill(1)\n"
+        "var other = Float64Array.new(count)\n"
+        "var sumList = Fn.new {\n"
+        "  var sum = 0\n"
+        "  for (x in list) sum = sum + x\n"
+        "  return sum\n"
+        "}\n"
+        "var sumArrayLoop = Fn.new {\n"
+        "  var sum = 0\n"
+        "  for (i in 0...count) sum = sum + array[i]\n"
+        "  return sum\n"
+        "}\n"
+        "var sumArray = Fn.new { array.sum }\n"
+        "var axpyArray = Fn.new { other.axpy(0.5, array) }\n");
+    const int iterations = 10;
+
+    wrenpp::Method sumList = vm.method("main", "sumList", "call()");
+    wrenpp::Method sumArrayLoop = vm.method("main", "sumArrayLoop", "call()");
+    wrenpp::Method sumArray = vm.method("main", "sumArray", "call()");
+    wrenpp::Method axpyArray = vm.method("main", "axpyArray", "call()");
+    report("1M element List, script loop", measure(iterations, [&sumList] {
+               sumList.callVoid();
+           }));
+    report("1M element Float64Array, script loop", measure(iterations, [&sumArrayLoop] {
+               sumArrayLoop.callVoid();
+           }));
+    report("1M element Float64Array.sum", measure(iterations, [&sumArray] {
+               sumArray.callVoid();
+           }));
+    report("1M element Float64Array.axpy", measure(iterations, [&axpyArray] {
+               axpyArray.callVoid();
+           }));
+}
+
+struct Vec3
+{
+    float x, y, z;
+
+    Vec3(float x, float y, float z) : x{x}, y{y}, z{z} {}
+
+    float dot(const Vec3& rhs) const { return x * rhs.x + y * rhs.y + z * rhs.z; }
+
+    Vec3 plus(const Vec3& rhs) const { return Vec3{x + rhs.x, y + rhs.y, z + rhs.z}; }
+};
+
+void bindVec3(wrenpp::VM& vm)
+{
+    vm.beginModule("main")
+        .bindClass<Vec3, float, float, float>("Vec3")
+        .bindGetter<decltype(Vec3::x), &Vec3::x>("x")
+        .bindSetter<decltype(Vec3::x), &Vec3::x>("x=(_)")
+        .bindMethod<decltype(&Vec3::dot), &Vec3::dot>(false, "dot(_)")
+        .bindMethod<decltype(&Vec3::plus), &Vec3::plus>(false, "plus(_)")
+        .endClass();
+    vm.executeString(
+        "foreign class Vec3 {\n"
+        "  construct new(x, y, z) {}\n"
+        "  foreign x\n"
+        "  foreign x=(rhs)\n"
+        "  foreign dot(rhs)\n"
+        "  foreign plus(rhs)\n"
+        "}\n");
+}
+
+// each script runs its body 10000 times per call, so that the call overhead from C++ is amortized
+void benchForeignObjects()
+{
+    wrenpp::VM vm;
+    bindVec3(vm);
+    vm.executeString(
+        "var a = Vec3.new(1, 2, 3)\n"
+        "var b = Vec3.new(4, 5, 6)\n"
+        "var construct = Fn.new {\n"
+        "  for (i in 0...10000) Vec3.new(i, i, i)\n"
+        "}\n"
+        "var dot = Fn.new {\n"
+        "  for (i in 0...10000) a.dot(b)\n"
+        "}\n"
+        "var plus = Fn.new {\n"
+        "  for (i in 0...10000) a.plus(b)\n"
+        "}\n"
+        "var getter = Fn.new {\n"
+        "  for (i in 0...10000) a.x\n"
+        "}\n"
+        "var setter = Fn.new {\n"
+        "  for (i in 0...10000) a.x = i\n"
+        "}\n");
+    const int iterations = 100;
+    const double loop = 10000.0;
+
+    wrenpp::Method construct = vm.method("main", "construct", "call()");
+    wrenpp::Method dot = vm.method("main", "dot", "call()");
+    wrenpp::Method plus = vm.method("main", "plus", "call()");
+    wrenpp::Method getter = vm.method("main", "getter", "call()");
+    wrenpp::Method setter = vm.method("main", "setter", "call()");
+    report("Vec3.new(_,_,_)", measure(iterations, [&construct] { construct.callVoid(); }) / loop);
+    report("Vec3.dot(_)", measure(iterations, [&dot] { dot.callVoid(); }) / loop);
+    report("Vec3.plus(_)", measure(iterations, [&plus] { plus.callVoid(); }) / loop);
+    report("Vec3.x", measure(iterations, [&getter] { getter.callVoid(); }) / loop);
+    report("Vec3.x=(_)", measure(iterations, [&setter] { setter.callVoid(); }) / loop);
+}
+
+double arity0() { return 0.0; }
+double arity1(double a) { return a; }
+double arity2(double a, double b) { return a + b; }
+double arity4(double a, double b, double c, double d) { return a + b + c + d; }
+double arity8(double a, double b, double c, double d, double e, double f, double g, double h)
+{
+    return a + b + c + d + e + f + g + h;
+}
+
+// each script runs its body 10000 times per call, so that the call overhead from C++ is amortized
+void benchForeignFunctions()
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Functions")
+        .bindFunction<decltype(&arity0), &arity0>(true, "arity0()")
+        .bindFunction<decltype(&arity1), &arity1>(true, "arity1(_)")
+        .bindFunction<decltype(&arity2), &arity2>(true, "arity2(_,_)")
+        .bindFunction<decltype(&arity4), &arity4>(true, "arity4(_,_,_,_)")
+        .bindFunction<decltype(&arity8), &arity8>(true, "arity8(_,_,_,_,_,_,_,_)")
+        .endClass();
+    vm.executeString(
+        "class Functions {\n"
+        "  foreign static arity0()\n"
+        "  foreign static arity1(a)\n"
+        "  foreign static arity2(a, b)\n"
+        "  foreign static arity4(a, b, c, d)\n"
+        "  foreign static arity8(a, b, c, d, e, f, g, h)\n"
+        "  static script2(a, b) { a + b }\n"
+        "}\n"
+        "var arity0 = Fn.new {\n"
+        "  for (i in 0...10000) Functions.arity0()\n"
+        "}\n"
+        "var arity1 = Fn.new {\n"
+        "  for (i in 0...10000) Functions.arity1(i)\n"
+        "}\n"
+        "var arity2 = Fn.new {\n"
+        "  for (i in 0...10000) Functions.arity2(i, i)\n"
+        "}\n"
+        "var arity4 = Fn.new {\n"
+        "  for (i in 0...10000) Functions.arity4(i, i, i, i)\n"
+        "}\n"
+        "var arity8 = Fn.new {\n"
+        "  for (i in 0...10000) Functions.arity8(i, i, i, i, i, i, i, i)\n"
+        "}\n"
+        "var script2 = Fn.new {\n"
+        "  for (i in 0...10000) Functions.script2(i, i)\n"
+        "}\n");
+    const int iterations = 100;
+    const double loop = 10000.0;
+
+    for (const char* name : {"arity0", "arity1", "arity2", "arity4", "arity8", "script2"})
+    {
+        wrenpp::Method fn = vm.method("main", name, "call()");
+        const std::string label = std::string("Functions.") + name;
+        report(label, measure(iterations, [&fn] { fn.callVoid(); }) / loop);
+    }
+}
+
+unsigned lengthOfCString(const char* str) { return unsigned(std::strlen(str)); }
+unsigned lengthOfString(std::string str) { return unsigned(str.size()); }
+unsigned lengthOfStringRef(const std::string& str) { return unsigned(str.size()); }
+const char* returnCString() { return "Hello there, Wren, how are you today?"; }
+std::string returnString() { return "Hello there, Wren, how are you today?"; }
+
+void benchStrings()
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Strings")
+        .bindFunction<decltype(&lengthOfCString), &lengthOfCString>(true, "cstring(_)")
+        .bindFunction<decltype(&lengthOfString), &lengthOfString>(true, "string(_)")
+        .bindFunction<decltype(&lengthOfStringRef), &lengthOfStringRef>(true, "stringRef(_)")
+        .bindFunction<decltype(&returnCString), &returnCString>(true, "returnCString()")
+        .bindFunction<decltype(&returnString), &returnString>(true, "returnString()")
+        .endClass();
+    vm.executeString(
+        "class Strings {\n"
+        "  foreign static cstring(str)\n"
+        "  foreign static string(str)\n"
+        "  foreign static stringRef(str)\n"
+        "  foreign static returnCString()\n"
+        "  foreign static returnString()\n"
+        "}\n"
+        "var str = \"Hello there, Wren, how are you today?\"\n"
+        "var cstring = Fn.new {\n"
+        "  for (i in 0...10000) Strings.cstring(str)\n"
+        "}\n"
+        "var string = Fn.new {\n"
+        "  for (i in 0...10000) Strings.string(str)\n"
+        "}\n"
+        "var stringRef = Fn.new {\n"
+        "  for (i in 0...10000) Strings.stringRef(str)\n"
+        "}\n"
+        "var returnCString = Fn.new {\n"
+        "  for (i in 0...10000) Strings.returnCString()\n"
+        "}\n"
+        "var returnString = Fn.new {\n"
+        "  for (i in 0...10000) Strings.returnString()\n"
+        "}\n");
+    const int iterations = 100;
+    const double loop = 10000.0;
+
+    for (const char* name : {"cstring", "string", "stringRef", "returnCString", "returnString"})
+    {
+        wrenpp::Method fn = vm.method("main", name, "call()");
+        const std::string label = std::string("Strings.") + name;
+        report(label, measure(iterations, [&fn] { fn.callVoid(); }) / loop);
+    }
+}
+
+std::future<double> readyValue(double x)
+{
+    std::promise<double> promise;
+    promise.set_value(x);
+    return promise.get_future();
+}
+
+constexpr int Fibers = 10000;
+
+// each tick resumes every fiber once
+void benchFiberTicks(const char* name, const char* fn)
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Host")
+        .bindAsyncFunction<decltype(&readyValue), &readyValue>(true, "value(_)")
+        .endClass();
+    wrenpp::FiberScheduler scheduler(vm);
+    vm.executeString(
+        "import \"scheduler\" for Scheduler\n"
+        "class Host {\n"
+        "  foreign static value(x)\n"
+        "}\n"
+        "var yielder = Fn.new {\n"
+        "  while (true) Scheduler.yield()\n"
+        "}\n"
+        "var awaiter = Fn.new {\n"
+        "  while (true) Scheduler.await(Host.value(1))\n"
+        "}\n");
+    for (int i = 0; i < Fibers; ++i)
+    {
+        scheduler.spawn("main", fn);
+    }
+    const std::chrono::seconds budget{1};
+    scheduler.tick(budget);
+    report(name, measure(20, [&scheduler, budget] { scheduler.tick(budget); }) / Fibers);
+}
+
+void benchFibers()
+{
+    benchFiberTicks("Scheduler.yield(), per fiber", "yielder");
+    benchFiberTicks("Scheduler.await(_), per fiber", "awaiter");
+}
+
+// a bound type which is expensive to copy, but cheap to move
+struct Mesh
+{
+    std::vector<float> vertices;
+
+    explicit Mesh(int count) : vertices(std::size_t(count), 1.f) {}
+
+    Mesh copy() const { return *this; }
+};
+
+Mesh makeMesh(int count) { return Mesh{count}; }
+unsigned meshByValue(Mesh mesh) { return unsigned(mesh.vertices.size()); }
+unsigned meshByConstRef(const Mesh& mesh) { return unsigned(mesh.vertices.size()); }
+const std::shared_ptr<Mesh>& sharedMesh()
+{
+    static const std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(1000);
+    return mesh;
+}
+unsigned consumeMesh(Mesh&& mesh)
+{
+    Mesh sink{std::move(mesh)};
+    return unsigned(sink.vertices.size());
+}
+
+// each script runs its body 1000 times per call, so that the call overhead from C++ is amortized
+void benchForeignValues()
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .bindClass<Mesh, int>("Mesh")
+        .bindMethod<decltype(&Mesh::copy), &Mesh::copy>(false, "copy()")
+        .endClass()
+        .beginClass("Meshes")
+        .bindFunction<decltype(&makeMesh), &makeMesh>(true, "make(_)")
+        .bindFunction<decltype(&meshByValue), &meshByValue>(true, "byValue(_)")
+        .bindFunction<decltype(&meshByConstRef), &meshByConstRef>(true, "byConstRef(_)")
+        .bindFunction<decltype(&consumeMesh), &consumeMesh>(true, "consume(_)")
+        .bindFunction<decltype(&sharedMesh), &sharedMesh>(true, "shared()")
+        .endClass();
+    vm.executeString(
+        "foreign class Mesh {\n"
+        "  construct new(count) {}\n"
+        "  foreign copy()\n"
+        "}\n"
+        "class Meshes {\n"
+        "  foreign static make(count)\n"
+        "  foreign static byValue(mesh)\n"
+        "  foreign static byConstRef(mesh)\n"
+        "  foreign static consume(mesh)\n"
+        "  foreign static shared()\n"
+        "}\n"
+        "var mesh = Mesh.new(1000)\n"
+        "var make = Fn.new {\n"
+        "  for (i in 0...1000) Meshes.make(1000)\n"
+        "}\n"
+        "var copy = Fn.new {\n"
+        "  for (i in 0...1000) mesh.copy()\n"
+        "}\n"
+        "var byValue = Fn.new {\n"
+        "  for (i in 0...1000) Meshes.byValue(mesh)\n"
+        "}\n"
+        "var byConstRef = Fn.new {\n"
+        "  for (i in 0...1000) Meshes.byConstRef(mesh)\n"
+        "}\n"
+        "var construct = Fn.new {\n"
+        "  for (i in 0...1000) Mesh.new(1000)\n"
+        "}\n"
+        "var consume = Fn.new {\n"
+        "  for (i in 0...1000) Meshes.consume(Mesh.new(1000))\n"
+        "}\n"
+        "var shared = Fn.new {\n"
+        "  for (i in 0...1000) Meshes.shared()\n"
+        "}\n"
+        "var identity = Fn.new { |x| x }\n");
+    const int iterations = 20;
+    const double loop = 1000.0;
+
+    // consume constructs each mesh in Wren first, which construct times on its own
+    for (const char* name :
+         {"make", "copy", "byValue", "byConstRef", "construct", "consume", "shared"})
+    {
+        wrenpp::Method fn = vm.method("main", name, "call()");
+        const std::string label = std::string("1000 vertex Mesh, ") + name;
+        // Wren doesn't see the vertices, so it wouldn't collect the meshes soon enough on its own
+        report(label, measure(iterations, [&vm, &fn] {
+                   fn.callVoid();
+                   vm.collectGarbage();
+               }) / loop);
+    }
+
+    // both make a mesh for Wren, by copying an existing one or moving a new one in
+    const Mesh mesh{1000};
+    wrenpp::Method identity = vm.method("main", "identity", "call(_)");
+    report("1000 vertex Mesh, copied into Wren", measure(1000, [&identity, &mesh] {
+               identity.callVoid(mesh);
+           }));
+    report("1000 vertex Mesh, moved into Wren", measure(1000, [&identity] {
+               identity.callVoid(Mesh{1000});
+           }));
+    const std::shared_ptr<Mesh>& shared = sharedMesh();
+    report("1000 vertex Mesh, shared with Wren", measure(1000, [&identity, &shared] {
+               identity.callVoid(shared);
+           }));
+}
+
+void* systemAllocator(void* memory, std::size_t, std::size_t newSize, void*)
+{
+    if (newSize == 0u)
+    {
+        std::free(memory);
+        return nullptr;
+    }
+    return std::realloc(memory, newSize);
+}
+
+// each script allocates many small objects, most of which become garbage right away
+const char* const AllocationScripts[][2] = {
+    {"strings",
+     "var run = Fn.new {\n"
+     "  var s = \"\"\n"
+     "  for (i in 0...2000) s = \"%(i)\" + \"-\"\n"
+     "  return s\n"
+     "}\n"},
+    {"instances",
+     "class Point {\n"
+     "  construct new(x, y) {\n"
+     "    _x = x\n"
+     "    _y = y\n"
+     "  }\n"
+     "  x { _x }\n"
+     "}\n"
+     "var run = Fn.new {\n"
+     "  var points = []\n"
+     "  for (i in 0...2000) points.add(Point.new(i, i))\n"
+     "  return points.count\n"
+     "}\n"},
+    {"closures",
+     "var run = Fn.new {\n"
+     "  var sum = 0\n"
+     "  for (i in 0...2000) {\n"
+     "    var f = Fn.new {|x| x + i }\n"
+     "    sum = sum + f.call(1)\n"
+     "  }\n"
+     "  return sum\n"
+     "}\n"},
+};
+
+void benchAllocationScript(const char* name, const char* source, wrenpp::VM& vm)
+{
+    vm.executeString(source);
+    wrenpp::Method run = vm.method("main", "run", "call()");
+    run.callVoid();
+    report(name, measure(200, [&run] { run.callVoid(); }));
+}
+
+void benchAllocators()
+{
+    // a small heap, so that collections run often enough for blocks to be reused
+    wrenpp::Config config;
+    config.initialHeapSize = 0x100000u;
+    config.minHeapSize = 0x40000u;
+
+    wrenpp::PoolAllocator pool;
+    for (const auto& script : AllocationScripts)
+    {
+        const std::string name = script[0];
+        {
+            wrenpp::VM vm(config);
+            benchAllocationScript((name + ", std::realloc").c_str(), script[1], vm);
+        }
+        {
+            wrenpp::Config system = config;
+            system.allocatorFn = systemAllocator;
+            wrenpp::VM vm(system);
+            benchAllocationScript((name + ", std::realloc via Config").c_str(), script[1], vm);
+        }
+        {
+            wrenpp::Config pooled = config;
+            pooled.allocatorFn = wrenpp::PoolAllocator::reallocate;
+            pooled.allocatorData = &pool;
+            wrenpp::VM vm(pooled);
+            benchAllocationScript((name + ", PoolAllocator").c_str(), script[1], vm);
+        }
+    }
+
+    const wrenpp::PoolAllocator::Stats stats = pool.stats();
+    std::printf("\n%-12s %14s %14s\n", "block size", "allocations", "frees");
+    for (const wrenpp::PoolAllocator::SizeClassStats& sizeClass : stats.sizeClasses)
+    {
+        if (sizeClass.allocations != 0u)
+        {
+            std::printf(
+                "%-12zu %14llu %14llu\n",
+                sizeClass.blockSize,
+                (unsigned long long)sizeClass.allocations,
+                (unsigned long long)sizeClass.frees);
+        }
+    }
+    std::printf(
+        "%-12s %14llu %14llu\n",
+        "large",
+        (unsigned long long)stats.largeAllocations,
+        (unsigned long long)stats.largeFrees);
+}
+
+// a frame allocates garbage, while a large retained scene makes every collection expensive
+const char* const FrameScript =
+    "var scene = []\n"
+    "for (i in 0...50000) scene.add([i, \"node %(i)\"])\n"
+    "var frame = Fn.new {\n"
+    "  for (i in 0...2000) {\n"
+    "    var garbage = \"frame garbage %(i)\"\n"
+    "  }\n"
+    "}\n";
+
+constexpr int Frames = 2000;
+
+// runs the frames, and reports the median, 99th percentile and worst frame time
+void benchFrames(const char* name, wrenpp::VM& vm, bool idle)
+{
+    vm.executeString(FrameScript);
+    wrenpp::Method frame = vm.method("main", "frame", "call()");
+
+    std::vector<double> frameTimes;
+    frameTimes.reserve(Frames);
+    for (int i = 0; i < Frames; ++i)
+    {
+        frameTimes.push_back(measure(1, [&frame] { frame.callVoid(); }));
+        if (idle)
+        {
+            vm.idle(std::chrono::milliseconds(8));
+        }
+    }
+    std::sort(frameTimes.begin(), frameTimes.end());
+
+    const std::string prefix = name;
+    report(prefix + ", median frame", frameTimes[Frames / 2]);
+    report(prefix + ", p99 frame", frameTimes[Frames * 99 / 100]);
+    report(prefix + ", worst frame", frameTimes.back());
+    const wrenpp::HeapStats stats = vm.heapStats();
+    reportCount(prefix + ", collections", stats.collections);
+    reportCount(
+        prefix + ", collections within frames", stats.collections - stats.idleCollections);
+}
+
+void benchGcScheduling()
+{
+    {
+        wrenpp::VM vm;
+        benchFrames("no idle collection", vm, false);
+    }
+    {
+        wrenpp::VM vm;
+        benchFrames("idle collection", vm, true);
+    }
+
+    wrenpp::GcScheduler scheduler;
+    {
+        // a first VM teaches the scheduler how the frames use the heap
+        wrenpp::VM vm(scheduler.configure());
+        benchFrames("idle collection, learning", vm, true);
+    }
+    {
+        wrenpp::VM vm(scheduler.configure());
+        benchFrames("idle collection, learned heap", vm, true);
+    }
+}
+
+// A module graph like that of a larger program: each module declares a class, and imports a few
+// of the modules after it.
+constexpr int GraphModules = 300;
+
+std::string graphModuleName(int i) { return "coldstart_" + std::to_string(i); }
+
+std::vector<std::pair<std::string, std::string>> makeModuleGraph()
+{
+    std::vector<std::pair<std::string, std::string>> modules;
+    for (int i = 0; i < GraphModules; ++i)
+    {
+        std::string source;
+        for (int j = i + 1; j < std::min(i + 4, GraphModules); ++j)
+        {
+            source += "import \"" + graphModuleName(j) + "\"\n";
+        }
+        source += "class Class" + std::to_string(i) + " {\n";
+        source += "  construct new() { _value = " + std::to_string(i) + " }\n";
+        for (int m = 0; m < 10; ++m)
+        {
+            source += "  method" + std::to_string(m) + "(x) { _value + x * " + std::to_string(m) +
+                      " }\n";
+        }
+        source += "}\n";
+        modules.emplace_back(graphModuleName(i), source);
+    }
+    return modules;
+}
+
+void benchColdStart()
+{
+    const std::vector<std::pair<std::string, std::string>> modules = makeModuleGraph();
+    for (const auto& module : modules)
+    {
+        std::ofstream file(module.first + ".wren");
+        file << module.second;
+    }
+    {
+        std::ofstream file("coldstart.wrenb", std::ios::out | std::ios::binary);
+        const std::string bundle = wrenpp::ModuleBundle::pack(modules);
+        file.write(bundle.data(), std::streamsize(bundle.size()));
+    }
+    const std::string root = graphModuleName(0);
+    const int iterations = 20;
+
+    // a new VM each time, which loads and runs the whole graph
+    report("directory, VM::loadModuleFn", measure(iterations, [&root] {
+               wrenpp::VM vm;
+               vm.executeModule(root);
+           }));
+
+    wrenpp::ModuleLoader loader;
+    wrenpp::Config loaderConfig;
+    loaderConfig.moduleLoader = &loader;
+    report("directory, ModuleLoader, uncached", measure(iterations, [&] {
+               wrenpp::ModuleLoader::clearCache();
+               wrenpp::VM vm(loaderConfig);
+               vm.executeModule(root);
+           }));
+    report("directory, ModuleLoader, cached", measure(iterations, [&] {
+               wrenpp::VM vm(loaderConfig);
+               vm.executeModule(root);
+           }));
+    wrenpp::ModuleLoader::clearCache();
+
+    report("bundle file", measure(iterations, [&root] {
+               const wrenpp::ModuleBundle bundle{std::string("coldstart.wrenb")};
+               wrenpp::Config config;
+               config.moduleBundle = &bundle;
+               wrenpp::VM vm(config);
+               vm.executeModule(root);
+           }));
+
+    for (const auto& module : modules)
+    {
+        std::remove((module.first + ".wren").c_str());
+    }
+    std::remove("coldstart.wrenb");
+}
+
+// the sections, in the order in which they run; a section's id identifies its results
+struct Section
+{
+    const char* id;
+    std::string title;
+    void (*run)();
+};
+
+const Section Sections[] = {
+    {"binding",
+     "Binding " + std::to_string(BoundClasses * MethodsPerClass) + " foreign methods per VM",
+     benchBinding},
+    {"pool", "Running short requests with and without a VM pool", benchPool},
+    {"serializer",
+     "Serializing a list of " + std::to_string(SerializedRecords) + " maps",
+     benchSerializer},
+    {"channels",
+     "Sending " + std::to_string(ChannelMessages) + " messages between VMs on separate threads",
+     benchChannels},
+    {"methods", "Calling Wren methods from C++", benchMethodCalls},
+    {"batches", "Calling a Wren method over batches of inputs", benchBatchedCalls},
+    {"executor",
+     "Mapping a method over " + std::to_string(ExecutorItems) + " items on several VMs",
+     benchExecutor},
+    {"functions", "Calling foreign functions from Wren", benchForeignFunctions},
+    {"strings", "Passing strings to and from C++", benchStrings},
+    {"containers", "Passing lists to and from C++", benchContainers},
+    {"objects", "Constructing and calling foreign objects", benchForeignObjects},
+    {"values", "Passing large foreign values to and from C++", benchForeignValues},
+    {"typed-arrays", "Summing typed arrays", benchTypedArrays},
+    {"fibers", "Resuming " + std::to_string(Fibers) + " scheduled fibers", benchFibers},
+    {"allocators", "Running allocation heavy scripts", benchAllocators},
+    {"gc-scheduling",
+     "Running " + std::to_string(Frames) + " frames with and without idle garbage collection",
+     benchGcScheduling},
+    {"cold-start",
+     "Starting a VM on a graph of " + std::to_string(GraphModules) + " modules",
+     benchColdStart},
+};
+
+int usage()
+{
+    std::fprintf(stderr, "usage: bench [--json output] [section...]\n\nsections:\n");
+    for (const Section& section : Sections)
+    {
+        std::fprintf(stderr, "  %s\n", section.id);
+    }
+    return 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const char* jsonPath = nullptr;
+    std::vector<std::string> selected;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc)
+        {
+            jsonPath = argv[++i];
+        }
+        else if (std::none_of(std::begin(Sections), std::end(Sections), [&arg](const Section& s) {
+                     return arg == s.id;
+                 }))
+        {
+            return usage();
+        }
+        else
+        {
+            selected.push_back(arg);
+        }
+    }
+
+    for (const Section& section : Sections)
+    {
+        if (!selected.empty() &&
+            std::find(selected.begin(), selected.end(), section.id) == selected.end())
+        {
+            continue;
+        }
+        std::printf("\n%s...\n\n", section.title.c_str());
+        currentSection = section.id;
+        section.run();
+    }
+
+    if (jsonPath)
+    {
+        std::ofstream out(jsonPath);
+        writeJson(out);
+        if (!out)
+        {
+            std::fprintf(stderr, "bench: can't write %s\n", jsonPath);
+            return 1;
+        }
+    }
+
+    return 0;
+}
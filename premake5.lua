@@ -10,6 +10,17 @@ newoption {
     description = "The location of the wren static lib"
 }
 
+newoption {
+    trigger     = "profile-bindings",
+    description = "Count and time the calls made to each foreign method binding"
+}
+
+newoption {
+    trigger     = "profiled-bindings",
+    value       = "count",
+    description = "The most bindings profiled per VM, 4096 by default"
+}
+
 workspace "wrenpp"
     local project_location = ""
     if _ACTION then
@@ -32,6 +43,12 @@ workspace "wrenpp"
     filter "action:vs*"
         defines { "_CRT_SECURE_NO_WARNINGS" }
 
+    filter "options:profile-bindings"
+        defines { "WRENPP_PROFILE_BINDINGS" }
+        if _OPTIONS["profiled-bindings"] then
+            defines { "WRENPP_PROFILED_BINDINGS=" .. _OPTIONS["profiled-bindings"] }
+        end
+
     filter "not action:vs*"
         buildoptions { "-std=c++14" }
 
@@ -81,4 +98,67 @@ workspace "wrenpp"
             links { "lib", "wren_static" }
 
         filter { "not action:vs*" }
-            links { "lib", "wren" }
+            links { "lib", "wren", "pthread" }
+
+    project "bench"
+        location(project_location)
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin/%{cfg.buildcfg}"
+        targetname "bench"
+        files { "Wren++.cpp", "bench/**.cpp", "bench/**.h" }
+        includedirs { "./", "bench" }
+        optimize "On"
+        if _OPTIONS["include"] then
+            includedirs { _OPTIONS["include"] }
+        end
+        if _OPTIONS["link"] then
+            libdirs {
+                _OPTIONS["link"]
+            }
+        end
+
+        prebuildcommands { "{MKDIR} %{cfg.targetdir}" }
+
+        filter "configurations:Debug"
+            debugdir "bin/%{cfg.buildcfg}"
+
+        filter { "action:vs*", "Debug" }
+            links { "lib", "wren_static_d" }
+
+        filter { "action:vs*", "Release"}
+            links { "lib", "wren_static" }
+
+        filter { "not action:vs*" }
+            links { "lib", "wren", "pthread" }
+
+    project "wrenpack"
+        location(project_location)
+        kind "ConsoleApp"
+        language "C++"
+        targetdir "bin/%{cfg.buildcfg}"
+        targetname "wrenpack"
+        files { "Wren++.cpp", "tools/wrenpack.cpp" }
+        includedirs { "./" }
+        if _OPTIONS["include"] then
+            includedirs { _OPTIONS["include"] }
+        end
+        if _OPTIONS["link"] then
+            libdirs {
+                _OPTIONS["link"]
+            }
+        end
+
+        prebuildcommands { "{MKDIR} %{cfg.targetdir}" }
+
+        filter "configurations:Debug"
+            debugdir "bin/%{cfg.buildcfg}"
+
+        filter { "action:vs*", "Debug" }
+            links { "lib", "wren_static_d" }
+
+        filter { "action:vs*", "Release"}
+            links { "lib", "wren_static" }
+
+        filter { "not action:vs*" }
+            links { "lib", "wren", "pthread" }
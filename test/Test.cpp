@@ -1,8 +1,22 @@
 #include "Wren++.h"
 #include <cassert>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // a small class to test class & method binding with
 struct Vec3
@@ -122,6 +136,32 @@ void testClassMethods()
     vm.executeModule("test_vector");
 }
 
+void testClassHandlesPerVM()
+{
+    // both VMs return Vec3 instances, each through its own cached class handle
+    wrenpp::VM first;
+    wrenpp::VM second;
+    bindVectorModule(first);
+    bindVectorModule(second);
+    const char* source =
+        "import \"vector\" for Vec3\n"
+        "var sumX = Fn.new {\n"
+        "  var v = Vec3.new(1, 0, 0)\n"
+        "  for (i in 0...4) v = v.plus(Vec3.new(1, 0, 0))\n"
+        "  return v.x\n"
+        "}\n";
+    first.executeString(source);
+    second.executeString(source);
+
+    wrenpp::Method firstSum = first.method("main", "sumX", "call()");
+    wrenpp::Method secondSum = second.method("main", "sumX", "call()");
+    for (int i = 0; i < 2; ++i)
+    {
+        assert(firstSum.call<double>() == 5.0);
+        assert(secondSum.call<double>() == 5.0);
+    }
+}
+
 void testProperties()
 {
     wrenpp::VM vm;
@@ -155,6 +195,92 @@ void testReturnValues()
     assert(!strcmp("Hello, world", sval.as<const char*>()));
 }
 
+void testValues()
+{
+    wrenpp::VM vm{};
+
+    vm.executeString(
+        "var returnsShort = Fn.new {\n"
+        "    return \"short\"\n"
+        "}\n"
+        "var returnsLong = Fn.new {\n"
+        "    return \"a string which is too long to be stored inline\"\n"
+        "}\n"
+        "var returnsNumber = Fn.new {\n"
+        "    return 42\n"
+        "}\n");
+
+    wrenpp::Value shortString = vm.method("main", "returnsShort", "call()")();
+    wrenpp::Value longString = vm.method("main", "returnsLong", "call()")();
+
+    // copies own their own strings, moves steal them
+    wrenpp::Value copy = longString;
+    wrenpp::Value moved = std::move(copy);
+    assert(copy.type() == WREN_TYPE_NULL);
+    assert(moved.as<std::string>() == longString.as<std::string>());
+    copy = shortString;
+    copy = moved;
+    assert(!strcmp(copy.as<const char*>(), "a string which is too long to be stored inline"));
+    assert(shortString.as<std::string>() == "short");
+
+    wrenpp::Value number = vm.method("main", "returnsNumber", "call()")();
+    assert(number.as<int>() == 42);
+    assert(number.as<unsigned>() == 42u);
+    assert(number.as<float>() == 42.f);
+
+    Vec3 v{1.f, 2.f, 3.f};
+    wrenpp::Value pointer(&v);
+    assert(pointer.as<Vec3*>() == &v);
+
+    vm.method("main", "returnsShort", "call()").callVoid();
+    wrenpp::Value borrowed = wrenpp::Value::borrowSlot(vm, 0);
+    assert(borrowed.isBorrowed());
+    assert(!strcmp(borrowed.as<const char*>(), "short"));
+}
+
+void testTypedCalls()
+{
+    wrenpp::VM vm{};
+
+    vm.executeString(
+        "var add = Fn.new { |a, b|\n"
+        "    return a + b\n"
+        "}\n"
+        "var isPositive = Fn.new { |x|\n"
+        "    return x > 0\n"
+        "}\n"
+        "var greet = Fn.new { |name|\n"
+        "    return \"Hello, %(name)\"\n"
+        "}\n"
+        "var fails = Fn.new {\n"
+        "    Fiber.abort(\"failing on purpose\")\n"
+        "}\n");
+    wrenpp::Method add = vm.method("main", "add", "call(_,_)");
+    assert(add.call<double>(1.0, 2) == 3.0);
+    assert(add.call<int>(2u, 3.f) == 5);
+    wrenpp::Method isPositive = vm.method("main", "isPositive", "call(_)");
+    assert(isPositive.call<bool>(4.0));
+    assert(!isPositive.call<bool>(-4.0));
+    wrenpp::Method greet = vm.method("main", "greet", "call(_)");
+    std::string name("world");
+    assert(greet.call<std::string>(name) == "Hello, world");
+    assert(greet.call<std::string>("Wren") == "Hello, Wren");
+    assert(greet.callVoid("Wren") == wrenpp::Result::Success);
+
+    wrenpp::Method fails = vm.method("main", "fails", "call()");
+    assert(fails.callVoid() == wrenpp::Result::RuntimeError);
+    bool threw = false;
+    try
+    {
+        fails.call<double>();
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    assert(threw);
+}
+
 void printConstRefString(const std::string& str) { std::printf("%s\n", str.c_str()); }
 
 void printValueString(std::string str) { std::printf("%s\n", str.c_str()); }
@@ -184,6 +310,1491 @@ void testStrings()
     vm.executeString("StringPrinter.print3(\"passing as C string works\")");
 }
 
+double sumVector(const std::vector<double>& values)
+{
+    double sum = 0.0;
+    for (double value : values)
+    {
+        sum += value;
+    }
+    return sum;
+}
+
+double sumListView(wrenpp::ListView<double> values)
+{
+    double sum = 0.0;
+    for (double value : values)
+    {
+        sum += value;
+    }
+    return sum;
+}
+
+std::vector<int> makeRange(int count)
+{
+    std::vector<int> range;
+    for (int i = 0; i < count; ++i)
+    {
+        range.push_back(i);
+    }
+    return range;
+}
+
+std::array<float, 3> reverseTriple(const std::array<float, 3>& triple)
+{
+    return std::array<float, 3>{{triple[2], triple[1], triple[0]}};
+}
+
+std::vector<std::vector<std::string>> nestStrings(std::vector<std::string> strings)
+{
+    return std::vector<std::vector<std::string>>{strings, strings};
+}
+
+std::map<std::string, int> countWords(const std::vector<std::string>& words)
+{
+    std::map<std::string, int> counts;
+    for (const std::string& word : words)
+    {
+        counts[word] += 1;
+    }
+    return counts;
+}
+
+int sumCounts(const std::unordered_map<std::string, int>& counts)
+{
+    int sum = 0;
+    for (const auto& count : counts)
+    {
+        sum += count.second;
+    }
+    return sum;
+}
+
+void testContainers()
+{
+    wrenpp::VM vm;
+
+    vm.beginModule("main")
+        .beginClass("Containers")
+        .bindFunction<decltype(&sumVector), &sumVector>(true, "sumVector(_)")
+        .bindFunction<decltype(&sumListView), &sumListView>(true, "sumListView(_)")
+        .bindFunction<decltype(&makeRange), &makeRange>(true, "makeRange(_)")
+        .bindFunction<decltype(&reverseTriple), &reverseTriple>(true, "reverseTriple(_)")
+        .bindFunction<decltype(&nestStrings), &nestStrings>(true, "nestStrings(_)")
+        .bindFunction<decltype(&countWords), &countWords>(true, "countWords(_)")
+        .bindFunction<decltype(&sumCounts), &sumCounts>(true, "sumCounts(_)")
+        .endClass();
+
+    vm.executeString(
+        "class Containers {\n"
+        "  foreign static sumVector(list)\n"
+        "  foreign static sumListView(list)\n"
+        "  foreign static makeRange(count)\n"
+        "  foreign static reverseTriple(list)\n"
+        "  foreign static nestStrings(list)\n"
+        "  foreign static countWords(list)\n"
+        "  foreign static sumCounts(pairs)\n"
+        "}\n"
+        "var sumVector = Fn.new { Containers.sumVector([1, 2, 3.5]) }\n"
+        "var sumListView = Fn.new { Containers.sumListView([1, 2, 3.5]) }\n"
+        "var rangeSum = Fn.new { Containers.makeRange(5).reduce { |a, b| a + b } }\n"
+        "var reversed = Fn.new {\n"
+        "  var triple = Containers.reverseTriple([1, 2, 3])\n"
+        "  return triple[0] == 3 && triple[1] == 2 && triple[2] == 1\n"
+        "}\n"
+        "var nested = Fn.new { Containers.nestStrings([\"a\", \"b\"])[1][1] }\n"
+        "var counted = Fn.new {\n"
+        "  var counts = {}\n"
+        "  for (pair in Containers.countWords([\"a\", \"b\", \"a\"])) counts[pair[0]] = pair[1]\n"
+        "  return counts[\"a\"] == 2 && counts[\"b\"] == 1\n"
+        "}\n"
+        "var countSum = Fn.new { Containers.sumCounts([[\"a\", 2], [\"b\", 3]]) }\n");
+
+    assert(vm.method("main", "sumVector", "call()").call<double>() == 6.5);
+    assert(vm.method("main", "sumListView", "call()").call<double>() == 6.5);
+    assert(vm.method("main", "rangeSum", "call()").call<int>() == 10);
+    assert(vm.method("main", "reversed", "call()").call<bool>());
+    assert(vm.method("main", "nested", "call()").call<std::string>() == "b");
+    assert(vm.method("main", "counted", "call()").call<bool>());
+    assert(vm.method("main", "countSum", "call()").call<int>() == 5);
+}
+
+std::vector<float> hostBuffer(8u, 1.f);
+
+wrenpp::Float32Array* hostArray()
+{
+    static wrenpp::Float32Array view(hostBuffer.data(), hostBuffer.size());
+    return &view;
+}
+
+struct CopyCounted
+{
+    static int copies;
+    static int moves;
+
+    int value{0};
+    bool movedFrom{false};
+
+    explicit CopyCounted(int value) : value{value} {}
+    CopyCounted(const CopyCounted& other) : value{other.value} { ++copies; }
+    CopyCounted(CopyCounted&& other) : value{other.value}
+    {
+        other.movedFrom = true;
+        ++moves;
+    }
+
+    CopyCounted plusOne() const { return CopyCounted{value + 1}; }
+
+    static void reset()
+    {
+        copies = 0;
+        moves = 0;
+    }
+};
+
+int CopyCounted::copies = 0;
+int CopyCounted::moves = 0;
+
+// a returned prvalue is only guaranteed not to be moved from C++17 on
+constexpr int ElidedMoves = __cplusplus >= 201703L ? 0 : 1;
+
+CopyCounted makeCopyCounted(int value) { return CopyCounted{value}; }
+int copyCountedByValue(CopyCounted counted) { return counted.value; }
+int copyCountedByConstRef(const CopyCounted& counted) { return counted.value; }
+int consumeCopyCounted(CopyCounted&& counted)
+{
+    CopyCounted sink{std::move(counted)};
+    return sink.value;
+}
+int consumeString(std::string&& text)
+{
+    const std::string sink{std::move(text)};
+    return int(sink.size());
+}
+
+void testForeignValueCopies()
+{
+    wrenpp::VM vm{};
+    vm.beginModule("main")
+        .bindClass<CopyCounted, int>("CopyCounted")
+        .bindMethod<decltype(&CopyCounted::plusOne), &CopyCounted::plusOne>(false, "plusOne()")
+        .bindGetter<decltype(CopyCounted::value), &CopyCounted::value>("value")
+        .bindGetter<decltype(CopyCounted::movedFrom), &CopyCounted::movedFrom>("movedFrom")
+        .endClass()
+        .beginClass("Host")
+        .bindFunction<decltype(&makeCopyCounted), &makeCopyCounted>(true, "make(_)")
+        .bindFunction<decltype(&copyCountedByValue), &copyCountedByValue>(true, "byValue(_)")
+        .bindFunction<decltype(&copyCountedByConstRef), &copyCountedByConstRef>(
+            true, "byConstRef(_)")
+        .bindFunction<decltype(&consumeCopyCounted), &consumeCopyCounted>(true, "consume(_)")
+        .bindFunction<decltype(&consumeString), &consumeString>(true, "consumeString(_)")
+        .endClass();
+    vm.executeString(
+        "foreign class CopyCounted {\n"
+        "  construct new(value) {}\n"
+        "  foreign plusOne()\n"
+        "  foreign value\n"
+        "  foreign movedFrom\n"
+        "}\n"
+        "class Host {\n"
+        "  foreign static make(value)\n"
+        "  foreign static byValue(counted)\n"
+        "  foreign static byConstRef(counted)\n"
+        "  foreign static consume(counted)\n"
+        "  foreign static consumeString(text)\n"
+        "}\n"
+        "var counted = CopyCounted.new(1)\n"
+        "var make = Fn.new { Host.make(2).value }\n"
+        "var plusOne = Fn.new { counted.plusOne().value }\n"
+        "var byValue = Fn.new { Host.byValue(counted) }\n"
+        "var byConstRef = Fn.new { Host.byConstRef(counted) }\n"
+        "var consume = Fn.new { Host.consume(counted) }\n"
+        "var movedFrom = Fn.new { counted.movedFrom }\n"
+        "var consumeString = Fn.new { Host.consumeString(\"four\") }\n"
+        "var identity = Fn.new { |x| x }\n");
+
+    // a free function's result is constructed right in the Wren object
+    CopyCounted::reset();
+    assert(vm.method("main", "make", "call()").call<int>() == 2);
+    assert(CopyCounted::copies == 0 && CopyCounted::moves <= ElidedMoves);
+
+    // a method's result is moved into it
+    CopyCounted::reset();
+    assert(vm.method("main", "plusOne", "call()").call<int>() == 2);
+    assert(CopyCounted::copies == 0 && CopyCounted::moves <= 1 + ElidedMoves);
+
+    // arguments passed from C++ are moved when they can be
+    wrenpp::Method identity = vm.method("main", "identity", "call(_)");
+    CopyCounted::reset();
+    identity.callVoid(CopyCounted{3});
+    assert(CopyCounted::copies == 0 && CopyCounted::moves == 1);
+    const CopyCounted local{4};
+    CopyCounted::reset();
+    identity.callVoid(local);
+    assert(CopyCounted::copies == 1 && CopyCounted::moves == 0);
+
+    // a by-value parameter gets a single copy, and a reference none
+    CopyCounted::reset();
+    assert(vm.method("main", "byValue", "call()").call<int>() == 1);
+    assert(CopyCounted::copies == 1 && CopyCounted::moves <= ElidedMoves);
+    CopyCounted::reset();
+    assert(vm.method("main", "byConstRef", "call()").call<int>() == 1);
+    assert(CopyCounted::copies == 0 && CopyCounted::moves == 0);
+
+    // an rvalue reference parameter gets a copy to move from, and the Wren object is left alone
+    CopyCounted::reset();
+    assert(vm.method("main", "consume", "call()").call<int>() == 1);
+    assert(CopyCounted::copies == 1 && CopyCounted::moves == 1);
+    assert(!vm.method("main", "movedFrom", "call()").call<bool>());
+
+    // other rvalue reference parameters read the slot as their own type
+    assert(vm.method("main", "consumeString", "call()").call<int>() == 4);
+}
+
+void testBatchedCalls()
+{
+    wrenpp::VM vm{};
+    vm.executeString(
+        "var multiply = Fn.new { |a, b| a * b }\n"
+        "var greet = Fn.new { |name| \"Hello, %(name)\" }\n"
+        "var failsAtThree = Fn.new { |x|\n"
+        "  if (x == 3) Fiber.abort(\"failing on purpose\")\n"
+        "}\n"
+        "class Scaler {\n"
+        "  construct new(factor) { _factor = factor }\n"
+        "  scale(x) { x * _factor }\n"
+        "}\n"
+        "var double = Scaler.new(2)\n"
+        "var triple = Scaler.new(3)\n");
+
+    const double lhs[] = {1.0, 2.0, 3.0, 4.0};
+    const int rhs[] = {5, 6, 7, 8};
+    double products[4] = {};
+    wrenpp::Method multiply = vm.method("main", "multiply", "call(_,_)");
+    assert(multiply.callBatch(4u, products, lhs, rhs) == 4u);
+    assert(products[0] == 5.0 && products[3] == 32.0);
+
+    const char* const names[] = {"Wren", "world"};
+    std::string greetings[2];
+    wrenpp::Method greet = vm.method("main", "greet", "call(_)");
+    assert(greet.callBatch(2u, greetings, names) == 2u);
+    assert(greetings[0] == "Hello, Wren" && greetings[1] == "Hello, world");
+
+    // the batch stops at the call which aborts
+    wrenpp::Method fails = vm.method("main", "failsAtThree", "call(_)");
+    assert(fails.callBatchVoid(4u, lhs) == 2u);
+
+    WrenHandle* receivers[2];
+    wrenEnsureSlots(vm, 1);
+    wrenGetVariable(vm, "main", "double", 0);
+    receivers[0] = wrenGetSlotHandle(vm, 0);
+    wrenGetVariable(vm, "main", "triple", 0);
+    receivers[1] = wrenGetSlotHandle(vm, 0);
+    double scaled[2] = {};
+    wrenpp::Method scale = vm.method("main", "double", "scale(_)");
+    assert(scale.callBatchOn(receivers, 2u, scaled, lhs) == 2u);
+    assert(scaled[0] == 2.0 && scaled[1] == 6.0);
+    wrenReleaseHandle(vm, receivers[0]);
+    wrenReleaseHandle(vm, receivers[1]);
+}
+
+void testTypedArrays()
+{
+    // moving an array hands its elements over instead of copying them
+    wrenpp::Float32Array owned{4u};
+    const float* elements = owned.data();
+    wrenpp::Float32Array moved{std::move(owned)};
+    assert(moved.data() == elements && !moved.isView() && moved.count() == 4u);
+    assert(owned.count() == 0u);
+    owned = std::move(moved);
+    assert(owned.data() == elements && moved.count() == 0u);
+
+    wrenpp::VM vm;
+    assert(wrenpp::bindTypedArrays(vm) == wrenpp::Result::Success);
+    vm.beginModule("main")
+        .beginClass("Host")
+        .bindFunction<decltype(&hostArray), &hostArray>(true, "array")
+        .endClass();
+
+    vm.executeString(
+        "import \"typed_array\" for Float32Array, Float64Array, Int32Array\n"
+        "class Host {\n"
+        "  foreign static array\n"
+        "}\n"
+        "var a = Float64Array.new(1000)\n"
+        "a.fill(2)\n"
+        "a[10] = -5\n"
+        "a[20] = 7\n"
+        "var b = Float64Array.new(1000)\n"
+        "b.copy(a)\n"
+        "b.scale(0.5)\n"
+        "a.axpy(2, b)\n"
+        "var sum = Fn.new { a.sum }\n"
+        "var min = Fn.new { a.min }\n"
+        "var max = Fn.new { a.max }\n"
+        "var count = Fn.new { Int32Array.new(3).count }\n"
+        "var truncates = Fn.new {\n"
+        "  var i = Int32Array.new(1)\n"
+        "  i[0] = 2.75\n"
+        "  return i[0]\n"
+        "}\n"
+        "var outOfBounds = Fn.new { a[1000] }\n"
+        "var scaleHost = Fn.new { Host.array.scale(3) }\n");
+
+    // every element is 2, except for -5 and 7, all doubled by adding b
+    assert(vm.method("main", "sum", "call()").call<double>() == 2.0 * (998.0 * 2.0 - 5.0 + 7.0));
+    assert(vm.method("main", "min", "call()").call<double>() == -10.0);
+    assert(vm.method("main", "max", "call()").call<double>() == 14.0);
+    assert(vm.method("main", "count", "call()").call<int>() == 3);
+    assert(vm.method("main", "truncates", "call()").call<int>() == 2);
+    assert(vm.method("main", "outOfBounds", "call()").callVoid() == wrenpp::Result::RuntimeError);
+
+    // the view writes straight through to the host's memory
+    vm.method("main", "scaleHost", "call()").callVoid();
+    for (float f : hostBuffer)
+    {
+        assert(f == 3.f);
+    }
+}
+
+struct Counted
+{
+    static int destroyed;
+
+    Counted() = default;
+    Counted(const Counted&) = default;
+    ~Counted() { ++destroyed; }
+};
+
+int Counted::destroyed = 0;
+
+Counted* returnCountedPtr()
+{
+    static Counted counted;
+    return &counted;
+}
+
+void testFinalizers()
+{
+    {
+        wrenpp::VM vm;
+        vm.beginModule("main")
+            .bindClass<Counted>("Counted")
+            .bindFunction<decltype(&returnCountedPtr), &returnCountedPtr>(true, "ptr()");
+
+        vm.executeString(
+            "foreign class Counted {\n"
+            "  construct new() {}\n"
+            "  foreign static ptr()\n"
+            "}\n"
+            "for (i in 0...3) Counted.new()\n"
+            "Counted.ptr()\n");
+    }
+
+    // the objects owned by Wren are destroyed along with the VM, the one owned by C++ is not
+    assert(Counted::destroyed == 3);
+}
+
+struct SharedMesh
+{
+    static int alive;
+    static int copies;
+
+    std::vector<float> vertices;
+
+    SharedMesh() { ++alive; }
+    SharedMesh(const SharedMesh& other) : vertices{other.vertices}
+    {
+        ++alive;
+        ++copies;
+    }
+    ~SharedMesh() { --alive; }
+
+    int vertexCount() const { return int(vertices.size()); }
+};
+
+int SharedMesh::alive = 0;
+int SharedMesh::copies = 0;
+
+std::shared_ptr<SharedMesh> keptMesh;
+
+std::shared_ptr<SharedMesh> makeSharedMesh(int count)
+{
+    auto mesh = std::make_shared<SharedMesh>();
+    mesh->vertices.resize(std::size_t(count));
+    return mesh;
+}
+
+void keepSharedMesh(std::shared_ptr<SharedMesh> mesh) { keptMesh = std::move(mesh); }
+
+const std::shared_ptr<SharedMesh>& hostSharedMesh()
+{
+    static std::shared_ptr<SharedMesh> mesh = makeSharedMesh(3);
+    return mesh;
+}
+
+// a plain struct, which opts in to the finalizer so that Wren can hold it shared
+struct SharedFrame
+{
+    float pixels[64];
+};
+
+namespace wrenpp
+{
+template<>
+struct SharedForeignClass<SharedFrame> : std::true_type
+{
+};
+} // namespace wrenpp
+
+std::shared_ptr<SharedFrame> hostFrame = std::make_shared<SharedFrame>();
+
+std::shared_ptr<SharedFrame> sharedFrame() { return hostFrame; }
+
+struct CountedTexture
+{
+    static int alive;
+
+    int references{0};
+    int width{0};
+
+    CountedTexture() { ++alive; }
+    CountedTexture(const CountedTexture&) = delete;
+    ~CountedTexture() { --alive; }
+
+    int area() const { return width * width; }
+};
+
+int CountedTexture::alive = 0;
+
+void intrusive_ptr_add_ref(CountedTexture* texture) { ++texture->references; }
+
+void intrusive_ptr_release(CountedTexture* texture)
+{
+    if (--texture->references == 0)
+    {
+        delete texture;
+    }
+}
+
+wrenpp::IntrusivePtr<CountedTexture> makeTexture(int width)
+{
+    wrenpp::IntrusivePtr<CountedTexture> texture{new CountedTexture};
+    texture->width = width;
+    return texture;
+}
+
+int textureReferences(wrenpp::IntrusivePtr<CountedTexture> texture)
+{
+    return texture->references;
+}
+
+void testSharedForeignObjects()
+{
+    {
+        wrenpp::VM vm;
+        vm.beginModule("main")
+            .bindClass<SharedMesh>("SharedMesh")
+            .bindMethod<decltype(&SharedMesh::vertexCount), &SharedMesh::vertexCount>(
+                false, "vertexCount()")
+            .endClass()
+            .bindClass<SharedFrame>("SharedFrame")
+            .endClass()
+            .bindClass<CountedTexture>("CountedTexture")
+            .bindMethod<decltype(&CountedTexture::area), &CountedTexture::area>(false, "area()")
+            .endClass()
+            .beginClass("SharedHost")
+            .bindFunction<decltype(&makeSharedMesh), &makeSharedMesh>(true, "mesh(_)")
+            .bindFunction<decltype(&keepSharedMesh), &keepSharedMesh>(true, "keep(_)")
+            .bindFunction<decltype(&hostSharedMesh), &hostSharedMesh>(true, "hostMesh()")
+            .bindFunction<decltype(&sharedFrame), &sharedFrame>(true, "frame()")
+            .bindFunction<decltype(&makeTexture), &makeTexture>(true, "texture(_)")
+            .bindFunction<decltype(&textureReferences), &textureReferences>(
+                true, "references(_)")
+            .endClass();
+        vm.executeString(
+            "foreign class SharedMesh {\n"
+            "  construct new() {}\n"
+            "  foreign vertexCount()\n"
+            "}\n"
+            "foreign class SharedFrame {}\n"
+            "foreign class CountedTexture {\n"
+            "  construct new() {}\n"
+            "  foreign area()\n"
+            "}\n"
+            "class SharedHost {\n"
+            "  foreign static mesh(count)\n"
+            "  foreign static keep(mesh)\n"
+            "  foreign static hostMesh()\n"
+            "  foreign static frame()\n"
+            "  foreign static texture(width)\n"
+            "  foreign static references(texture)\n"
+            "}\n"
+            "var mesh = SharedHost.mesh(1000)\n"
+            "var texture = SharedHost.texture(4)\n"
+            "var frame = SharedHost.frame()\n"
+            "var vertexCount = Fn.new { mesh.vertexCount() }\n"
+            "var keep = Fn.new { SharedHost.keep(mesh) }\n"
+            "var hostMesh = Fn.new { SharedHost.hostMesh().vertexCount() }\n"
+            "var area = Fn.new { texture.area() }\n"
+            "var references = Fn.new { SharedHost.references(texture) }\n"
+            "var keepOwnMesh = Fn.new { SharedHost.keep(SharedMesh.new()) }\n"
+            "var ownTextureReferences = Fn.new { SharedHost.references(CountedTexture.new()) }\n"
+            "var drop = Fn.new {\n"
+            "  mesh = null\n"
+            "  texture = null\n"
+            "  frame = null\n"
+            "}\n"
+            "var identity = Fn.new { |x| x }\n");
+
+        // the object stays in C++, and methods are called on it without copying it
+        assert(SharedMesh::alive == 1 && SharedMesh::copies == 0);
+        assert(vm.method("main", "vertexCount", "call()").call<int>() == 1000);
+        assert(vm.method("main", "area", "call()").call<int>() == 16);
+        assert(CountedTexture::alive == 1);
+        assert(hostFrame.use_count() == 2);
+
+        // a shared_ptr parameter shares the ownership with Wren
+        vm.method("main", "keep", "call()").callVoid();
+        assert(keptMesh.use_count() == 2);
+        assert(vm.method("main", "references", "call()").call<int>() == 2);
+
+        // objects which Wren owns by itself can't be shared from within a call
+        assert(
+            vm.method("main", "keepOwnMesh", "call()").callVoid() ==
+            wrenpp::Result::RuntimeError);
+        assert(keptMesh.use_count() == 2);
+        assert(
+            vm.method("main", "ownTextureReferences", "call()").callVoid() ==
+            wrenpp::Result::RuntimeError);
+
+        // a returned reference to a shared_ptr adds Wren as an owner
+        assert(vm.method("main", "hostMesh", "call()").call<int>() == 3);
+        assert(SharedMesh::copies == 0);
+
+        // Wren gives up its references when its objects are finalized
+        vm.method("main", "drop", "call()").callVoid();
+        vm.collectGarbage();
+        assert(keptMesh.use_count() == 1);
+        assert(CountedTexture::alive == 0);
+        assert(hostFrame.use_count() == 1);
+        keptMesh.reset();
+        assert(SharedMesh::alive == 1);
+
+        // and objects passed in from C++ are shared the same way
+        std::shared_ptr<SharedMesh> mesh = makeSharedMesh(2);
+        wrenpp::Method identity = vm.method("main", "identity", "call(_)");
+        identity.callVoid(mesh);
+        identity.callVoid(wrenpp::IntrusivePtr<CountedTexture>{});
+        vm.collectGarbage();
+        assert(mesh.use_count() == 1);
+    }
+
+    // a shared object outlives the VM as long as C++ holds it
+    assert(SharedMesh::alive == 1 && SharedMesh::copies == 0);
+}
+
+int returnsOne() { return 1; }
+
+int returnsTwo() { return 2; }
+
+int returnsThree() { return 3; }
+
+void testSignatureCollisions()
+{
+    wrenpp::VM vm;
+
+    // the qualified names "main" + "A" + "bc()" and "main" + "Ab" + "c()" are identical when
+    // simply concatenated
+    vm.beginModule("main")
+        .beginClass("A")
+        .bindFunction<decltype(&returnsOne), &returnsOne>(true, "bc()")
+        .endClass()
+        .beginClass("Ab")
+        .bindFunction<decltype(&returnsTwo), &returnsTwo>(true, "c()")
+        .endClass();
+
+    vm.executeString(
+        "class A {\n"
+        "  foreign static bc()\n"
+        "}\n"
+        "class Ab {\n"
+        "  foreign static c()\n"
+        "}\n");
+
+    assert(vm.method("main", "A", "bc()")().as<double>() == 1.0);
+    assert(vm.method("main", "Ab", "c()")().as<double>() == 2.0);
+
+    // binding after the VM has already looked up methods must still work
+    vm.beginModule("main")
+        .beginClass("B")
+        .bindFunction<decltype(&returnsThree), &returnsThree>(true, "bc()")
+        .endClass();
+
+    vm.executeString(
+        "class B {\n"
+        "  foreign static bc()\n"
+        "}\n");
+
+    assert(vm.method("main", "B", "bc()")().as<double>() == 3.0);
+}
+
+struct CountingHeap
+{
+    long live = 0;
+    int allocations = 0;
+    int frees = 0;
+};
+
+void* countingAllocator(void* memory, std::size_t oldSize, std::size_t newSize, void* userData)
+{
+    CountingHeap* heap = static_cast<CountingHeap*>(userData);
+    heap->live += long(newSize) - long(oldSize);
+    if (memory == nullptr)
+    {
+        ++heap->allocations;
+    }
+    if (newSize == 0u)
+    {
+        ++heap->frees;
+        std::free(memory);
+        return nullptr;
+    }
+    return std::realloc(memory, newSize);
+}
+
+void testConfig()
+{
+    CountingHeap first;
+    CountingHeap second;
+    {
+        wrenpp::Config config;
+        config.allocatorFn = countingAllocator;
+        config.allocatorData = &first;
+        config.initialHeapSize = 0x10000u;
+        config.minHeapSize = 0x1000u;
+        wrenpp::VM firstVM(config);
+        config.allocatorData = &second;
+        wrenpp::VM secondVM(config);
+        wrenpp::VM defaultVM;
+
+        firstVM.executeString(
+            "var strings = []\n"
+            "for (i in 0...1000) strings.add(\"string %(i)\")\n");
+        const int secondAllocations = second.allocations;
+        assert(first.allocations > secondAllocations);
+        firstVM.collectGarbage();
+
+        // strings passed to and from Wren are allocated by the VM they're passed to
+        secondVM.executeString("var echo = Fn.new {|s| s + s }");
+        wrenpp::Method echo = secondVM.method("main", "echo", "call(_)");
+        assert(echo.call<std::string>("a long enough string to heap allocate").size() == 74u);
+        assert(second.allocations > secondAllocations);
+
+        defaultVM.executeString("var x = \"default\"");
+    }
+    assert(first.live == 0 && first.allocations == first.frees);
+    assert(second.live == 0 && second.allocations == second.frees);
+}
+
+// runs frames which only allocate garbage, with an idle window after each, and returns the number
+// of collections which happened within the frames
+std::uint64_t runFrames(wrenpp::VM& vm)
+{
+    vm.executeString(
+        "var frame = Fn.new {\n"
+        "  for (i in 0...200) {\n"
+        "    var garbage = \"frame garbage %(i)\"\n"
+        "  }\n"
+        "}\n");
+    wrenpp::Method frame = vm.method("main", "frame", "call()");
+    for (int i = 0; i < 200; ++i)
+    {
+        frame.callVoid();
+        vm.idle(std::chrono::seconds(1));
+    }
+    const wrenpp::HeapStats stats = vm.heapStats();
+    return stats.collections - stats.idleCollections - stats.explicitCollections;
+}
+
+void testGcScheduler()
+{
+    wrenpp::GcScheduler scheduler;
+    wrenpp::Config base;
+    base.initialHeapSize = 0x8000u;
+    base.minHeapSize = 0x8000u;
+    {
+        wrenpp::VM vm(scheduler.configure(base));
+        runFrames(vm);
+        assert(vm.heapStats().idleCollections > 0u);
+    }
+    assert(scheduler.reports() == 1u);
+
+    // the learned heap holds what survives collections, plus room for two windows
+    const wrenpp::Config learned = scheduler.configure(base);
+    assert(learned.scheduler == &scheduler);
+    assert(learned.minHeapSize > base.minHeapSize);
+    assert(learned.initialHeapSize == learned.minHeapSize);
+    {
+        wrenpp::VM vm(learned);
+        // at most the compilation of the script may collect outside of an idle window
+        assert(runFrames(vm) <= 1u);
+        assert(vm.heapStats().idleCollections > 0u);
+    }
+    assert(scheduler.reports() == 2u);
+}
+
+void writeModule(const char* path, const char* source)
+{
+    // replace the file as a whole, as a mapped source would see changes made in place
+    {
+        std::ofstream file("module_update.tmp");
+        file << source;
+    }
+    // Windows won't rename over an existing file
+    std::remove(path);
+    std::rename("module_update.tmp", path);
+}
+
+void testModuleLoader()
+{
+    writeModule("loader_module.wren", "var value = Fn.new { 1 }\n");
+    wrenpp::ModuleLoader loader{{"missing_directory", "."}};
+    wrenpp::Config config;
+    config.moduleLoader = &loader;
+
+    std::shared_ptr<const wrenpp::ModuleLoader::Source> source = loader.find("loader_module");
+    assert(source && source->size() == 25u);
+    // the file is mapped once, every VM shares it
+    assert(loader.find("loader_module") == source);
+    assert(!loader.find("no_such_module"));
+
+    {
+        wrenpp::VM vm(config);
+        assert(vm.executeModule("loader_module") == wrenpp::Result::Success);
+        assert(vm.method("loader_module", "value", "call()").call<int>() == 1);
+        assert(vm.executeModule("no_such_module") == wrenpp::Result::CompileError);
+    }
+
+    // a changed file is mapped again, while the old source stays valid
+    writeModule("loader_module.wren", "var value = Fn.new { 1 + 1 }\n");
+    {
+        wrenpp::VM vm(config);
+        vm.executeString(
+            "import \"loader_module\" for value\n"
+            "var imported = Fn.new { value.call() }\n");
+        assert(vm.method("main", "imported", "call()").call<int>() == 2);
+    }
+    assert(loader.find("loader_module") != source);
+    assert(std::string(source->data(), 9u) == "var value");
+
+    // a rewrite of the same size within the same second is mapped again too
+    const std::shared_ptr<const wrenpp::ModuleLoader::Source> changed =
+        loader.find("loader_module");
+    writeModule("loader_module.wren", "var value = Fn.new { 1 + 2 }\n");
+    assert(loader.find("loader_module") != changed);
+    // every spelling of the path shares one cache entry
+    wrenpp::ModuleLoader spelled{{"./."}};
+    assert(spelled.find("loader_module") == loader.find("loader_module"));
+
+    source.reset();
+    wrenpp::ModuleLoader::clearCache();
+    std::remove("loader_module.wren");
+}
+
+void testModuleBundle()
+{
+    const std::string packed = wrenpp::ModuleBundle::pack(
+        {{"bundle_main",
+          "import \"bundle/lib\" for answer\n"
+          "var value = Fn.new { answer + 1 }\n"},
+         {"bundle/lib", "var answer = 41\n"}});
+    const wrenpp::ModuleBundle bundle(packed.data(), packed.size());
+    assert(bundle.moduleCount() == 2u);
+    std::size_t size = 0u;
+    assert(std::strcmp(bundle.find("bundle/lib", &size), "var answer = 41\n") == 0);
+    assert(size == 16u);
+    assert(bundle.find("bundle") == nullptr);
+
+    wrenpp::Config config;
+    config.moduleBundle = &bundle;
+    wrenpp::VM vm(config);
+    assert(vm.executeModule("bundle_main") == wrenpp::Result::Success);
+    assert(vm.method("bundle_main", "value", "call()").call<int>() == 42);
+
+    bool threw = false;
+    try
+    {
+        wrenpp::ModuleBundle truncated(packed.data(), packed.size() / 2u);
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void testPoolAllocator()
+{
+    wrenpp::PoolAllocator pool;
+    {
+        wrenpp::Config config;
+        config.allocatorFn = wrenpp::PoolAllocator::reallocate;
+        config.allocatorData = &pool;
+        wrenpp::VM vm(config);
+        vm.executeString(
+            "var strings = []\n"
+            "for (i in 0...1000) strings.add(\"string %(i)\")\n"
+            "var total = Fn.new {\n"
+            "  var n = 0\n"
+            "  for (s in strings) n = n + s.count\n"
+            "  return n\n"
+            "}\n");
+        vm.collectGarbage();
+        assert(vm.method("main", "total", "call()").call<int>() > 0);
+    }
+
+    // everything the VM allocated was returned, to the size class it came from
+    const wrenpp::PoolAllocator::Stats stats = pool.stats();
+    std::uint64_t allocations = 0u;
+    for (const wrenpp::PoolAllocator::SizeClassStats& sizeClass : stats.sizeClasses)
+    {
+        assert(sizeClass.allocations == sizeClass.frees);
+        allocations += sizeClass.allocations;
+    }
+    assert(allocations > 1000u);
+    assert(stats.largeAllocations == stats.largeFrees);
+    assert(stats.slabBytes > 0u);
+}
+
+void testHeapStats()
+{
+    wrenpp::Config config;
+    config.initialHeapSize = 0x10000u;
+    config.minHeapSize = 0x8000u;
+    wrenpp::VM vm(config);
+    const wrenpp::HeapStats initial = vm.heapStats();
+    assert(initial.liveBytes > 0u && initial.collections == 0u);
+
+    vm.executeString(
+        "for (i in 0...10000) {\n"
+        "  var garbage = \"string %(i)\"\n"
+        "}\n");
+    const wrenpp::HeapStats implicit = vm.heapStats();
+    assert(implicit.collections > 0u && implicit.explicitCollections == 0u);
+    assert(implicit.peakBytes >= implicit.liveBytes);
+    assert(implicit.allocations > implicit.frees);
+
+    vm.collectGarbage();
+    const wrenpp::HeapStats collected = vm.heapStats();
+    // the collections kept the heap within heapGrowthPercent of what's really live
+    assert(implicit.peakBytes < 2u * collected.liveBytes + config.minHeapSize);
+    assert(collected.collections == implicit.collections + 1u);
+    assert(collected.explicitCollections == 1u);
+    assert(collected.liveBytes <= implicit.liveBytes);
+    assert(collected.maxPause <= collected.totalPause);
+    assert(collected.maxPause.count() > 0);
+
+    // a VM driven through the C API directly still collects, by Wren's own thresholds
+    wrenpp::VM raw(config);
+    raw.beginModule("main").bindClass<Counted>("Counted").endClass();
+    raw.executeString(
+        "foreign class Counted {\n"
+        "  construct new() {}\n"
+        "}\n");
+    const int destroyed = Counted::destroyed;
+    wrenInterpret(raw.ptr(), "main", "for (i in 0...100000) Counted.new()\n");
+    assert(Counted::destroyed > destroyed);
+}
+
+double half(double x) { return x / 2.0; }
+
+void testBindingProfile()
+{
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Profiled")
+        .bindFunction<decltype(&half), &half>(true, "half(_)")
+        .bindCFunction(true, "noop()", [](WrenVM*) {})
+        .endClass();
+    vm.executeString(
+        "class Profiled {\n"
+        "  foreign static half(x)\n"
+        "  foreign static noop()\n"
+        "}\n"
+        "var run = Fn.new {\n"
+        "  for (i in 0...100) Profiled.half(i)\n"
+        "  Profiled.noop()\n"
+        "}\n");
+    wrenpp::Method run = vm.method("main", "run", "call()");
+
+    // nothing is counted until profiling is switched on
+    run.callVoid();
+    assert(vm.hottestBindings(10).empty());
+
+    vm.setBindingProfiling(true);
+    run.callVoid();
+    run.callVoid();
+    const std::vector<wrenpp::BindingProfile> bindings = vm.hottestBindings(10);
+#ifdef WRENPP_PROFILE_BINDINGS
+    assert(bindings.size() == 2u);
+    const wrenpp::BindingProfile& halves =
+        bindings[0].signature == "half(_)" ? bindings[0] : bindings[1];
+    assert(halves.module == "main" && halves.className == "Profiled" && halves.isStatic);
+    assert(halves.calls == 200u);
+    assert(halves.maxTime <= halves.totalTime);
+    assert(vm.hottestBindings(1).size() == 1u);
+
+    vm.resetBindingProfile();
+    assert(vm.hottestBindings(10).empty());
+    // far below the limit, every binding is profiled
+    assert(vm.unprofiledBindings() == 0u);
+#else
+    assert(bindings.empty());
+#endif
+}
+
+std::vector<std::promise<double>> requests;
+
+std::future<double> request(double)
+{
+    requests.emplace_back();
+    return requests.back().get_future();
+}
+
+void testFiberScheduler()
+{
+    requests.clear();
+    std::string errors;
+    const wrenpp::ErrorFn errorFn = wrenpp::VM::errorFn;
+    wrenpp::VM::errorFn = [&errors](WrenErrorType, const char*, int, const char* message) {
+        errors += message;
+    };
+
+    wrenpp::VM vm;
+    vm.beginModule("main")
+        .beginClass("Host")
+        .bindAsyncFunction<decltype(&request), &request>(true, "request(_)")
+        .endClass();
+    wrenpp::FiberScheduler scheduler(vm);
+    vm.executeString(
+        "import \"scheduler\" for Scheduler\n"
+        "class Host {\n"
+        "  foreign static request(x)\n"
+        "}\n"
+        "var results = []\n"
+        "var worker = Fn.new {\n"
+        "  var value = Scheduler.await(Host.request(1))\n"
+        "  results.add(value)\n"
+        "  Scheduler.yield()\n"
+        "  results.add(value + 1)\n"
+        "}\n"
+        "var spinner = Fn.new {\n"
+        "  while (true) Scheduler.yield()\n"
+        "}\n"
+        "var sum = Fn.new { results.reduce(0) {|a, b| a + b } }\n");
+    const std::chrono::seconds budget{1};
+
+    scheduler.spawn("main", "worker");
+    scheduler.spawn("main", "worker");
+    assert(scheduler.fiberCount() == 2u);
+    assert(scheduler.tick(budget) == 2u);
+    assert(scheduler.awaitingCount() == 2u && requests.size() == 2u);
+    // nothing to do until a result is in
+    assert(scheduler.tick(budget) == 0u);
+
+    requests[0].set_value(10.0);
+    assert(scheduler.tick(budget) == 1u);
+    assert(scheduler.awaitingCount() == 1u && scheduler.fiberCount() == 2u);
+
+    // the exception aborts the second fiber, while the first one finishes
+    requests[1].set_exception(std::make_exception_ptr(std::runtime_error("disk on fire")));
+    assert(scheduler.tick(budget) == 2u);
+    assert(scheduler.fiberCount() == 0u);
+    assert(errors.find("disk on fire") != std::string::npos);
+    assert(vm.method("main", "sum", "call()").call<double>() == 21.0);
+
+    // a fiber runs even with no budget left, but the others wait for the next tick
+    for (int i = 0; i < 3; ++i)
+    {
+        scheduler.spawn("main", "spinner");
+    }
+    assert(scheduler.tick(std::chrono::nanoseconds(0)) == 1u);
+    assert(scheduler.tick(budget) == 3u);
+    assert(scheduler.fiberCount() == 3u);
+
+    // there's no fiber to suspend outside of the scheduler
+    errors.clear();
+    assert(vm.executeString("Host.request(2)") == wrenpp::Result::RuntimeError);
+    assert(errors.find("scheduled fiber") != std::string::npos);
+
+    wrenpp::VM::errorFn = errorFn;
+}
+
+template<int N>
+struct Tagged
+{
+    int value;
+
+    explicit Tagged(int value) : value{value} {}
+
+    Tagged twice() const { return Tagged{2 * value + N}; }
+};
+
+template<int N>
+void bindTagged(wrenpp::VM& vm)
+{
+    vm.beginModule("main")
+        .bindClass<Tagged<N>, int>("Tagged" + std::to_string(N))
+        .template bindGetter<decltype(Tagged<N>::value), &Tagged<N>::value>("value")
+        .template bindMethod<decltype(&Tagged<N>::twice), &Tagged<N>::twice>(false, "twice()")
+        .endClass()
+        .endModule();
+}
+
+void testBindingAcrossThreads()
+{
+    // each thread runs its own VMs, binding the same types in a different order, so that type ids
+    // and class names are first registered concurrently
+    using Binder = void (*)(wrenpp::VM&);
+    const std::array<Binder, 4> binders{
+        {&bindTagged<0>, &bindTagged<1>, &bindTagged<2>, &bindTagged<3>}};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&binders, t]() {
+            for (int round = 0; round < 10; ++round)
+            {
+                wrenpp::VM vm;
+                for (std::size_t i = 0u; i < binders.size(); ++i)
+                {
+                    binders[(t + i) % binders.size()](vm);
+                }
+                vm.executeString(
+                    "foreign class Tagged0 {\n"
+                    "  construct new(value) {}\n"
+                    "  foreign value\n"
+                    "  foreign twice()\n"
+                    "}\n"
+                    "foreign class Tagged1 {\n"
+                    "  construct new(value) {}\n"
+                    "  foreign value\n"
+                    "  foreign twice()\n"
+                    "}\n"
+                    "foreign class Tagged2 {\n"
+                    "  construct new(value) {}\n"
+                    "  foreign value\n"
+                    "  foreign twice()\n"
+                    "}\n"
+                    "foreign class Tagged3 {\n"
+                    "  construct new(value) {}\n"
+                    "  foreign value\n"
+                    "  foreign twice()\n"
+                    "}\n"
+                    "var total = Fn.new {|x|\n"
+                    "  return Tagged0.new(x).twice().value + Tagged1.new(x).twice().value +\n"
+                    "    Tagged2.new(x).twice().value + Tagged3.new(x).twice().value\n"
+                    "}\n");
+
+                wrenpp::Method total = vm.method("main", "total", "call(_)");
+                // 4 * 2x + (0 + 1 + 2 + 3)
+                assert(total.call<int>(t + round) == 8 * (t + round) + 6);
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void testExecutor()
+{
+    std::atomic<int> vms{0};
+    const auto setup = [&vms](wrenpp::VM& vm) {
+        ++vms;
+        vm.executeString(
+            "var square = Fn.new { |x|\n"
+            "  if (x == 5000) Fiber.abort(\"failing on purpose\")\n"
+            "  return x * x\n"
+            "}\n");
+    };
+    wrenpp::Executor executor{4u, setup};
+    assert(vms == 4 && executor.workerCount() == 4u);
+
+    const std::size_t count = 10000u;
+    std::vector<double> inputs(count);
+    std::vector<double> squares(count, -1.0);
+    for (std::size_t i = 0u; i < count; ++i)
+    {
+        inputs[i] = double(i);
+    }
+    // the call which aborts is skipped, and the rest of its chunk still runs
+    assert(executor.map("main", "square", "call(_)", count, squares.data(), inputs.data()) == 1u);
+    for (std::size_t i = 0u; i < count; ++i)
+    {
+        assert(i == 5000u ? squares[i] == -1.0 : squares[i] == double(i * i));
+    }
+
+    // small chunks, so that the workers steal from each other
+    executor.setChunkSize(7u);
+    std::fill(squares.begin(), squares.end(), -1.0);
+    assert(executor.map("main", "square", "call(_)", 4999u, squares.data(), inputs.data()) == 0u);
+    assert(squares[4998] == 4998.0 * 4998.0 && squares[4999] == -1.0);
+
+    bool threw = false;
+    try
+    {
+        wrenpp::Executor failing{2u, [](wrenpp::VM&) { throw std::runtime_error("no setup"); }};
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void testVMPool()
+{
+    int setups = 0;
+    int resets = 0;
+    wrenpp::VMPool::Options options;
+    options.size = 2u;
+    options.maxUses = 3u;
+    options.reset = [&resets](wrenpp::VM& vm) {
+        ++resets;
+        vm.executeString("Counter.count = 0\n");
+    };
+    wrenpp::VMPool pool{
+        [&setups](wrenpp::VM& vm) {
+            ++setups;
+            vm.executeString(
+                "class Counter {\n"
+                "  static count { __count }\n"
+                "  static count=(value) { __count = value }\n"
+                "}\n"
+                "Counter.count = 0\n");
+        },
+        options};
+    assert(setups == 2);
+
+    {
+        wrenpp::VMPool::Lease first = pool.acquire();
+        wrenpp::VMPool::Lease second = pool.acquire();
+        assert(first && second && &*first != &*second);
+        first->executeString("Counter.count = Counter.count + 1\n");
+        assert(first->method("main", "Counter", "count").call<int>() == 1);
+    }
+    assert(resets == 2);
+
+    // the reset cleared what the last lease left behind
+    for (int i = 0; i < 3; ++i)
+    {
+        wrenpp::VMPool::Lease lease = pool.acquire();
+        assert(lease->method("main", "Counter", "count").call<int>() == 0);
+        lease->executeString("Counter.count = Counter.count + 1\n");
+    }
+    // the most recently returned VM is leased first, so one of them reached its third use
+    wrenpp::VMPool::Stats stats = pool.stats();
+    assert(stats.recycled == 1u && stats.size == 1u && stats.idle == 1u);
+    pool.refill();
+    assert(setups == 3 && pool.stats().size == 2u);
+
+    {
+        wrenpp::VMPool::Lease lease = pool.acquire();
+        lease.discard();
+    }
+    stats = pool.stats();
+    assert(stats.acquisitions == 6u && stats.hits == 6u && stats.recycled == 2u);
+    assert(stats.hitRate() == 1.0);
+}
+
+void testSharedBuffers()
+{
+    const wrenpp::SharedBuffer first{std::vector<double>{1.5, 2.5, 3.5}};
+    wrenpp::PublishedBuffer prices{first};
+    assert(first.count<double>() == 3u && first.read<double>(2) == 3.5);
+
+    std::atomic<int> started{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&prices, &started]() {
+            wrenpp::VM vm;
+            assert(wrenpp::bindSharedBuffers(vm) == wrenpp::Result::Success);
+            vm.executeString(
+                "import \"shared_buffer\" for SharedBuffer, PublishedBuffer\n"
+                "var total = Fn.new { |published|\n"
+                "  var snapshot = published.current\n"
+                "  var sum = 0\n"
+                "  for (i in 0...(snapshot.byteCount / 8)) sum = sum + snapshot.float64(i)\n"
+                "  return sum\n"
+                "}\n"
+                "var pastTheEnd = Fn.new { |published| published.current.float64(3) }\n");
+            wrenpp::Method total = vm.method("main", "total", "call(_)");
+            ++started;
+            for (int round = 0; round < 200; ++round)
+            {
+                // each call sees either version, never a mix of the two
+                const double sum = total.call<double>(&prices);
+                assert(sum == 7.5 || sum == 30.0);
+            }
+            wrenpp::Method pastTheEnd = vm.method("main", "pastTheEnd", "call(_)");
+            assert(pastTheEnd.callVoid(&prices) == wrenpp::Result::RuntimeError);
+        });
+    }
+    while (started < 2)
+    {
+        std::this_thread::yield();
+    }
+    assert(prices.publish(wrenpp::SharedBuffer{std::vector<double>{10.0, 20.0}}) == 1u);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    // the VMs released the old version when they were freed
+    assert(prices.version() == 1u && first.useCount() == 1);
+    assert(prices.current().read<double>(1) == 20.0);
+}
+
+void testChannels()
+{
+    wrenpp::Channel channel{4u};
+    assert(channel.capacity() == 4u && channel.empty());
+
+    wrenpp::VM receiver;
+    assert(wrenpp::bindChannels(receiver) == wrenpp::Result::Success);
+    wrenpp::FiberScheduler scheduler(receiver);
+    receiver.executeString(
+        "import \"channel\" for Channel\n"
+        "var inbox = null\n"
+        "var received = []\n"
+        "var setInbox = Fn.new { |channel| inbox = channel }\n"
+        "var receive = Fn.new {\n"
+        "  for (i in 0...4) received.add(inbox.receive())\n"
+        "}\n"
+        "var check = Fn.new {\n"
+        "  return received[0] == 1.5 && received[1] == \"two\" &&\n"
+        "    received[2].count == 4 && received[2][1][0] == true && received[2][2] == \"x\" &&\n"
+        "    Object.same(received[2][1], received[2][3]) &&\n"
+        "    received[3][\"key\"][0] == 3 && received[3][\"key\"][1] == null &&\n"
+        "    received[3][4] == false && received[3][\"empty\"].count == 0\n"
+        "}\n");
+    receiver.method("main", "setInbox", "call(_)").callVoid(&channel);
+
+    // the fiber parks until a message arrives
+    scheduler.spawn("main", "receive");
+    const std::chrono::seconds budget{1};
+    scheduler.tick(budget);
+    assert(scheduler.awaitingCount() == 1u);
+    scheduler.tick(budget);
+    assert(scheduler.awaitingCount() == 1u);
+
+    wrenpp::VM sender;
+    assert(wrenpp::bindChannels(sender) == wrenpp::Result::Success);
+    sender.executeString(
+        "import \"channel\" for Channel\n"
+        "var pair = [true, null]\n"
+        "var send = Fn.new { |channel|\n"
+        "  return channel.trySend(1.5) && channel.trySend(\"two\") &&\n"
+        "    channel.trySend([1, pair, \"x\", pair]) &&\n"
+        "    channel.trySend({\"key\": [3, null], 4: false, \"empty\": {}})\n"
+        "}\n"
+        "var sendOne = Fn.new { |channel| channel.trySend(1) }\n"
+        "var sendFn = Fn.new { |channel| channel.trySend(Fn.new {}) }\n");
+    assert(sender.method("main", "send", "call(_)").call<bool>(&channel));
+    assert(channel.full());
+    assert(!sender.method("main", "sendOne", "call(_)").call<bool>(&channel));
+    const wrenpp::ErrorFn errorFn = wrenpp::VM::errorFn;
+    wrenpp::VM::errorFn = [](WrenErrorType, const char*, int, const char*) {};
+    assert(
+        sender.method("main", "sendFn", "call(_)").callVoid(&channel) ==
+        wrenpp::Result::RuntimeError);
+    wrenpp::VM::errorFn = errorFn;
+
+    while (scheduler.fiberCount() != 0u)
+    {
+        scheduler.tick(budget);
+    }
+    assert(channel.empty());
+    assert(receiver.method("main", "check", "call()").call<bool>());
+
+    // a message which can't be read aborts the receiving fiber instead of unwinding through Wren
+    receiver.executeString(
+        "var receiveError = Fn.new { |channel| Fiber.new { channel.receive() }.try() }\n");
+    wrenpp::Method receiveError = receiver.method("main", "receiveError", "call(_)");
+    assert(channel.trySendMessage(std::string("\x02l\x05", 3u)));
+    assert(receiveError.call<std::string>(&channel).find("truncated") != std::string::npos);
+    wrenpp::VM objects;
+    bindVectorModule(objects);
+    objects.executeString("import \"vector\" for Vec3\nvar vectors = [Vec3.new(1, 2, 3)]\n");
+    wrenpp::Serializer serializer{objects};
+    serializer.registerForeign<Vec3>(
+        "Vec3",
+        [](const Vec3&) { return std::string(); },
+        [](const std::string&) { return Vec3{0.f, 0.f, 0.f}; });
+    assert(channel.trySendMessage(serializer.serialize("main", "vectors")));
+    assert(receiveError.call<std::string>(&channel).find("Vec3") != std::string::npos);
+    assert(channel.empty());
+
+    // the host drains a VM's inbound channels in batches
+    wrenpp::Channel inbox{16u};
+    wrenpp::VM listener;
+    assert(wrenpp::bindChannels(listener) == wrenpp::Result::Success);
+    listener.executeString(
+        "var total = 0\n"
+        "var onMessage = Fn.new { |message| total = total + message }\n"
+        "var getTotal = Fn.new { total }\n");
+    listener.listen(inbox, "main", "onMessage");
+    for (int i = 1; i <= 10; ++i)
+    {
+        assert(inbox.trySend(double(i)));
+    }
+    assert(listener.drainChannels(4u) == 4u);
+    assert(listener.drainChannels() == 6u);
+    assert(listener.drainChannels() == 0u);
+    assert(listener.method("main", "getTotal", "call()").call<int>() == 55);
+
+    // a message which can't be read is reported and dropped
+    assert(inbox.trySendMessage("corrupt"));
+    assert(inbox.trySend(1.0));
+    wrenpp::VM::errorFn = [](WrenErrorType, const char*, int, const char*) {};
+    assert(listener.drainChannels() == 1u);
+    wrenpp::VM::errorFn = errorFn;
+    assert(listener.method("main", "getTotal", "call()").call<int>() == 56);
+}
+
+void testSerializer()
+{
+    wrenpp::VM source;
+    bindVectorModule(source);
+    source.executeString(
+        "import \"vector\" for Vec3\n"
+        "var state = [1, -2.5, \"three\", true, null, {\"nested\": [4, {}], 5: false}]\n"
+        "state.add(Vec3.new(1, 2, 3))\n"
+        "state.add(state)\n"
+        "var deep = []\n"
+        "var inner = deep\n"
+        "for (i in 0...2000) {\n"
+        "  inner.add([])\n"
+        "  inner = inner[0]\n"
+        "}\n"
+        "var shared = [1, 2]\n"
+        "var dag = [shared, {\"a\": shared}, shared]\n"
+        "var diamond = []\n"
+        "for (i in 0...64) diamond = [diamond, diamond]\n"
+        "var unsupported = [Fn.new {}]\n"
+        "var half = 0.5\n"
+        "class Aborts {\n"
+        "  construct new() {}\n"
+        "  type { Fiber.abort(\"no type\") }\n"
+        "}\n"
+        "var aborts = [[1], {\"a\": 2}, Aborts.new()]\n"
+        // serializing leaves the values as they were
+        "var unchanged = Fn.new {\n"
+        "  return state.count == 8 && state[5].count == 2 && shared.count == 2 &&\n"
+        "    dag[1].count == 1 && aborts.count == 3 && aborts[0].count == 1 &&\n"
+        "    aborts[1].count == 1\n"
+        "}\n");
+    wrenpp::Serializer serializer{source};
+    const auto saveVec3 = [](const Vec3& v) {
+        return std::string(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    const auto loadVec3 = [](const std::string& bytes) {
+        Vec3 v{0.f, 0.f, 0.f};
+        std::memcpy(&v, bytes.data(), sizeof(v));
+        return v;
+    };
+    serializer.registerForeign<Vec3>("Vec3", saveVec3, loadVec3);
+    const std::string state = serializer.serialize("main", "state");
+    const std::string deep = serializer.serialize("main", "deep");
+    const std::string dag = serializer.serialize("main", "dag");
+    // each list is written once, however many times it's referenced
+    const std::string diamond = serializer.serialize("main", "diamond");
+    assert(diamond.size() < 64u * 8u);
+    // doubles are little-endian on any host
+    const std::string half("\x02" "d" "\0\0\0\0\0\0\xe0\x3f", 10u);
+    assert(serializer.serialize("main", "half") == half);
+
+    bool threw = false;
+    try
+    {
+        serializer.serialize("main", "unsupported");
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    assert(threw);
+
+    // a walk which aborts leaves no marks behind
+    const wrenpp::ErrorFn errorFn = wrenpp::VM::errorFn;
+    wrenpp::VM::errorFn = [](WrenErrorType, const char*, int, const char*) {};
+    threw = false;
+    try
+    {
+        serializer.serialize("main", "aborts");
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    wrenpp::VM::errorFn = errorFn;
+    assert(threw);
+    assert(source.method("main", "unchanged", "call()").call<bool>());
+
+    // the bytes are rebuilt in another VM
+    wrenpp::VM target;
+    bindVectorModule(target);
+    target.executeString(
+        "import \"vector\" for Vec3\n"
+        "var checkState = Fn.new { |s|\n"
+        "  return s.count == 8 && s[0] == 1 && s[1] == -2.5 && s[2] == \"three\" &&\n"
+        "    s[3] == true && s[4] == null && s[5][\"nested\"][0] == 4 &&\n"
+        "    s[5][\"nested\"][1].count == 0 && s[5][5] == false &&\n"
+        "    s[6] is Vec3 && s[6].z == 3 && Object.same(s[7], s)\n"
+        "}\n"
+        "var checkDag = Fn.new { |d|\n"
+        "  return d.count == 3 && d[0].count == 2 && Object.same(d[0], d[1][\"a\"]) &&\n"
+        "    Object.same(d[0], d[2])\n"
+        "}\n"
+        "var depth = Fn.new { |list|\n"
+        "  var n = 0\n"
+        "  while (list.count > 0) {\n"
+        "    list = list[0]\n"
+        "    n = n + 1\n"
+        "  }\n"
+        "  return n\n"
+        "}\n");
+    wrenpp::Serializer deserializer{target};
+    deserializer.registerForeign<Vec3>("Vec3", saveVec3, loadVec3);
+    WrenHandle* rebuilt = deserializer.deserialize(state);
+    assert(target.method("main", "checkState", "call(_)").call<bool>(rebuilt));
+    wrenReleaseHandle(target, rebuilt);
+    rebuilt = deserializer.deserialize(deep);
+    assert(target.method("main", "depth", "call(_)").call<int>(rebuilt) == 2000);
+    wrenReleaseHandle(target, rebuilt);
+    rebuilt = deserializer.deserialize(dag);
+    assert(target.method("main", "checkDag", "call(_)").call<bool>(rebuilt));
+    wrenReleaseHandle(target, rebuilt);
+    rebuilt = deserializer.deserialize(diamond);
+    assert(target.method("main", "depth", "call(_)").call<int>(rebuilt) == 64);
+    wrenReleaseHandle(target, rebuilt);
+
+    threw = false;
+    try
+    {
+        deserializer.deserialize(state.substr(0u, state.size() / 2u));
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    assert(threw);
+}
+
 int main()
 {
 
@@ -195,6 +1806,10 @@ int main()
 
     testClassMethods();
 
+    std::printf("\nTesting returning foreign objects from several VMs...\n\n");
+
+    testClassHandlesPerVM();
+
     std::printf("\nTesting properties...\n\n");
 
     testProperties();
@@ -203,9 +1818,101 @@ int main()
 
     testReturnValues();
 
+    std::printf("\nTesting copying and moving values...\n\n");
+
+    testValues();
+
+    std::printf("\nTesting typed method calls...\n\n");
+
+    testTypedCalls();
+
+    std::printf("\nTesting that foreign values aren't copied needlessly...\n\n");
+
+    testForeignValueCopies();
+
+    std::printf("\nTesting batched method calls...\n\n");
+
+    testBatchedCalls();
+
     std::printf("\nTesting to see if passing string to C++ works...\n\n");
 
     testStrings();
 
+    std::printf("\nTesting passing containers to and from C++...\n\n");
+
+    testContainers();
+
+    std::printf("\nTesting typed arrays...\n\n");
+
+    testTypedArrays();
+
+    std::printf("\nTesting finalizers...\n\n");
+
+    testFinalizers();
+
+    std::printf("\nTesting sharing foreign objects with C++...\n\n");
+
+    testSharedForeignObjects();
+
+    std::printf("\nTesting that bound signatures never collide...\n\n");
+
+    testSignatureCollisions();
+
+    std::printf("\nTesting per-VM configuration...\n\n");
+
+    testConfig();
+
+    std::printf("\nTesting heap statistics...\n\n");
+
+    testHeapStats();
+
+    std::printf("\nTesting binding profiling...\n\n");
+
+    testBindingProfile();
+
+    std::printf("\nTesting the fiber scheduler...\n\n");
+
+    testFiberScheduler();
+
+    std::printf("\nTesting idle garbage collection...\n\n");
+
+    testGcScheduler();
+
+    std::printf("\nTesting the module loader...\n\n");
+
+    testModuleLoader();
+
+    std::printf("\nTesting module bundles...\n\n");
+
+    testModuleBundle();
+
+    std::printf("\nTesting the pool allocator...\n\n");
+
+    testPoolAllocator();
+
+    std::printf("\nTesting binding classes from several threads...\n\n");
+
+    testBindingAcrossThreads();
+
+    std::printf("\nTesting the executor...\n\n");
+
+    testExecutor();
+
+    std::printf("\nTesting the VM pool...\n\n");
+
+    testVMPool();
+
+    std::printf("\nTesting shared buffers...\n\n");
+
+    testSharedBuffers();
+
+    std::printf("\nTesting channels...\n\n");
+
+    testChannels();
+
+    std::printf("\nTesting the serializer...\n\n");
+
+    testSerializer();
+
     return 0;
 }
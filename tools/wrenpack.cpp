@@ -0,0 +1,149 @@
+#include "Wren++.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Packs Wren modules into a single bundle, for wrenpp::ModuleBundle.
+ *
+ *   wrenpack [-C directory] [--cpp symbol] -o output file.wren...
+ *
+ * Each file is read from the directory, and named after its path relative to it, without the
+ * .wren extension, so that "-C scripts lib/math.wren" is imported as "lib/math". With --cpp, the
+ * output is a C++ source file defining the bundle as a byte array `symbol`, and its size as
+ * `symbolSize`, to be compiled into the program.
+ */
+
+namespace
+{
+
+void usage()
+{
+    std::fprintf(stderr, "usage: wrenpack [-C directory] [--cpp symbol] -o output file.wren...\n");
+}
+
+std::string readFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("could not read " + path);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+std::string moduleName(const std::string& file)
+{
+    const std::string extension = ".wren";
+    if (file.size() > extension.size() &&
+        file.compare(file.size() - extension.size(), extension.size(), extension) == 0)
+    {
+        return file.substr(0u, file.size() - extension.size());
+    }
+    return file;
+}
+
+void writeBinary(const std::string& path, const std::string& bundle)
+{
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    out.write(bundle.data(), std::streamsize(bundle.size()));
+    if (!out)
+    {
+        throw std::runtime_error("could not write " + path);
+    }
+}
+
+void writeCpp(const std::string& path, const std::string& bundle, const std::string& symbol)
+{
+    std::ofstream out(path, std::ios::out);
+    out << "// Generated by wrenpack, do not edit.\n"
+        << "#include <cstddef>\n\n"
+        << "alignas(4) extern const unsigned char " << symbol << "[] = {";
+    for (std::size_t i = 0u; i < bundle.size(); ++i)
+    {
+        out << (i % 16u == 0u ? "\n    " : " ") << unsigned(static_cast<unsigned char>(bundle[i]))
+            << ",";
+    }
+    out << "\n};\n\n"
+        << "extern const std::size_t " << symbol << "Size = sizeof(" << symbol << ");\n";
+    if (!out)
+    {
+        throw std::runtime_error("could not write " + path);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string directory;
+    std::string symbol;
+    std::string output;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "-C") == 0 && hasValue)
+        {
+            directory = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--cpp") == 0 && hasValue)
+        {
+            symbol = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "-o") == 0 && hasValue)
+        {
+            output = argv[++i];
+        }
+        else if (argv[i][0] == '-')
+        {
+            usage();
+            return 1;
+        }
+        else
+        {
+            files.push_back(argv[i]);
+        }
+    }
+    if (output.empty() || files.empty())
+    {
+        usage();
+        return 1;
+    }
+    if (!directory.empty() && directory.back() != '/')
+    {
+        directory += '/';
+    }
+
+    try
+    {
+        std::vector<std::pair<std::string, std::string>> modules;
+        for (const std::string& file : files)
+        {
+            modules.emplace_back(moduleName(file), readFile(directory + file));
+        }
+        const std::string bundle = wrenpp::ModuleBundle::pack(modules);
+        if (symbol.empty())
+        {
+            writeBinary(output, bundle);
+        }
+        else
+        {
+            writeCpp(output, bundle, symbol);
+        }
+        std::printf("packed %zu modules into %s\n", modules.size(), output.c_str());
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "wrenpack: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}